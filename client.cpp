@@ -8,27 +8,229 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "latencyHistogram.cpp"
+#include "loadReport.cpp"
+#include "workload.cpp"
+
+#define LATESTART 1000 //Microseconds behind schedule an open-loop request may start before it counts as late
+#define SCHEDULESEED 1 //Seeds Poisson schedules, so runs at the same rate send on the same schedule
+#define LOADREADSIZE 262144 //The bytes an epoll load thread reads at once; bodies are discarded
+#define LOADHEADERMAX 8192 //The most of a response header an epoll load thread keeps to frame it
+#define LOADEVENTS 256 //The epoll events an epoll load thread handles per wakeup
+#define LOADTIMEOUT 5000 //Milliseconds an epoll load thread waits with no progress before failing what is outstanding
+#define COMPAREDEPTH 8 //The pipeline depth a mode comparison uses when none is given
+#define GENERATORINTERVAL 1000 //Milliseconds per row of a multi-process run's time series when none is given
+#define REPORTGRACE 20 //Milliseconds after an interval ends before the coordinator prints it
 
 using namespace std;
 
 struct workerThreadStruct
 {
 	int loopLimit;
+	int requestsPerConnection;
+	
+	///Requests written ahead of their responses on a keep-alive connection
+	int pipelineDepth;
 	int port;
 	int* runningThreads;
 	char* file;
 	const char* host;
+	
+	///Whether each response is printed as it arrives
+	bool echoBodies;
+	
+	///Chooses each request's file instead of file, or NULL
+	Workload* workload;
+	
+	///Where a generator process counts each interval's responses, or NULL when running alone
+	LoadReport* report;
+	
+	///This generator's number, and how many share the schedule
+	int generator;
+	int generators;
+	
+	///Each request's send time in nanoseconds after scheduleStart, or NULL to run closed-loop
+	long* schedule;
+	
+	///The number of requests in the schedule
+	long scheduled;
+	
+	///The next request of the schedule to claim
+	long* nextRequest;
+	
+	///When the schedule started, on CLOCK_MONOTONIC
+	struct timespec scheduleStart;
+	
+	///Whether closed-loop workers stop at the deadline rather than after loopLimit requests
+	bool timed;
+	
+	///When a timed run stops starting requests, on CLOCK_MONOTONIC
+	struct timespec deadline;
+	
 	pthread_cond_t *finishedCondition;
 	pthread_mutex_t *finishedLock;
 	sockaddr_in* sockAddress;
 };
 
+/**
+ * @brief One simulated user of an epoll load thread
+ */
+struct loadConnection
+{
+	///The states of a request
+	enum {IDLE, CONNECTING, SENDING, READING};
+	
+	int sockfd;
+	
+	int state;
+	
+	///Requests this user still has to make, including the current one
+	int loopsLeft;
+	
+	///Requests made on the current connection
+	int used;
+	
+	///The request and how much of it has been sent
+	string request;
+	size_t requestSent;
+	
+	///The header of the response so far, until it is complete
+	string header;
+	
+	///The response bytes received
+	long received;
+	
+	///The size of the whole response, or -1 until its header gives a length
+	long expected;
+	
+	///Whether the response says the server will close the connection
+	bool serverClosing;
+	
+	///When the request was sent
+	struct timeval sent;
+};
+
+/**
+ * @brief The work handed to an epoll load thread
+ */
+struct loadThreadStruct
+{
+	workerThreadStruct* data;
+	
+	///The simulated users this thread drives
+	int users;
+};
+
 struct threadReturn
 {
 	int error;
 	long recv;
+	long connections;
+	long responses;
+	long firstByteTotal;
+	long firstByteMax;
+	
+	///Response times, from the intended send time in open-loop runs
+	LatencyHistogram* latencies;
+	
+	///Open-loop requests sent more than LATESTART after their intended time
+	long lateStarts;
+	
+	///The thread's erand48 state for picking workload files
+	unsigned short fileSeed[3];
+};
+
+/**
+ * @brief The totals of one run of runWorkerThreads
+ */
+struct runResult
+{
+	///Wall time in microseconds
+	long micros;
+	int errors;
+	long connections;
+	long bytes;
+	
+	///The responses timed
+	long completed;
+	
+	long p50;
+	long p99;
 };
 
+/**
+ * @brief The microseconds since a time
+ */
+static long microsSince(const struct timeval& since)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since.tv_sec) * 1000000 + (now.tv_usec - since.tv_usec);
+}
+
+/**
+ * @brief Counts a response's time to first byte
+ */
+static void recordFirstByte(threadReturn* retn, long micros)
+{
+	retn->responses++;
+	retn->firstByteTotal += micros;
+	retn->firstByteMax = max(retn->firstByteMax, micros);
+}
+
+/**
+ * @brief Checks whether a timed run should stop starting requests
+ */
+static bool pastDeadline(workerThreadStruct* data)
+{
+	if(!data->timed) return false;
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > data->deadline.tv_sec || (now.tv_sec == data->deadline.tv_sec && now.tv_nsec >= data->deadline.tv_nsec);
+}
+
+/**
+ * @brief Counts a whole response, and reports it to the coordinator when there is one
+ */
+static void recordResponse(workerThreadStruct* data, threadReturn* retn, long micros, long bytes)
+{
+	retn->latencies->record(micros);
+	if(data->report)
+		data->report->recordResponse(micros, bytes);
+}
+
+/**
+ * @brief Counts failed requests, and reports them to the coordinator when there is one
+ */
+static void recordErrors(workerThreadStruct* data, threadReturn* retn, long count)
+{
+	retn->error += count;
+	if(data->report)
+		data->report->recordErrors(count);
+}
+
+/**
+ * @brief The microseconds since a time on CLOCK_MONOTONIC
+ */
+static long microsSince(const struct timespec& since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since.tv_sec) * 1000000 + (now.tv_nsec - since.tv_nsec) / 1000;
+}
+
 /**
  * @brief Allows for connection to and requesting pages from an HTTP Server
  */
@@ -47,6 +249,61 @@ class client
 	///The number of threads that have been initialized
 	int runningThreads;
 	
+	///Requests per second to send on a schedule, or 0 to send each as soon as the last finishes
+	double openLoopRate;
+	
+	///Whether open-loop requests arrive as a Poisson process rather than evenly spaced
+	bool poissonArrivals;
+	
+	///The epoll threads that drive the connections, or 0 for a blocking thread per connection
+	int loadThreads;
+	
+	///Requests written ahead of their responses on each keep-alive connection
+	int pipelineDepth;
+	
+	///Chooses each request's file, or NULL to always request the file given
+	Workload* workload;
+	
+	///Seconds a closed-loop run lasts, or 0 to run each thread's loops
+	double runSeconds;
+	
+	///The report this process counts into as one of several generators, or NULL
+	LoadReport* report;
+	
+	///Whether the blocking per-request workers print each response
+	bool echoBodies;
+	
+	///Whether response bodies and the run summary are left unprinted
+	bool quiet;
+	
+	///This process's number among the generators, and how many there are
+	int generator;
+	int generators;
+	
+	/**
+	 * @brief Lays out when each open-loop request should be sent
+	 * 
+	 * @param count The number of requests
+	 * @return Nanoseconds after the start for each request, in order
+	 */
+	long* buildSchedule(long count)
+	{
+		long* schedule = new long[count];
+		double interval = 1e9 / openLoopRate;
+		double at = 0;
+		
+		unsigned short seed[3] = {SCHEDULESEED, 0, 0};
+		for(long i = 0; i < count; i++)
+		{
+			schedule[i] = (long)at;
+			
+			//Exponential gaps between requests make their arrivals a Poisson process
+			at += poissonArrivals ? -log(1 - erand48(seed)) * interval : interval;
+		}
+		
+		return schedule;
+	}
+	
 	public:
 	
 	/**
@@ -57,32 +314,370 @@ class client
 	client(int remotePort)
 	{
 		port = remotePort;
+		openLoopRate = 0;
+		poissonArrivals = false;
+		loadThreads = 0;
+		pipelineDepth = 1;
+		workload = NULL;
+		runSeconds = 0;
+		report = NULL;
+		echoBodies = true;
+		quiet = false;
+		generator = 0;
+		generators = 1;
 		
 		pthread_mutex_init(&finishedLock, NULL);
 		pthread_cond_init(&finishedCondition, NULL);
 	}
 	
+	/**
+	 * @brief Sends requests on a fixed schedule instead of as fast as responses come back
+	 * 
+	 * @param rate Requests per second across all threads
+	 * @param poisson Whether gaps between requests are random with that mean rather than fixed
+	 * 
+	 * @note Each thread claims the next request in the schedule and waits for
+	 * its time, so the threads bound how many requests can be outstanding. A
+	 * request's latency is measured from when it should have been sent, so a
+	 * slow server's queueing shows up even when every thread is stuck waiting
+	 * on it instead of hiding as fewer requests sent.
+	 */
+	void setOpenLoop(double rate, bool poisson)
+	{
+		openLoopRate = rate;
+		poissonArrivals = poisson;
+	}
+	
+	/**
+	 * @brief Drives the connections from a few epoll threads instead of a blocking thread each
+	 * 
+	 * @param threads The number of epoll threads
+	 * 
+	 * @note The thread count given to runWorkerThreads becomes the number of
+	 * concurrent connections, spread over these threads. Each connection is
+	 * non-blocking and makes its loops of requests one after another. Bodies
+	 * are read in large chunks and discarded rather than echoed.
+	 */
+	void setEpollEngine(int threads)
+	{
+		loadThreads = threads;
+	}
+	
+	/**
+	 * @brief Writes up to depth requests on a keep-alive connection before reading their responses
+	 * 
+	 * @param depth The most requests outstanding on a connection, 1 to wait for each response
+	 * 
+	 * @note Only the closed-loop blocking workers pipeline; open-loop and epoll
+	 * runs send one request at a time on each connection.
+	 */
+	void setPipelineDepth(int depth)
+	{
+		pipelineDepth = max(depth, 1);
+	}
+	
+	/**
+	 * @brief Runs closed-loop threads for a fixed time instead of a fixed number of loops
+	 * 
+	 * @param seconds How long the threads keep starting requests, or 0 to count loops
+	 * 
+	 * @note Requests already sent when the time is up are still answered and
+	 * counted. Only the blocking closed-loop workers are timed; open-loop,
+	 * replay and epoll runs still run their schedules or loops.
+	 */
+	void setDuration(double seconds)
+	{
+		runSeconds = seconds;
+	}
+	
+	/**
+	 * @brief Chooses whether the per-request workers print each response they receive
+	 */
+	void setEchoBodies(bool echo)
+	{
+		echoBodies = echo;
+	}
+	
+	/**
+	 * @brief Stops the client printing response bodies and the summary of each run
+	 * 
+	 * @note For callers that only use the runResult, such as testSuite.
+	 * Nothing is printed from the worker threads, so the caller's cout is
+	 * left alone.
+	 */
+	void setQuiet(bool silent)
+	{
+		quiet = silent;
+	}
+	
+	/**
+	 * @brief Picks each request's file from a mix or an access log instead of using the file given
+	 * 
+	 * @param mix The files to request, which the caller keeps until the runs finish
+	 * 
+	 * @note A replayed log sets its own schedule: every logged request is sent
+	 * once, at its original offset from the first, open-loop. The thread count
+	 * caps how many are outstanding and the loop count is ignored.
+	 */
+	void setWorkload(Workload* mix)
+	{
+		workload = mix;
+	}
+	
+	/**
+	 * @brief Runs the same load per-request, keep-alive and pipelined, and prints the three side by side
+	 * 
+	 * @param requestsPerConnection How many requests share a connection in the keep-alive and pipelined runs
+	 * @param depth The pipeline depth of the pipelined run
+	 * 
+	 * @note The runs go one after another against the same server or proxy, so
+	 * the table shows what reusing and pipelining connections buy end to end.
+	 */
+	void compareConnectionModes(char* dest, char* file, int threadCount, int loopLimit, const char* host, int requestsPerConnection, int depth)
+	{
+		const char* modes[3] = {"per-request", "keep-alive", "pipelined"};
+		int reuse[3] = {1, requestsPerConnection, requestsPerConnection};
+		int depths[3] = {1, 1, depth};
+		runResult results[3];
+		
+		int savedDepth = pipelineDepth;
+		for(int i = 0; i < 3; i++)
+		{
+			cout << "--- " << modes[i] << " ---" << endl;
+			pipelineDepth = depths[i];
+			results[i] = runWorkerThreads(dest, file, threadCount, loopLimit, host, reuse[i]);
+		}
+		pipelineDepth = savedDepth;
+		
+		cout << "Mode\t\tReq/s\tp50 us\tp99 us\tConnections\tErrors" << endl;
+		for(int i = 0; i < 3; i++)
+		{
+			string label = modes[i];
+			if(i > 0)
+				label += " (" + to_string(reuse[i]) + (i == 2 ? ", depth " + to_string(depths[i]) : "") + ")";
+			
+			cout << label << (label.length() < 16 ? "\t\t" : "\t") << (long)(results[i].micros ? results[i].completed * 1000000.0 / results[i].micros : 0) << "\t" << results[i].p50 << "\t" << results[i].p99 << "\t" << results[i].connections << "\t\t" << results[i].errors << endl;
+		}
+	}
+	
+	/**
+	 * @brief Forks generator processes that run the load together, and prints their combined results as a time series
+	 * 
+	 * @param processes The generator processes, each pinned to its own CPU while there are enough
+	 * @param intervalMillis The length of each row of the time series
+	 * 
+	 * @note Closed-loop, every generator runs the whole load of threadCount
+	 * threads, so the total is processes times larger. Open-loop schedules and
+	 * replays are shared out instead: each generator takes every processes-th
+	 * request, so together they send at the rate asked for. The generators'
+	 * own output is discarded. The coordinator prints a row per interval while
+	 * they run, then each generator's totals and the combined latencies.
+	 */
+	void runGenerators(char* dest, char* file, int threadCount, int loopLimit, const char* host, int requestsPerConnection, int processes, int intervalMillis)
+	{
+		processes = min(processes, REPORTMAXPROCS);
+		LoadReport* shared = LoadReport::create(processes, intervalMillis);
+		if(shared == NULL)
+		{
+			cout << "Couldn't map the load report" << endl;
+			return;
+		}
+		
+		//Generators are spread over the CPUs this process may use
+		cpu_set_t allowed;
+		sched_getaffinity(0, sizeof(allowed), &allowed);
+		int cpus[CPU_SETSIZE];
+		int cpuCount = 0;
+		for(int i = 0; i < CPU_SETSIZE; i++)
+			if(CPU_ISSET(i, &allowed))
+				cpus[cpuCount++] = i;
+		
+		//Anything still buffered would otherwise be printed again by each generator
+		cout.flush();
+		
+		int launched = 0;
+		for(; launched < processes; launched++)
+		{
+			int cpu = cpus[launched % cpuCount];
+			pid_t pid = fork();
+			if(pid < 0)
+			{
+				cout << "Only " << launched << " generators could be started" << endl;
+				break;
+			}
+			
+			if(pid == 0)
+			{
+				cpu_set_t pinned;
+				CPU_ZERO(&pinned);
+				CPU_SET(cpu, &pinned);
+				sched_setaffinity(0, sizeof(pinned), &pinned);
+				
+				if(freopen("/dev/null", "w", stdout) == NULL)
+					_exit(1);
+				
+				report = shared;
+				generator = launched;
+				generators = processes;
+				runResult result = runWorkerThreads(dest, file, threadCount, loopLimit, host, requestsPerConnection);
+				
+				generatorTotals& totals = shared->totals[launched];
+				totals.micros = result.micros;
+				totals.errors = result.errors;
+				totals.bytes = result.bytes;
+				totals.connections = result.connections;
+				totals.completed = result.completed;
+				__atomic_store_n(&totals.finished, 1, __ATOMIC_RELEASE);
+				
+				_exit(0);
+			}
+			
+			shared->totals[launched].pid = pid;
+			shared->totals[launched].cpu = cpu;
+		}
+		
+		//Start once every generator that is still alive has its threads ready
+		int alive = launched;
+		while(!shared->waitForArrivals(alive))
+			while(waitpid(-1, NULL, WNOHANG) > 0)
+				alive--;
+		shared->release();
+		
+		cout << "Generators: " << launched << " processes\t" << threadCount << (loadThreads > 0 ? " connections" : " threads") << " each\t" << "interval " << intervalMillis << " ms" << endl;
+		cout << "Time s\tReq/s\tMB/s\tErrors\tp50 us\tp99 us\tmax us" << endl;
+		
+		//Each interval is printed once it has passed, with a little grace for responses being counted
+		//Once the table is full the last interval collects the rest, but the generators are still checked once an interval
+		int printed = 0;
+		int running = alive;
+		for(long tick = 1; running > 0; tick++)
+		{
+			struct timespec due = shared->start;
+			long offset = tick * shared->intervalNanos + REPORTGRACE * 1000000L;
+			due.tv_sec += offset / 1000000000;
+			due.tv_nsec += offset % 1000000000;
+			if(due.tv_nsec >= 1000000000)
+			{
+				due.tv_sec++;
+				due.tv_nsec -= 1000000000;
+			}
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+			
+			while(running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+				running--;
+			
+			if(running > 0 && printed < REPORTINTERVALS - 1)
+				printInterval(shared, printed++, shared->intervalNanos);
+		}
+		
+		//The run lasted as long as its slowest generator
+		long longest = 0;
+		for(int i = 0; i < launched; i++)
+			if(__atomic_load_n(&shared->totals[i].finished, __ATOMIC_ACQUIRE))
+				longest = max(longest, shared->totals[i].micros);
+		
+		//The rest, the last of them cut short by the end of the run
+		long ran = longest * 1000;
+		int last = min((int)(max(ran - 1, 0L) / shared->intervalNanos), REPORTINTERVALS - 1);
+		for(; printed <= last; printed++)
+			printInterval(shared, printed, min(shared->intervalNanos, ran - printed * shared->intervalNanos));
+		
+		LatencyHistogram latencies;
+		for(int i = 0; i < REPORTINTERVALS; i++)
+			if(shared->intervals[i].requests > 0)
+				latencies.merge(shared->intervals[i].latencies);
+		
+		long errors = 0;
+		long bytes = 0;
+		long connections = 0;
+		for(int i = 0; i < launched; i++)
+		{
+			generatorTotals& totals = shared->totals[i];
+			if(!__atomic_load_n(&totals.finished, __ATOMIC_ACQUIRE))
+			{
+				cout << "Generator " << i << " (pid " << totals.pid << ", cpu " << totals.cpu << "): did not finish" << endl;
+				continue;
+			}
+			
+			cout << "Generator " << i << " (pid " << totals.pid << ", cpu " << totals.cpu << "): " << totals.micros << " us\t" << "responses: " << totals.completed << "\t" << "errors: " << totals.errors << "\t" << "bytes: " << totals.bytes << "\t" << "connections: " << totals.connections << endl;
+			
+			errors += totals.errors;
+			bytes += totals.bytes;
+			connections += totals.connections;
+		}
+		
+		cout << longest << "\t" << errors << endl;
+		cout << "Bytes transferred: " << bytes << "\t" << "Connections: " << connections << "\t" << "Aggregate: " << (longest ? latencies.count() * 1000000.0 / longest : 0) << " req/s" << endl;
+		latencies.print("Latency");
+		
+		LoadReport::destroy(shared);
+	}
+	
+	/**
+	 * @brief Prints one row of a generator run's time series
+	 * 
+	 * @param length The nanoseconds the interval covered, less than a whole one at the end of the run
+	 */
+	static void printInterval(LoadReport* shared, int index, long length)
+	{
+		reportInterval& row = shared->intervals[index];
+		double seconds = max(length, 1L) / 1e9;
+		
+		//Copied so the percentiles come from one consistent set of counts
+		LatencyHistogram latencies = row.latencies;
+		
+		cout << (index + 1) * shared->intervalNanos / 1e9 << "\t" << (long)(row.requests / seconds) << "\t" << row.bytes / seconds / 1048576 << "\t" << row.errors << "\t" << latencies.valueAt(50) << "\t" << latencies.valueAt(99) << "\t" << latencies.maximum() << endl;
+	}
+	
 	/**
 	 * @brief the main thread that will spawn worker threads
 	 * to connect to the HTTP server
 	 * 
 	 * @param The address of the server you are connecting to
-	 * @param threadCount The number of threads to spawn
+	 * @param threadCount The number of threads to spawn, or of connections with the epoll engine
 	 * @param loopLimit How many times each worker thread will run
 	 * @param The host a proxy should redirect to
+	 * @param requestsPerConnection How many requests share a keep-alive connection, or 1 for a connection per request
+	 * @return The run's totals, which have also been printed unless the client is quiet
 	 */
-	void runWorkerThreads(char* dest, char* file, int threadCount, int loopLimit, const char* host)
+	runResult runWorkerThreads(char* dest, char* file, int threadCount, int loopLimit, const char* host, int requestsPerConnection = 1)
 	{
-		pthread_t workerThreads[threadCount];
+		//The epoll engine spreads the connections over its own threads
+		int spawnCount = loadThreads > 0 ? min(loadThreads, threadCount) : threadCount;
+		pthread_t workerThreads[spawnCount];
+		loadThreadStruct loadData[spawnCount];
 		
 		workerThreadStruct wrkData;
 		wrkData.port = port;
-		wrkData.loopLimit = loopLimit;
+		//A timed run's threads go until the deadline instead of counting loops
+		wrkData.timed = runSeconds > 0 && loadThreads == 0 && openLoopRate == 0 && !(workload && workload->isReplay());
+		wrkData.loopLimit = wrkData.timed ? INT_MAX : loopLimit;
+		wrkData.requestsPerConnection = requestsPerConnection;
+		wrkData.pipelineDepth = pipelineDepth;
 		wrkData.runningThreads = &runningThreads;
 		wrkData.file = file;
 		wrkData.host = host;
+		wrkData.echoBodies = echoBodies && !quiet;
 		wrkData.finishedCondition = &finishedCondition;
 		wrkData.finishedLock = &finishedLock;
+		
+		long nextRequest = 0;
+		wrkData.workload = workload;
+		wrkData.report = report;
+		wrkData.generator = generator;
+		wrkData.generators = generators;
+		
+		if(workload && workload->isReplay())
+		{
+			wrkData.schedule = workload->buildSchedule();
+			wrkData.scheduled = workload->size();
+		}
+		else
+		{
+			wrkData.schedule = openLoopRate > 0 ? buildSchedule((long)threadCount * loopLimit) : NULL;
+			wrkData.scheduled = (long)threadCount * loopLimit;
+		}
+		wrkData.nextRequest = &nextRequest;
 
 		hostent *server = gethostbyname(dest);
 		
@@ -101,25 +696,53 @@ class client
 		
 		runningThreads = 0;
 		
-		threadReturn* retn[threadCount];
+		threadReturn* retn[spawnCount];
 		
-		for(int i = 0; i < threadCount; i++)
+		for(int i = 0; i < spawnCount; i++)
 		{
 			workerThreads[i] = pthread_t();
-			pthread_create(&workerThreads[i], NULL, client::workerThread, &wrkData);
+			
+			if(loadThreads > 0)
+			{
+				loadData[i].data = &wrkData;
+				loadData[i].users = threadCount / spawnCount + (i < threadCount % spawnCount ? 1 : 0);
+				pthread_create(&workerThreads[i], NULL, client::epollLoadThread, &loadData[i]);
+			}
+			else
+				pthread_create(&workerThreads[i], NULL, client::workerThread, &wrkData);
 		}
 		
-		//spin wait for the threads
-		while(runningThreads < threadCount);
+		//spin wait for the threads; the load must not be hoisted out of the loop
+		while(__atomic_load_n(&runningThreads, __ATOMIC_ACQUIRE) < spawnCount);
+		
+		//Generators start together, and share the coordinator's schedule start
+		if(report)
+			report->arriveAndWait();
 		
 		//Start the timer
 		struct timeval start, end;
 		gettimeofday(&start, NULL);
+		if(report)
+			wrkData.scheduleStart = report->start;
+		else
+			clock_gettime(CLOCK_MONOTONIC, &wrkData.scheduleStart);
 		
+		wrkData.deadline = wrkData.scheduleStart;
+		wrkData.deadline.tv_sec += (long)runSeconds;
+		wrkData.deadline.tv_nsec += (long)((runSeconds - (long)runSeconds) * 1e9);
+		if(wrkData.deadline.tv_nsec >= 1000000000)
+		{
+			wrkData.deadline.tv_sec++;
+			wrkData.deadline.tv_nsec -= 1000000000;
+		}
+		
+		//Taking the lock makes sure every thread is waiting before the broadcast
+		pthread_mutex_lock(&finishedLock);
 		pthread_cond_broadcast(&finishedCondition);
+		pthread_mutex_unlock(&finishedLock);
 		
 		//rejoin
-		for(int i = 0; i < threadCount; i++)
+		for(int i = 0; i < spawnCount; i++)
 		{
 			pthread_join(workerThreads[i], (void**)&(retn[i]));
 		}
@@ -130,10 +753,24 @@ class client
 		//count disconnects
 		int errors = 0;
 		long bytesTransferred = 0;
-		for(int i = 0; i < threadCount; i++)
+		long connections = 0;
+		long responses = 0;
+		long firstByteTotal = 0;
+		long firstByteMax = 0;
+		long lateStarts = 0;
+		LatencyHistogram latencies;
+		for(int i = 0; i < spawnCount; i++)
 		{
+			latencies.merge(*retn[i]->latencies);
+			lateStarts += retn[i]->lateStarts;
+			delete retn[i]->latencies;
+			
 			errors += retn[i]->error;
 			bytesTransferred += retn[i]->recv;
+			connections += retn[i]->connections;
+			responses += retn[i]->responses;
+			firstByteTotal += retn[i]->firstByteTotal;
+			firstByteMax = max(firstByteMax, retn[i]->firstByteMax);
 			delete retn[i];
 		}
 		
@@ -142,9 +779,52 @@ class client
 
 		long mtime = (seconds) * 1000000 + useconds;
 		
-		cout << mtime << "\t" << errors << endl;
-		cout << "Bytes transferred: " << bytesTransferred << endl;
-
+		//A quiet run only returns its totals
+		if(!quiet)
+		{
+			cout << mtime << "\t" << errors << endl;
+			cout << "Bytes transferred: " << bytesTransferred << endl;
+			
+			if(requestsPerConnection > 1 && pipelineDepth > 1 && loadThreads == 0 && !wrkData.schedule)
+				cout << "Connection mode: pipelined (" << requestsPerConnection << " requests per connection, depth " << pipelineDepth << ")";
+			else if(requestsPerConnection > 1)
+				cout << "Connection mode: persistent (" << requestsPerConnection << " requests per connection)";
+			else
+				cout << "Connection mode: per-request";
+			if(loadThreads > 0)
+				cout << " (epoll, " << spawnCount << " threads for " << threadCount << " users)";
+			cout << "\t" << "Connections: " << connections << endl;
+			cout << "Time to first byte: avg " << (responses ? firstByteTotal / responses : 0) << " us\t" << "max " << firstByteMax << " us" << endl;
+			
+			if(workload)
+				workload->print();
+			
+			if(wrkData.schedule && workload && workload->isReplay())
+			{
+				cout << "Replay: achieved " << (mtime ? latencies.count() * 1000000.0 / mtime : 0) << " req/s\t" << "late starts: " << lateStarts << endl;
+				latencies.print("Latency from logged send");
+			}
+			else if(wrkData.schedule)
+			{
+				cout << "Open loop: target " << openLoopRate << " req/s (" << (poissonArrivals ? "poisson" : "constant") << ")\t" << "achieved " << (mtime ? latencies.count() * 1000000.0 / mtime : 0) << " req/s\t" << "late starts: " << lateStarts << endl;
+				latencies.print("Latency from intended send");
+			}
+			else
+				latencies.print("Latency");
+		}
+		
+		if(wrkData.schedule)
+			delete[] wrkData.schedule;
+		
+		runResult result;
+		result.micros = mtime;
+		result.errors = errors;
+		result.connections = connections;
+		result.bytes = bytesTransferred;
+		result.completed = latencies.count();
+		result.p50 = latencies.valueAt(50);
+		result.p99 = latencies.valueAt(99);
+		return result;
 	}
 	
 	/**
@@ -160,40 +840,48 @@ class client
 		
 		//Wait for permission to continue
 		pthread_mutex_lock(data->finishedLock);
-		(*data->runningThreads)++;
+		int startOrder = __atomic_fetch_add(data->runningThreads, 1, __ATOMIC_RELEASE);
 		pthread_cond_wait( data->finishedCondition, data->finishedLock );
 		pthread_mutex_unlock(data->finishedLock);
 		
 		threadReturn* retn = new threadReturn;
 		retn->error = 0;
 		retn->recv = 0;
+		retn->connections = 0;
+		retn->responses = 0;
+		retn->firstByteTotal = 0;
+		retn->firstByteMax = 0;
+		retn->latencies = new LatencyHistogram();
+		retn->lateStarts = 0;
+		retn->fileSeed[0] = WORKLOADSEED;
+		retn->fileSeed[1] = startOrder;
+		retn->fileSeed[2] = 0;
 		
-		for(int i = 0; i < data->loopLimit; i++)
+		if(data->schedule)
 		{
-	
-			int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+			runOpenLoop(data, retn);
+			pthread_exit(retn);
+		}
+		
+		for(int i = 0; i < data->loopLimit && !pastDeadline(data); i++)
+		{
+			int sockfd = openConnection(data, retn);
 			
-			int connected = connect(sockfd,(struct sockaddr *)data->sockAddress,sizeof(*(data->sockAddress)));
-			//EXPECT_EQ(connected, 0);
-
-		    struct timeval timeout;      
-			timeout.tv_sec = 5;
-			timeout.tv_usec = 0;
-
-			if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
-				sizeof(timeout)) < 0)
-				printf("setsockopt failed\n");
-
-			if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-			    	sizeof(timeout)) < 0)
-			    	printf("setsockopt failed\n");
-
+			if(data->requestsPerConnection > 1)
+			{
+				//Count every request made on this connection, the outer loop adds the last one
+				i += runPersistentConnection(sockfd, data, retn, data->loopLimit - i) - 1;
+				close(sockfd);
+				continue;
+			}
 				
-			string req = "GET " + string(data->file) + " HTTP/1.0\r\n";
+			string req = "GET " + requestFile(data, retn, i) + " HTTP/1.0\r\n";
 			if(data->host)
 				req += "Host: " + string(data->host) + "\r\n";
 			req += "\r\n";
 			
+			struct timeval sent;
+			gettimeofday(&sent, NULL);
 			int err = write(sockfd, req.c_str(), strlen(req.c_str()));
 			
 			//Read the response
@@ -203,6 +891,9 @@ class client
 			while(bytesRead > 0)
 			{
 				bytesRead = read(sockfd, &buffer, 255);
+				if(bytesRead > 0 && input.length() == 0)
+					recordFirstByte(retn, microsSince(sent));
+				
 				input += string(buffer, 0, bytesRead);
 				retn->recv += bytesRead;
 			}
@@ -211,17 +902,537 @@ class client
 			if(bytesRead < 0 || input.length() == 0)
 			{
 				//cout << "Errno: " << errno << endl;
-				retn->error++;
+				recordErrors(data, retn, 1);
 				close(sockfd);
 				//cout << "Was full" << endl;
 				continue;
 			}
 			
-			cout << input << endl;
+			recordResponse(data, retn, microsSince(sent), input.length());
+			
+			if(data->echoBodies)
+				cout << input << endl;
 			
 			close(sockfd);
 		}
 		
 		pthread_exit(retn);
 	}
+	
+	/**
+	 * @brief An epoll load thread: drives its users' connections until they have made all their requests
+	 * 
+	 * @param dataStruct The thread's loadThreadStruct
+	 */
+	static void *epollLoadThread(void* dataStruct)
+	{
+		loadThreadStruct* load = (loadThreadStruct*) dataStruct;
+		workerThreadStruct* data = load->data;
+		
+		//Wait for permission to continue
+		pthread_mutex_lock(data->finishedLock);
+		int startOrder = __atomic_fetch_add(data->runningThreads, 1, __ATOMIC_RELEASE);
+		pthread_cond_wait( data->finishedCondition, data->finishedLock );
+		pthread_mutex_unlock(data->finishedLock);
+		
+		threadReturn* retn = new threadReturn;
+		retn->error = 0;
+		retn->recv = 0;
+		retn->connections = 0;
+		retn->responses = 0;
+		retn->firstByteTotal = 0;
+		retn->firstByteMax = 0;
+		retn->latencies = new LatencyHistogram();
+		retn->lateStarts = 0;
+		retn->fileSeed[0] = WORKLOADSEED;
+		retn->fileSeed[1] = startOrder;
+		retn->fileSeed[2] = 0;
+		
+		int epollfd = epoll_create1(0);
+		char* buffer = new char[LOADREADSIZE];
+		loadConnection* users = new loadConnection[load->users];
+		int active = 0;
+		
+		for(int i = 0; i < load->users; i++)
+		{
+			users[i].sockfd = -1;
+			users[i].state = loadConnection::IDLE;
+			users[i].loopsLeft = data->loopLimit;
+			
+			if(users[i].loopsLeft > 0)
+			{
+				advanceConnection(epollfd, &users[i], data, retn, buffer);
+				if(users[i].loopsLeft > 0)
+					active++;
+			}
+		}
+		
+		struct epoll_event events[LOADEVENTS];
+		while(active > 0)
+		{
+			int ready = epoll_wait(epollfd, events, LOADEVENTS, LOADTIMEOUT);
+			if(ready < 0 && errno == EINTR) continue;
+			
+			//Nothing moved for the whole timeout, so give up on what is left
+			if(ready <= 0)
+			{
+				for(int i = 0; i < load->users; i++)
+					if(users[i].loopsLeft > 0)
+					{
+						recordErrors(data, retn, users[i].loopsLeft);
+						users[i].loopsLeft = 0;
+						close(users[i].sockfd);
+					}
+				break;
+			}
+			
+			for(int i = 0; i < ready; i++)
+			{
+				loadConnection* conn = (loadConnection*)events[i].data.ptr;
+				if(conn->loopsLeft == 0) continue;
+				
+				advanceConnection(epollfd, conn, data, retn, buffer);
+				if(conn->loopsLeft == 0)
+					active--;
+			}
+		}
+		
+		close(epollfd);
+		delete[] users;
+		delete[] buffer;
+		
+		pthread_exit(retn);
+	}
+	
+	/**
+	 * @brief Prepares a user's next request, on its open connection or a new non-blocking one
+	 * 
+	 * @return False if the connection failed at once
+	 */
+	static bool startRequest(int epollfd, loadConnection* conn, workerThreadStruct* data, threadReturn* retn)
+	{
+		bool persistent = data->requestsPerConnection > 1;
+		
+		if(conn->sockfd < 0)
+		{
+			conn->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			conn->used = 0;
+			retn->connections++;
+			
+			if(connect(conn->sockfd, (struct sockaddr *)data->sockAddress, sizeof(*(data->sockAddress))) < 0 && errno != EINPROGRESS)
+				return false;
+			
+			//Edge-triggered, so the connection is advanced until it would block each time it is woken
+			struct epoll_event event;
+			event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			event.data.ptr = conn;
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->sockfd, &event);
+			
+			conn->state = loadConnection::CONNECTING;
+		}
+		else
+			conn->state = loadConnection::SENDING;
+		
+		conn->used++;
+		
+		conn->request = "GET " + requestFile(data, retn, 0) + (persistent ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+		if(data->host)
+			conn->request += "Host: " + string(data->host) + "\r\n";
+		//Let the server close after the last request this connection will make
+		if(persistent && (conn->used == data->requestsPerConnection || conn->loopsLeft == 1))
+			conn->request += "Connection: close\r\n";
+		conn->request += "\r\n";
+		
+		conn->requestSent = 0;
+		conn->header.clear();
+		conn->received = 0;
+		conn->expected = -1;
+		conn->serverClosing = !persistent;
+		gettimeofday(&conn->sent, NULL);
+		
+		return true;
+	}
+	
+	/**
+	 * @brief Counts a finished request and leaves the user ready for its next one
+	 * 
+	 * @param succeeded Whether a whole response arrived
+	 */
+	static void finishRequest(loadConnection* conn, workerThreadStruct* data, threadReturn* retn, bool succeeded)
+	{
+		if(succeeded)
+		{
+			retn->recv += conn->received;
+			recordResponse(data, retn, microsSince(conn->sent), conn->received);
+		}
+		else
+			recordErrors(data, retn, 1);
+		
+		bool reuse = succeeded && !conn->serverClosing && conn->used < data->requestsPerConnection;
+		if(!reuse)
+		{
+			close(conn->sockfd);
+			conn->sockfd = -1;
+		}
+		
+		conn->loopsLeft--;
+		conn->state = loadConnection::IDLE;
+	}
+	
+	/**
+	 * @brief Moves a user's requests along until its socket would block or it has none left
+	 * 
+	 * @param buffer The thread's read buffer
+	 */
+	static void advanceConnection(int epollfd, loadConnection* conn, workerThreadStruct* data, threadReturn* retn, char* buffer)
+	{
+		while(conn->loopsLeft > 0)
+		{
+			if(conn->state == loadConnection::IDLE && !startRequest(epollfd, conn, data, retn))
+			{
+				finishRequest(conn, data, retn, false);
+				continue;
+			}
+			
+			if(conn->state == loadConnection::CONNECTING)
+			{
+				int error = 0;
+				socklen_t length = sizeof(error);
+				getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &length);
+				
+				//A connect still in progress reports no error; sending then waits for it
+				if(error != 0)
+				{
+					finishRequest(conn, data, retn, false);
+					continue;
+				}
+				
+				conn->state = loadConnection::SENDING;
+			}
+			
+			if(conn->state == loadConnection::SENDING)
+			{
+				int sent = send(conn->sockfd, conn->request.c_str() + conn->requestSent, conn->request.length() - conn->requestSent, MSG_NOSIGNAL);
+				if(sent < 0 && (errno == EAGAIN || errno == ENOTCONN)) return;
+				if(sent <= 0)
+				{
+					finishRequest(conn, data, retn, false);
+					continue;
+				}
+				
+				conn->requestSent += sent;
+				if(conn->requestSent == conn->request.length())
+					conn->state = loadConnection::READING;
+				continue;
+			}
+			
+			int bytesRead = read(conn->sockfd, buffer, LOADREADSIZE);
+			if(bytesRead < 0 && errno == EAGAIN) return;
+			
+			//The server closed: that ends a response without a length, and fails one with
+			if(bytesRead <= 0)
+			{
+				finishRequest(conn, data, retn, bytesRead == 0 && conn->received > 0 && (conn->expected < 0 || conn->received == conn->expected));
+				continue;
+			}
+			
+			if(conn->received == 0)
+				recordFirstByte(retn, microsSince(conn->sent));
+			conn->received += bytesRead;
+			
+			//Only the header is kept, to find the response's length
+			if(conn->expected < 0 && conn->header.length() < LOADHEADERMAX)
+			{
+				conn->header.append(buffer, min(bytesRead, (int)(LOADHEADERMAX - conn->header.length())));
+				
+				size_t headerEnd = conn->header.find("\r\n\r\n");
+				const char* lengthField = headerEnd == string::npos ? NULL : strcasestr(conn->header.c_str(), "Content-Length:");
+				if(lengthField && lengthField < conn->header.c_str() + headerEnd)
+				{
+					conn->expected = headerEnd + 4 + atol(lengthField + 15);
+					conn->serverClosing = conn->serverClosing || strcasestr(conn->header.c_str(), "Connection: close") != NULL;
+				}
+			}
+			
+			//A framed response on a kept connection is done once its length has arrived
+			if(conn->expected >= 0 && conn->received >= conn->expected && !conn->serverClosing)
+				finishRequest(conn, data, retn, conn->received == conn->expected);
+		}
+	}
+	
+	/**
+	 * @brief Connects to the server with 5 second send and receive timeouts
+	 * 
+	 * @return The socket, which may have failed to connect
+	 */
+	static int openConnection(workerThreadStruct* data, threadReturn* retn)
+	{
+		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		
+		int connected = connect(sockfd,(struct sockaddr *)data->sockAddress,sizeof(*(data->sockAddress)));
+		//EXPECT_EQ(connected, 0);
+		retn->connections++;
+
+	    struct timeval timeout;      
+		timeout.tv_sec = 5;
+		timeout.tv_usec = 0;
+
+		if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
+			sizeof(timeout)) < 0)
+			printf("setsockopt failed\n");
+
+		if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
+		    	sizeof(timeout)) < 0)
+		    	printf("setsockopt failed\n");
+		
+		return sockfd;
+	}
+	
+	/**
+	 * @brief Claims requests from the schedule and sends each at its time, until the schedule runs out
+	 * 
+	 * @param data The schedule and request information
+	 * @param retn Where latencies, errors and received bytes are counted
+	 * 
+	 * @note Bodies aren't echoed, since printing them would hold up the schedule.
+	 * With keep-alive a thread reuses its connection for up to
+	 * requestsPerConnection of the requests it claims.
+	 */
+	static void runOpenLoop(workerThreadStruct* data, threadReturn* retn)
+	{
+		bool persistent = data->requestsPerConnection > 1;
+		int sockfd = -1;
+		int used = 0;
+		string pending;
+		long index;
+		
+		//Generators sharing a schedule take every generators-th request of it
+		while((index = __sync_fetch_and_add(data->nextRequest, 1) * data->generators + data->generator) < data->scheduled)
+		{
+			struct timespec intended = data->scheduleStart;
+			intended.tv_sec += data->schedule[index] / 1000000000;
+			intended.tv_nsec += data->schedule[index] % 1000000000;
+			if(intended.tv_nsec >= 1000000000)
+			{
+				intended.tv_sec++;
+				intended.tv_nsec -= 1000000000;
+			}
+			
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &intended, NULL) == EINTR);
+			
+			//Every thread was busy when this request was due
+			if(microsSince(intended) > LATESTART)
+				retn->lateStarts++;
+			
+			if(sockfd < 0)
+			{
+				sockfd = openConnection(data, retn);
+				used = 0;
+				pending.clear();
+			}
+			
+			used++;
+			bool last = !persistent || used == data->requestsPerConnection;
+			
+			string req = "GET " + requestFile(data, retn, index) + (persistent ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+			if(data->host)
+				req += "Host: " + string(data->host) + "\r\n";
+			if(persistent && last)
+				req += "Connection: close\r\n";
+			req += "\r\n";
+			
+			struct timeval sent;
+			gettimeofday(&sent, NULL);
+			
+			long received = -1;
+			bool serverClosing = !persistent;
+			if(write(sockfd, req.c_str(), req.length()) == (int)req.length())
+			{
+				if(persistent)
+					received = readFramedResponse(sockfd, pending, serverClosing, sent, retn);
+				else
+					received = readToClose(sockfd, sent, retn);
+			}
+			
+			if(received <= 0)
+				recordErrors(data, retn, 1);
+			else
+			{
+				retn->recv += received;
+				recordResponse(data, retn, microsSince(intended), received);
+			}
+			
+			if(received <= 0 || last || serverClosing)
+			{
+				close(sockfd);
+				sockfd = -1;
+			}
+		}
+		
+		if(sockfd >= 0) close(sockfd);
+	}
+	
+	/**
+	 * @brief The file a request asks for
+	 * 
+	 * @param index The request's place in the schedule, which picks the logged file when replaying
+	 */
+	static string requestFile(workerThreadStruct* data, threadReturn* retn, long index)
+	{
+		if(data->workload)
+			return data->workload->pick(retn->fileSeed, index);
+		
+		return data->file;
+	}
+	
+	/**
+	 * @brief Reads a response that ends when the server closes the connection, without keeping it
+	 * 
+	 * @param sockfd The socket to read from
+	 * @param sent When the request was sent, for the time to first byte
+	 * @param retn Where the time to first byte is counted
+	 * @return The size of the response, or -1 if the read failed
+	 */
+	static long readToClose(int sockfd, const struct timeval& sent, threadReturn* retn)
+	{
+		char buffer[16384];
+		long total = 0;
+		int bytesRead;
+		
+		while((bytesRead = read(sockfd, buffer, sizeof(buffer))) > 0)
+		{
+			if(total == 0)
+				recordFirstByte(retn, microsSince(sent));
+			
+			total += bytesRead;
+		}
+		
+		return bytesRead < 0 ? -1 : total;
+	}
+	
+	/**
+	 * @brief Sends requests on a single keep-alive connection, pipelining up to pipelineDepth at a time
+	 * 
+	 * @param sockfd The connected socket
+	 * @param data The worker's loop and request information
+	 * @param retn Where errors and received bytes are counted
+	 * @param remaining The number of requests this worker still has to make
+	 * @return The number of requests this connection accounted for
+	 * 
+	 * @note With a depth of one each request waits for the previous response.
+	 * Deeper pipelines keep that many requests written ahead of the responses,
+	 * which are told apart by their Content-Length. Each latency runs from the
+	 * request's own write, so time spent queued behind earlier responses counts.
+	 */
+	static int runPersistentConnection(int sockfd, workerThreadStruct* data, threadReturn* retn, int remaining)
+	{
+		int requests = min(data->requestsPerConnection, remaining);
+		int depth = max(data->pipelineDepth, 1);
+		string pending;
+		
+		//The send times of the requests still waiting for a response, oldest first
+		deque<struct timeval> outstanding;
+		int sentCount = 0;
+		
+		for(int i = 0; i < requests; i++)
+		{
+			//A timed run stops sending, and closes once what was sent is answered
+			bool stopping = pastDeadline(data);
+			if(stopping && outstanding.empty())
+				return i;
+			
+			//Top the pipeline up, batching the new requests into one write
+			string batch;
+			struct timeval sent;
+			gettimeofday(&sent, NULL);
+			while(!stopping && sentCount < requests && (int)outstanding.size() < depth)
+			{
+				batch += "GET " + requestFile(data, retn, sentCount) + " HTTP/1.1\r\n";
+				if(data->host)
+					batch += "Host: " + string(data->host) + "\r\n";
+				//Let the server close after the last response
+				if(++sentCount == requests)
+					batch += "Connection: close\r\n";
+				batch += "\r\n";
+				
+				outstanding.push_back(sent);
+			}
+			
+			long received = -1;
+			bool serverClosing = false;
+			if(batch.length() == 0 || write(sockfd, batch.c_str(), batch.length()) == (int)batch.length())
+				received = readFramedResponse(sockfd, pending, serverClosing, outstanding.front(), retn);
+			
+			//Every request still in the pipeline is lost
+			if(received < 0)
+			{
+				recordErrors(data, retn, outstanding.size());
+				return sentCount;
+			}
+			
+			retn->recv += received;
+			recordResponse(data, retn, microsSince(outstanding.front()), received);
+			outstanding.pop_front();
+			
+			//The server won't answer the rest here, so they go again on a new connection
+			if(serverClosing)
+				return i + 1;
+		}
+		
+		return requests;
+	}
+	
+	/**
+	 * @brief Reads exactly one response, using its Content-Length to find where it ends
+	 * 
+	 * @param sockfd The socket to read from
+	 * @param pending Bytes already read past the previous response, updated with bytes read past this one
+	 * @param serverClosing Set if the response says the server is closing the connection
+	 * @param sent When the request was sent, for the time to first byte
+	 * @param retn Where the time to first byte is counted
+	 * @return The size of the response, or -1 if the connection failed first
+	 */
+	static long readFramedResponse(int sockfd, string& pending, bool& serverClosing, const struct timeval& sent, threadReturn* retn)
+	{
+		char buffer[4096];
+		size_t headerEnd;
+		bool counted = false;
+		
+		//Bytes left over from the previous response already arrived
+		if(pending.length() > 0)
+		{
+			recordFirstByte(retn, 0);
+			counted = true;
+		}
+		
+		while((headerEnd = pending.find("\r\n\r\n")) == string::npos)
+		{
+			int bytesRead = read(sockfd, buffer, sizeof(buffer));
+			if(bytesRead <= 0) return -1;
+			pending.append(buffer, bytesRead);
+			
+			if(!counted)
+			{
+				recordFirstByte(retn, microsSince(sent));
+				counted = true;
+			}
+		}
+		
+		//Responses without a length can't share a connection
+		string header = pending.substr(0, headerEnd);
+		const char* lengthField = strcasestr(header.c_str(), "Content-Length:");
+		if(lengthField == NULL) return -1;
+		
+		size_t total = headerEnd + 4 + atol(lengthField + 15);
+		serverClosing = strcasestr(header.c_str(), "Connection: close") != NULL;
+		while(pending.length() < total)
+		{
+			int bytesRead = read(sockfd, buffer, sizeof(buffer));
+			if(bytesRead <= 0) return -1;
+			pending.append(buffer, bytesRead);
+		}
+		
+		pending.erase(0, total);
+		return total;
+	}
 };
@@ -3,5 +3,116 @@
 int main(int argc, char* argv[])
 {
 	client c(atoi(argv[2]));
-	c.runWorkerThreads(argv[1], argv[3], atoi(argv[4]), atoi(argv[5]), argc >=6 ? argv[6] : "");
+	
+	const char* host = NULL;
+	int requestsPerConnection = 1;
+	double rate = 0;
+	bool poisson = false;
+	int epollThreads = 0;
+	int pipelineDepth = 0;
+	bool compare = false;
+	const char* specPath = NULL;
+	const char* logPath = NULL;
+	int processes = 0;
+	int intervalMillis = GENERATORINTERVAL;
+	double duration = 0;
+	
+	//The remote host and optional settings follow the required arguments
+	for(int i = 6; i < argc; i++)
+	{
+		//"keepalive=<N>" makes up to N requests on each connection
+		if(strncmp(argv[i], "keepalive=", 10) == 0)
+			requestsPerConnection = atoi(argv[i] + 10);
+		//"rate=<N>" sends N requests per second on a schedule instead of closed-loop
+		else if(strncmp(argv[i], "rate=", 5) == 0)
+			rate = atof(argv[i] + 5);
+		//"poisson" spaces scheduled requests randomly instead of evenly
+		else if(strcmp(argv[i], "poisson") == 0)
+			poisson = true;
+		//"epoll=<N>" drives the connections from N epoll threads instead of a thread each
+		else if(strncmp(argv[i], "epoll=", 6) == 0)
+			epollThreads = atoi(argv[i] + 6);
+		//"pipeline=<D>" writes up to D requests on a keep-alive connection before reading responses
+		else if(strncmp(argv[i], "pipeline=", 9) == 0)
+			pipelineDepth = atoi(argv[i] + 9);
+		//"noecho" stops the per-request workers printing each response
+		else if(strcmp(argv[i], "noecho") == 0)
+			c.setEchoBodies(false);
+		//"compare" runs per-request, keep-alive and pipelined one after another and tabulates them
+		else if(strcmp(argv[i], "compare") == 0)
+			compare = true;
+		//"workload=<file>" picks each request's file from a spec of weighted size classes with Zipf popularity
+		else if(strncmp(argv[i], "workload=", 9) == 0)
+			specPath = argv[i] + 9;
+		//"replay=<file>" sends the requests of an access log at their logged spacing
+		else if(strncmp(argv[i], "replay=", 7) == 0)
+			logPath = argv[i] + 7;
+		//"procs=<K>" forks K generator processes and prints their combined results
+		else if(strncmp(argv[i], "procs=", 6) == 0)
+			processes = atoi(argv[i] + 6);
+		//"duration=<s>" keeps closed-loop threads going for s seconds instead of counting loops
+		else if(strncmp(argv[i], "duration=", 9) == 0)
+			duration = atof(argv[i] + 9);
+		//"interval=<ms>" sets the length of each row of a procs= time series
+		else if(strncmp(argv[i], "interval=", 9) == 0)
+			intervalMillis = max(atoi(argv[i] + 9), 1);
+		else
+			host = argv[i];
+	}
+	
+	Workload workload;
+	if(logPath && !workload.loadLog(logPath))
+	{
+		cout << "No requests could be read from " << logPath << endl;
+		return 1;
+	}
+	else if(!logPath && specPath && !workload.loadSpec(specPath))
+	{
+		cout << "No files could be read from " << specPath << endl;
+		return 1;
+	}
+	
+	if(logPath || specPath)
+		c.setWorkload(&workload);
+	
+	//A replay keeps the log's own open-loop timing
+	if(logPath && (rate > 0 || epollThreads > 0))
+	{
+		cout << "rate= and epoll= are ignored with replay=" << endl;
+		rate = 0;
+		epollThreads = 0;
+	}
+	
+	//The epoll engine runs closed-loop
+	if(rate > 0 && epollThreads > 0)
+		cout << "rate= is ignored with epoll=" << endl;
+	else if(rate > 0)
+		c.setOpenLoop(rate, poisson);
+	
+	if(epollThreads > 0)
+		c.setEpollEngine(epollThreads);
+	
+	if(duration > 0 && (rate > 0 || epollThreads > 0 || logPath))
+		cout << "duration= is ignored with rate=, epoll= or replay=" << endl;
+	else if(duration > 0)
+		c.setDuration(duration);
+	
+	//Pipelining needs a connection that stays open, so without keepalive= one lasts the whole loop
+	if((pipelineDepth > 1 || compare) && requestsPerConnection < 2)
+		requestsPerConnection = atoi(argv[5]);
+	
+	if(pipelineDepth > 1 && (rate > 0 || epollThreads > 0 || logPath))
+		cout << "pipeline= is ignored with rate=, epoll= or replay=" << endl;
+	else if(pipelineDepth > 1 && !compare)
+		c.setPipelineDepth(pipelineDepth);
+	
+	if(processes > 1 && compare)
+		cout << "compare is ignored with procs=" << endl;
+	
+	if(processes > 1)
+		c.runGenerators(argv[1], argv[3], atoi(argv[4]), atoi(argv[5]), host, requestsPerConnection, processes, intervalMillis);
+	else if(compare)
+		c.compareConnectionModes(argv[1], argv[3], atoi(argv[4]), atoi(argv[5]), host, requestsPerConnection, pipelineDepth > 1 ? pipelineDepth : COMPAREDEPTH);
+	else
+		c.runWorkerThreads(argv[1], argv[3], atoi(argv[4]), atoi(argv[5]), host, requestsPerConnection);
 }
@@ -0,0 +1,267 @@
+#ifndef CONTENT_CACHE
+#define CONTENT_CACHE
+
+/**
+ * @file contentCache.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the ContentCache class that keeps static files mapped in memory
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <list>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CACHESHARDS 16 //The number of independently locked pieces of the cache
+
+using namespace std;
+
+/**
+ * @brief A file body held in memory along with the header that goes in front of it
+ */
+struct cacheEntry
+{
+	///The path the entry was loaded from
+	string key;
+
+	///The prebuilt response header
+	string header;
+
+	///The mapped file contents
+	char* body;
+
+	///The number of bytes in body
+	size_t length;
+
+	///The number of holders, including the cache itself while the entry is indexed
+	int refs;
+};
+
+namespace{
+/**
+ * @brief A sharded cache of mmapped static files with a byte budget and LRU eviction
+ *
+ * @note Entries are reference counted, so an entry evicted while a worker is
+ * still writing it stays mapped until that worker releases it
+ */
+class ContentCache
+{
+	private:
+
+	/**
+	 * @brief One independently locked piece of the cache
+	 */
+	struct cacheShard
+	{
+		///Protects everything in the shard
+		pthread_mutex_t lock;
+
+		///Entries ordered from most to least recently used
+		list<cacheEntry*> lru;
+
+		///Maps a path to its position in lru
+		map<string, list<cacheEntry*>::iterator> index;
+
+		///The body bytes held by the shard
+		size_t bytes;
+
+		long hits;
+		long misses;
+		long evictions;
+	};
+
+	///The shards, picked by a hash of the path
+	cacheShard shards[CACHESHARDS];
+
+	///The most body bytes each shard may hold
+	size_t shardBudget;
+
+	///Files larger than this are never cached
+	size_t maxObjectSize;
+
+	/**
+	 * @brief Picks the shard that owns a path
+	 */
+	cacheShard& shardFor(const string& key)
+	{
+		//FNV-1a
+		unsigned int hash = 2166136261u;
+		for(size_t i = 0; i < key.length(); i++)
+			hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+		return shards[hash % CACHESHARDS];
+	}
+
+	/**
+	 * @brief Drops one reference and unmaps the entry when none are left
+	 */
+	static void dropReference(cacheEntry* entry)
+	{
+		if(__sync_sub_and_fetch(&entry->refs, 1) == 0)
+		{
+			if(entry->body) munmap(entry->body, entry->length);
+			delete entry;
+		}
+	}
+
+	public:
+
+	/**
+	 * @brief Creates an empty cache
+	 *
+	 * @param byteBudget The most body bytes the whole cache may hold
+	 * @param maxObject Files larger than this are served from disk instead
+	 */
+	ContentCache(size_t byteBudget, size_t maxObject)
+	{
+		shardBudget = byteBudget / CACHESHARDS;
+		maxObjectSize = min(maxObject, shardBudget);
+
+		for(int i = 0; i < CACHESHARDS; i++)
+		{
+			pthread_mutex_init(&shards[i].lock, NULL);
+			shards[i].bytes = 0;
+			shards[i].hits = 0;
+			shards[i].misses = 0;
+			shards[i].evictions = 0;
+		}
+	}
+
+	~ContentCache()
+	{
+		for(int i = 0; i < CACHESHARDS; i++)
+		{
+			for(list<cacheEntry*>::iterator it = shards[i].lru.begin(); it != shards[i].lru.end(); ++it)
+				dropReference(*it);
+
+			pthread_mutex_destroy(&shards[i].lock);
+		}
+	}
+
+	/**
+	 * @brief Looks up a path without touching the filesystem
+	 *
+	 * @param key The path of the file
+	 * @return The entry, which must be handed back to release(), or NULL on a miss
+	 */
+	cacheEntry* acquire(const string& key)
+	{
+		cacheShard& shard = shardFor(key);
+		cacheEntry* entry = NULL;
+
+		pthread_mutex_lock(&shard.lock);
+
+		map<string, list<cacheEntry*>::iterator>::iterator found = shard.index.find(key);
+		if(found != shard.index.end())
+		{
+			//Move to the front of the LRU list
+			shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+			entry = *(found->second);
+			__sync_fetch_and_add(&entry->refs, 1);
+			shard.hits++;
+		}
+		else
+			shard.misses++;
+
+		pthread_mutex_unlock(&shard.lock);
+
+		return entry;
+	}
+
+	/**
+	 * @brief Maps an open file into the cache, evicting the least recently used entries to make room
+	 *
+	 * @param key The path of the file
+	 * @param header The response header to keep with the body
+	 * @param fileFd The open file, which the caller still owns
+	 * @param length The size of the file
+	 * @return The entry, which must be handed back to release(), or NULL if the file is not cacheable
+	 */
+	cacheEntry* insert(const string& key, const string& header, int fileFd, size_t length)
+	{
+		if(length > maxObjectSize) return NULL;
+
+		char* body = NULL;
+		if(length > 0)
+		{
+			body = (char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fileFd, 0);
+			if(body == MAP_FAILED) return NULL;
+		}
+
+		cacheEntry* entry = new cacheEntry();
+		entry->key = key;
+		entry->header = header;
+		entry->body = body;
+		entry->length = length;
+		entry->refs = 2;//One for the cache, one for the caller
+
+		cacheShard& shard = shardFor(key);
+		pthread_mutex_lock(&shard.lock);
+
+		//Another thread loaded it first
+		map<string, list<cacheEntry*>::iterator>::iterator found = shard.index.find(key);
+		if(found != shard.index.end())
+		{
+			cacheEntry* existing = *(found->second);
+			__sync_fetch_and_add(&existing->refs, 1);
+			pthread_mutex_unlock(&shard.lock);
+
+			entry->refs = 1;
+			dropReference(entry);
+			return existing;
+		}
+
+		while(shard.bytes + length > shardBudget && !shard.lru.empty())
+		{
+			cacheEntry* victim = shard.lru.back();
+			shard.lru.pop_back();
+			shard.index.erase(victim->key);
+			shard.bytes -= victim->length;
+			shard.evictions++;
+
+			dropReference(victim);
+		}
+
+		shard.lru.push_front(entry);
+		shard.index[key] = shard.lru.begin();
+		shard.bytes += length;
+
+		pthread_mutex_unlock(&shard.lock);
+
+		return entry;
+	}
+
+	/**
+	 * @brief Hands back an entry returned by acquire() or insert()
+	 */
+	void release(cacheEntry* entry)
+	{
+		dropReference(entry);
+	}
+
+	/**
+	 * @brief Prints the hit and miss counters for the whole cache
+	 */
+	void printStats()
+	{
+		long hits = 0, misses = 0, evictions = 0;
+		size_t bytes = 0;
+
+		for(int i = 0; i < CACHESHARDS; i++)
+		{
+			pthread_mutex_lock(&shards[i].lock);
+			hits += shards[i].hits;
+			misses += shards[i].misses;
+			evictions += shards[i].evictions;
+			bytes += shards[i].bytes;
+			pthread_mutex_unlock(&shards[i].lock);
+		}
+
+		cout << "Cache hits: " << hits << "\t" << "misses: " << misses << "\t" << "evictions: " << evictions << "\t" << "bytes: " << bytes << endl;
+	}
+};
+}
+#endif
@@ -0,0 +1,797 @@
+#ifndef DISK_CACHE
+#define DISK_CACHE
+
+/**
+ * @file diskCache.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the DiskCache class, a log-structured store of origin responses that outlives the proxy
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#define DISKSEGMENTSIZE 16777216 //Segments are sealed once the next record would pass this size
+#define DISKSEGMENTNAME "segment.%d" //A segment's file name in the cache directory
+#define DISKSEGMENTMAGIC 0x48545053 //Starts every segment file
+#define DISKRECORDMAGIC 0x48545052 //Starts every record
+#define DISKMAXKEY 1024 //Longer keys mean the record is damaged
+#define DISKCOMPACTRATIO 0.5 //Sealed segments with less than this share still live are rewritten
+
+using namespace std;
+
+/**
+ * @brief The first bytes of a segment file
+ */
+struct diskSegmentHeader
+{
+	unsigned int magic;
+
+	///The segment's number, which orders segments oldest first
+	unsigned int number;
+};
+
+/**
+ * @brief The fixed part of a record, followed by the key, the response header and the body
+ */
+struct diskRecordHeader
+{
+	unsigned int magic;
+
+	///CRC-32C of the lengths, key, response header and body
+	unsigned int checksum;
+
+	unsigned int keyLength;
+	unsigned int headerLength;
+	unsigned long long bodyLength;
+};
+
+namespace{
+/**
+ * @brief The CRC-32C table, for CPUs without the SSE4.2 instruction
+ */
+static unsigned int crc32cTable[256];
+
+static void buildCrc32cTable()
+{
+	for(unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int crc = i;
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		crc32cTable[i] = crc;
+	}
+}
+
+/**
+ * @brief Continues a CRC-32C over more bytes, 8 at a time where the CPU allows
+ */
+static unsigned int crc32c(unsigned int crc, const char* data, size_t length)
+{
+#ifdef __SSE4_2__
+	unsigned long long wide = crc;
+	for(; length >= 8; data += 8, length -= 8)
+	{
+		unsigned long long word;
+		memcpy(&word, data, 8);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = (unsigned int)wide;
+#endif
+	for(; length > 0; data++, length--)
+		crc = (crc >> 8) ^ crc32cTable[(crc ^ (unsigned char)*data) & 0xff];
+
+	return crc;
+}
+
+/**
+ * @brief An append-only on-disk tier for the proxy's response cache
+ *
+ * @note Responses are appended as checksummed records to the newest segment
+ * file in a directory, and the segment is sealed when it fills. Only a hash of
+ * each key and the record's location are kept in memory, and that index is
+ * rebuilt at startup by reading just the record headers and keys, so a
+ * restarted proxy has its working set back without fetching it again. A
+ * later record for the same key supersedes the earlier one. A background
+ * thread rewrites the live records of sealed segments that are mostly dead,
+ * and deletes the oldest segments when the directory passes its budget.
+ * Records are checked when read, so torn or damaged ones are misses.
+ */
+class DiskCache
+{
+	private:
+
+	/**
+	 * @brief Where a record is
+	 */
+	struct diskLocation
+	{
+		int segment;
+		long offset;
+
+		///The whole record, including its fixed header
+		long length;
+	};
+
+	/**
+	 * @brief An open segment file
+	 */
+	struct diskSegment
+	{
+		int fd;
+
+		///The bytes in the file
+		long size;
+
+		///The bytes of records the index still points to
+		long liveBytes;
+
+		///Readers and writers using fd without holding the lock
+		int pins;
+
+		///Records reserved in the file that are still being written
+		int writers;
+
+		///Set once the file is deleted; the last reader closes it
+		bool doomed;
+	};
+
+	///The directory holding the segments
+	string directory;
+
+	///Maps a hash of each key to its newest record
+	map<unsigned long long, diskLocation> index;
+
+	///The open segments by number
+	map<int, diskSegment*> segments;
+
+	///The number of the segment being appended to, or -1 before the first append
+	int active;
+
+	///The number the next segment gets
+	int nextSegment;
+
+	///The bytes in every segment
+	long totalBytes;
+
+	///The most bytes the segments may hold
+	long budget;
+
+	///Protects the index, the segments and the sizes
+	pthread_mutex_t lock;
+
+	///Signalled when a segment is sealed or the budget is passed
+	pthread_cond_t work;
+
+	pthread_t compactThread;
+	bool running;
+
+	long hits;
+	long misses;
+	long writes;
+	long writtenBytes;
+	long corrupt;
+	long compactions;
+	long evictions;
+
+	static unsigned long long hashKey(const string& key)
+	{
+		//FNV-1a
+		unsigned long long hash = 14695981039346656037ull;
+		for(size_t i = 0; i < key.length(); i++)
+			hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+
+		return hash;
+	}
+
+	/**
+	 * @brief Checksums a record's lengths, then its key, response header and body
+	 */
+	static unsigned int recordChecksum(const diskRecordHeader& record, const char* key, const char* header, const char* body)
+	{
+		unsigned int crc = crc32c(0xffffffff, (const char*)&record.keyLength, sizeof(record) - 2 * sizeof(unsigned int));
+		crc = crc32c(crc, key, record.keyLength);
+		crc = crc32c(crc, header, record.headerLength);
+		crc = crc32c(crc, body, record.bodyLength);
+
+		return ~crc;
+	}
+
+	string segmentPath(int number)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), DISKSEGMENTNAME, number);
+
+		return directory + "/" + name;
+	}
+
+	/**
+	 * @brief Drops a reader's hold on a segment, closing it if it was deleted meanwhile
+	 *
+	 * @note The caller holds lock
+	 */
+	void unpin(diskSegment* segment)
+	{
+		if(--segment->pins == 0 && segment->doomed)
+		{
+			close(segment->fd);
+			delete segment;
+		}
+	}
+
+	/**
+	 * @brief Deletes a segment's file and forgets it
+	 *
+	 * @note The caller holds lock and has removed the index entries pointing at it
+	 */
+	void dropSegment(int number)
+	{
+		diskSegment* segment = segments[number];
+		segments.erase(number);
+		totalBytes -= segment->size;
+
+		unlink(segmentPath(number).c_str());
+
+		segment->doomed = true;
+		segment->pins++;
+		unpin(segment);
+	}
+
+	/**
+	 * @brief Starts a new segment and makes it the one appended to
+	 *
+	 * @note The caller holds lock
+	 */
+	bool openNewSegment()
+	{
+		int number = nextSegment++;
+		int fd = open(segmentPath(number).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		diskSegmentHeader header;
+		header.magic = DISKSEGMENTMAGIC;
+		header.number = number;
+
+		if(fd < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		{
+			cout << "Error creating disk cache segment " << segmentPath(number) << endl;
+			if(fd >= 0) close(fd);
+			return false;
+		}
+
+		diskSegment* segment = new diskSegment();
+		segment->fd = fd;
+		segment->size = sizeof(header);
+		segment->liveBytes = 0;
+		segment->pins = 0;
+		segment->writers = 0;
+		segment->doomed = false;
+
+		segments[number] = segment;
+		totalBytes += segment->size;
+
+		//The previous segment is sealed and may be worth compacting now
+		if(active >= 0) pthread_cond_signal(&work);
+		active = number;
+
+		return true;
+	}
+
+	/**
+	 * @brief Points the index at a record, accounting for the one it supersedes
+	 *
+	 * @note The caller holds lock
+	 */
+	void publish(unsigned long long hash, const diskLocation& location)
+	{
+		map<unsigned long long, diskLocation>::iterator old = index.find(hash);
+		if(old != index.end() && segments.count(old->second.segment))
+			segments[old->second.segment]->liveBytes -= old->second.length;
+
+		index[hash] = location;
+		segments[location.segment]->liveBytes += location.length;
+	}
+
+	/**
+	 * @brief Writes a record to the end of the active segment and indexes it
+	 *
+	 * @param replaces The record being carried over by compaction, which must
+	 * still be the key's newest for the copy to be indexed, or NULL
+	 * @return True if the record was written and indexed
+	 *
+	 * @note Only reserving the space and indexing the record take the lock, so
+	 * lookups never wait behind the write. A write that fails leaves its space
+	 * unindexed, and a restart stops reading the segment there.
+	 */
+	bool append(unsigned long long hash, struct iovec* parts, int partCount, long length, const diskLocation* replaces = NULL)
+	{
+		pthread_mutex_lock(&lock);
+
+		if(active < 0 || segments[active]->size + length > DISKSEGMENTSIZE)
+		{
+			if(!openNewSegment())
+			{
+				pthread_mutex_unlock(&lock);
+				return false;
+			}
+		}
+
+		diskSegment* segment = segments[active];
+
+		diskLocation location;
+		location.segment = active;
+		location.offset = segment->size;
+		location.length = length;
+
+		segment->size += length;
+		totalBytes += length;
+		segment->writers++;
+		segment->pins++;
+
+		pthread_mutex_unlock(&lock);
+
+		bool written = pwritev(segment->fd, parts, partCount, location.offset) == length;
+
+		pthread_mutex_lock(&lock);
+
+		segment->writers--;
+		bool indexed = written && !segment->doomed;
+
+		//A newer insert may have superseded the record compaction is copying
+		if(indexed && replaces)
+		{
+			map<unsigned long long, diskLocation>::iterator live = index.find(hash);
+			indexed = live != index.end() && live->second.segment == replaces->segment && live->second.offset == replaces->offset;
+		}
+
+		if(indexed) publish(hash, location);
+
+		//A sealed segment may have been passed over for compaction while it was written
+		if(totalBytes > budget || (segment->writers == 0 && location.segment != active))
+			pthread_cond_signal(&work);
+
+		unpin(segment);
+
+		pthread_mutex_unlock(&lock);
+
+		return indexed;
+	}
+
+	/**
+	 * @brief Reads a segment's record headers and keys into the index
+	 *
+	 * @return The number of records indexed
+	 *
+	 * @note A segment ends at the first record that doesn't fit in the file
+	 * or has a bad magic number, which is where a crash would have torn it.
+	 * The rest of the file is cut off so appends continue from there.
+	 */
+	long scanSegment(int number)
+	{
+		int fd = open(segmentPath(number).c_str(), O_RDWR | O_CLOEXEC);
+		if(fd < 0) return 0;
+
+		struct stat fileStat;
+		diskSegmentHeader header;
+		if(fstat(fd, &fileStat) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != DISKSEGMENTMAGIC)
+		{
+			close(fd);
+			unlink(segmentPath(number).c_str());
+			return 0;
+		}
+
+		diskSegment* segment = new diskSegment();
+		segment->fd = fd;
+		segment->liveBytes = 0;
+		segment->pins = 0;
+		segment->writers = 0;
+		segment->doomed = false;
+		segments[number] = segment;
+
+		long offset = sizeof(header);
+		long records = 0;
+		char key[DISKMAXKEY];
+
+		while(true)
+		{
+			diskRecordHeader record;
+			if(pread(fd, &record, sizeof(record), offset) != sizeof(record) || record.magic != DISKRECORDMAGIC || record.keyLength > DISKMAXKEY)
+				break;
+
+			long length = sizeof(record) + record.keyLength + record.headerLength + record.bodyLength;
+			if(offset + length > fileStat.st_size || pread(fd, key, record.keyLength, offset + sizeof(record)) != (int)record.keyLength)
+				break;
+
+			diskLocation location;
+			location.segment = number;
+			location.offset = offset;
+			location.length = length;
+			publish(hashKey(string(key, record.keyLength)), location);
+
+			offset += length;
+			records++;
+		}
+
+		if(offset < fileStat.st_size)
+			ftruncate(fd, offset);
+
+		segment->size = offset;
+		totalBytes += offset;
+
+		return records;
+	}
+
+	/**
+	 * @brief Copies a sealed segment's live records to the active segment, then deletes it
+	 */
+	void compactSegment(int number, diskSegment* segment)
+	{
+		long offset = sizeof(diskSegmentHeader);
+		long size = segment->size;
+		vector<char> buffer;
+
+		while(offset < size)
+		{
+			diskRecordHeader record;
+			if(pread(segment->fd, &record, sizeof(record), offset) != sizeof(record) || record.keyLength > DISKMAXKEY)
+				break;
+
+			long length = sizeof(record) + record.keyLength + record.headerLength + record.bodyLength;
+			buffer.resize(length);
+			if(pread(segment->fd, &buffer[0], length, offset) != length)
+				break;
+
+			unsigned long long hash = hashKey(string(&buffer[sizeof(record)], record.keyLength));
+
+			diskLocation location;
+			location.segment = number;
+			location.offset = offset;
+			location.length = length;
+
+			pthread_mutex_lock(&lock);
+
+			//Only records the index still points to are carried over
+			map<unsigned long long, diskLocation>::iterator live = index.find(hash);
+			bool carry = live != index.end() && live->second.segment == number && live->second.offset == offset;
+
+			pthread_mutex_unlock(&lock);
+
+			if(carry)
+			{
+				struct iovec part;
+				part.iov_base = &buffer[0];
+				part.iov_len = length;
+				append(hash, &part, 1, length, &location);
+			}
+
+			offset += length;
+		}
+	}
+
+	/**
+	 * @brief Removes every index entry that points into a segment
+	 *
+	 * @note The caller holds lock
+	 */
+	void forgetSegment(int number)
+	{
+		for(map<unsigned long long, diskLocation>::iterator it = index.begin(); it != index.end(); )
+			if(it->second.segment == number) index.erase(it++);
+			else ++it;
+	}
+
+	/**
+	 * @brief A level of indirection to call the member function compactTask for a thread
+	 */
+	static void *launchCompactTask(void* obj)
+	{
+		DiskCache* thisCache = (DiskCache*)obj;
+		return thisCache->compactTask();
+	}
+
+	/**
+	 * @brief Evicts the oldest segments while over budget, and compacts sealed segments that are mostly dead
+	 */
+	void *compactTask()
+	{
+		pthread_mutex_lock(&lock);
+
+		while(running)
+		{
+			int victim = -1;
+			bool evict = false;
+
+			//Segments with records still being written are left until the writes finish
+			if(totalBytes > budget && segments.begin()->first != active && segments.begin()->second->writers == 0)
+			{
+				victim = segments.begin()->first;
+				evict = true;
+			}
+			else
+			{
+				double lowest = DISKCOMPACTRATIO;
+				for(map<int, diskSegment*>::iterator it = segments.begin(); it != segments.end(); ++it)
+				{
+					long records = it->second->size - (long)sizeof(diskSegmentHeader);
+					if(it->first != active && it->second->writers == 0 && records > 0 && (double)it->second->liveBytes / records < lowest)
+					{
+						lowest = (double)it->second->liveBytes / records;
+						victim = it->first;
+					}
+				}
+			}
+
+			if(victim < 0)
+			{
+				pthread_cond_wait(&work, &lock);
+				continue;
+			}
+
+			diskSegment* segment = segments[victim];
+
+			if(!evict)
+			{
+				segment->pins++;
+				pthread_mutex_unlock(&lock);
+
+				compactSegment(victim, segment);
+
+				pthread_mutex_lock(&lock);
+				unpin(segment);
+				compactions++;
+			}
+			else
+				evictions++;
+
+			forgetSegment(victim);
+			dropSegment(victim);
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		return NULL;
+	}
+
+	public:
+
+	/**
+	 * @brief Opens the cache in a directory, indexing whatever an earlier proxy left there
+	 *
+	 * @param dir The directory, which is created if it doesn't exist
+	 * @param byteBudget The most bytes the segments may hold
+	 */
+	DiskCache(const string& dir, long byteBudget)
+	{
+		directory = dir;
+		budget = max(byteBudget, (long)DISKSEGMENTSIZE * 2);
+		active = -1;
+		nextSegment = 0;
+		totalBytes = 0;
+		hits = 0;
+		misses = 0;
+		writes = 0;
+		writtenBytes = 0;
+		corrupt = 0;
+		compactions = 0;
+		evictions = 0;
+		running = true;
+
+		buildCrc32cTable();
+
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&work, NULL);
+
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+
+		mkdir(directory.c_str(), 0755);
+
+		//Scan oldest first so later records supersede earlier ones
+		vector<int> found;
+		DIR* listing = opendir(directory.c_str());
+		struct dirent* file;
+		while(listing && (file = readdir(listing)) != NULL)
+		{
+			int number;
+			char tail;
+			if(sscanf(file->d_name, DISKSEGMENTNAME "%c", &number, &tail) == 1)
+				found.push_back(number);
+		}
+		if(listing) closedir(listing);
+		else cout << "Error opening disk cache directory " << directory << endl;
+
+		sort(found.begin(), found.end());
+
+		long records = 0;
+		for(size_t i = 0; i < found.size(); i++)
+			records += scanSegment(found[i]);
+
+		if(!segments.empty())
+		{
+			active = segments.rbegin()->first;
+			nextSegment = active + 1;
+		}
+
+		gettimeofday(&end, NULL);
+		long elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+		cout << "Disk cache: indexed " << index.size() << " responses from " << records << " records in " << segments.size() << " segments (" << totalBytes << " bytes) in " << elapsed / 1000 << " ms" << endl;
+
+		pthread_create(&compactThread, NULL, DiskCache::launchCompactTask, this);
+	}
+
+	~DiskCache()
+	{
+		pthread_mutex_lock(&lock);
+		running = false;
+		pthread_cond_signal(&work);
+		pthread_mutex_unlock(&lock);
+
+		pthread_join(compactThread, NULL);
+
+		for(map<int, diskSegment*>::iterator it = segments.begin(); it != segments.end(); ++it)
+		{
+			close(it->second->fd);
+			delete it->second;
+		}
+
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&work);
+	}
+
+	/**
+	 * @brief The largest response a segment can hold
+	 */
+	size_t maxObjectSize()
+	{
+		return DISKSEGMENTSIZE - sizeof(diskSegmentHeader) - sizeof(diskRecordHeader) - DISKMAXKEY;
+	}
+
+	/**
+	 * @brief Reads a response
+	 *
+	 * @param key The origin and path
+	 * @param header Set to the header as the client receives it
+	 * @param body Set to the body
+	 * @return True if a record was found and its checksum matched
+	 */
+	bool lookup(const string& key, string& header, string& body)
+	{
+		unsigned long long hash = hashKey(key);
+
+		pthread_mutex_lock(&lock);
+
+		map<unsigned long long, diskLocation>::iterator found = index.find(hash);
+		if(found == index.end())
+		{
+			misses++;
+			pthread_mutex_unlock(&lock);
+			return false;
+		}
+
+		diskLocation location = found->second;
+		diskSegment* segment = segments[location.segment];
+		segment->pins++;
+
+		pthread_mutex_unlock(&lock);
+
+		//The segment can't be closed while pinned, so read without the lock
+		vector<char> buffer(location.length);
+		diskRecordHeader record;
+		bool valid = false;
+		bool otherKey = false;
+
+		if(pread(segment->fd, &buffer[0], location.length, location.offset) == location.length)
+		{
+			memcpy(&record, &buffer[0], sizeof(record));
+			const char* recordKey = &buffer[sizeof(record)];
+
+			if(record.magic == DISKRECORDMAGIC && (long)(sizeof(record) + record.keyLength + record.headerLength + record.bodyLength) == location.length)
+			{
+				//Another key with the same hash isn't damage, just a miss
+				otherKey = key.compare(0, string::npos, recordKey, record.keyLength) != 0;
+				valid = !otherKey && record.checksum == recordChecksum(record, recordKey, recordKey + record.keyLength, recordKey + record.keyLength + record.headerLength);
+			}
+		}
+
+		pthread_mutex_lock(&lock);
+
+		unpin(segment);
+
+		if(valid)
+			hits++;
+		else
+		{
+			misses++;
+			if(!otherKey) corrupt++;
+
+			found = index.find(hash);
+			if(found != index.end() && found->second.segment == location.segment && found->second.offset == location.offset)
+			{
+				if(segments.count(location.segment))
+					segments[location.segment]->liveBytes -= location.length;
+				index.erase(found);
+			}
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		if(valid)
+		{
+			const char* recordHeader = &buffer[sizeof(record) + record.keyLength];
+			header.assign(recordHeader, record.headerLength);
+			body.assign(recordHeader + record.headerLength, record.bodyLength);
+		}
+
+		return valid;
+	}
+
+	/**
+	 * @brief Appends a response fetched from an origin
+	 *
+	 * @param key The origin and path
+	 * @param header The header as the client receives it
+	 * @param body The body
+	 */
+	void insert(const string& key, const string& header, const string& body)
+	{
+		if(key.length() > DISKMAXKEY || header.length() + body.length() > maxObjectSize())
+			return;
+
+		diskRecordHeader record;
+		record.magic = DISKRECORDMAGIC;
+		record.keyLength = key.length();
+		record.headerLength = header.length();
+		record.bodyLength = body.length();
+		record.checksum = recordChecksum(record, key.data(), header.data(), body.data());
+
+		struct iovec parts[4];
+		parts[0].iov_base = &record;
+		parts[0].iov_len = sizeof(record);
+		parts[1].iov_base = (void*)key.data();
+		parts[1].iov_len = key.length();
+		parts[2].iov_base = (void*)header.data();
+		parts[2].iov_len = header.length();
+		parts[3].iov_base = (void*)body.data();
+		parts[3].iov_len = body.length();
+
+		long length = sizeof(record) + key.length() + header.length() + body.length();
+
+		if(append(hashKey(key), parts, 4, length))
+		{
+			__sync_fetch_and_add(&writes, 1);
+			__sync_fetch_and_add(&writtenBytes, length);
+		}
+	}
+
+	/**
+	 * @brief Prints the disk tier's hit ratio and how much it has written and reclaimed
+	 */
+	void printStats()
+	{
+		pthread_mutex_lock(&lock);
+
+		cout << "Disk cache hits: " << hits << "\t" << "misses: " << misses << "\t" << "hit ratio: " << (hits + misses ? (double)hits / (hits + misses) : 0) << "\t" << "corrupt: " << corrupt << endl;
+		cout << "Disk cache writes: " << writes << "\t" << "bytes: " << writtenBytes << "\t" << "segments: " << segments.size() << "\t" << "disk bytes: " << totalBytes << "\t" << "compactions: " << compactions << "\t" << "evicted segments: " << evictions << endl;
+
+		pthread_mutex_unlock(&lock);
+	}
+};
+}
+#endif
@@ -0,0 +1,166 @@
+#ifndef HEDGE_POLICY
+#define HEDGE_POLICY
+
+/**
+ * @file hedgePolicy.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the HedgePolicy class that decides when the proxy sends a second copy of a slow upstream request
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <pthread.h>
+
+#define HEDGESAMPLES 1024 //Recent upstream first-byte times the hedge delay is taken from
+#define HEDGEWARMUP 32 //Samples needed before the delay follows them
+#define HEDGEREFRESH 64 //Samples between recomputing the delay
+#define HEDGEDEFAULTDELAY 10000 //Microseconds waited before hedging until enough samples exist
+#define HEDGEMINDELAY 200 //The shortest delay in microseconds, so a fast backend isn't hedged on scheduling noise
+
+using namespace std;
+
+namespace{
+/**
+ * @brief Tracks upstream first-byte times and rations hedged requests
+ *
+ * @note The hedge delay is a percentile of the recent times to first byte,
+ * so only the slowest requests are hedged. Hedges are capped at a share of
+ * the eligible requests, so a backend that is slow for everyone can't make
+ * the proxy double its load.
+ */
+class HedgePolicy
+{
+	private:
+
+	///A ring of recent first-byte times in microseconds
+	long samples[HEDGESAMPLES];
+
+	///Samples recorded in total; the next one goes at recorded % HEDGESAMPLES
+	long recorded;
+
+	///The percentile of samples waited before hedging
+	double percentile;
+
+	///The most hedges per hundred eligible requests
+	int budgetPercent;
+
+	///The current delay in microseconds
+	long delay;
+
+	///Protects everything
+	pthread_mutex_t lock;
+
+	long eligible;
+	long hedges;
+	long hedgeWins;
+	long refused;
+
+	/**
+	 * @brief Takes the percentile of the samples as the new delay
+	 *
+	 * @note The caller holds lock
+	 */
+	void recomputeDelay()
+	{
+		long count = min(recorded, (long)HEDGESAMPLES);
+		long sorted[HEDGESAMPLES];
+		copy(samples, samples + count, sorted);
+
+		long rank = min(count - 1, (long)(count * percentile / 100));
+		nth_element(sorted, sorted + rank, sorted + count);
+
+		delay = max(sorted[rank], (long)HEDGEMINDELAY);
+	}
+
+	public:
+
+	/**
+	 * @param delayPercentile The percentile of recent first-byte times to wait before hedging
+	 * @param budget The most hedges per hundred eligible requests
+	 */
+	HedgePolicy(double delayPercentile, int budget)
+	{
+		recorded = 0;
+		percentile = delayPercentile;
+		budgetPercent = budget;
+		delay = HEDGEDEFAULTDELAY;
+		eligible = 0;
+		hedges = 0;
+		hedgeWins = 0;
+		refused = 0;
+
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	/**
+	 * @brief Counts a request that could be hedged and returns how long to wait for its first byte
+	 *
+	 * @return Microseconds
+	 */
+	long begin()
+	{
+		pthread_mutex_lock(&lock);
+		eligible++;
+		long current = delay;
+		pthread_mutex_unlock(&lock);
+
+		return current;
+	}
+
+	/**
+	 * @brief Records how long an upstream took to start responding
+	 *
+	 * @param micros The time from sending the request to the first byte, or the
+	 * time waited so far if the hedge answered first
+	 */
+	void recordFirstByte(long micros)
+	{
+		pthread_mutex_lock(&lock);
+
+		samples[recorded++ % HEDGESAMPLES] = micros;
+		if(recorded >= HEDGEWARMUP && recorded % HEDGEREFRESH == 0)
+			recomputeDelay();
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief Asks to send a hedge for a request that has waited out the delay
+	 *
+	 * @return False if that would go over the budget
+	 */
+	bool tryHedge()
+	{
+		pthread_mutex_lock(&lock);
+
+		//One hedge is always allowed so the first slow request isn't stranded
+		bool allowed = hedges * 100 < eligible * budgetPercent + 100;
+		if(allowed) hedges++;
+		else refused++;
+
+		pthread_mutex_unlock(&lock);
+
+		return allowed;
+	}
+
+	/**
+	 * @brief Records which copy of a hedged request answered first
+	 */
+	void recordOutcome(bool hedgeWon)
+	{
+		if(hedgeWon) __sync_fetch_and_add(&hedgeWins, 1);
+	}
+
+	/**
+	 * @brief Prints how often requests were hedged and how often the hedge won
+	 */
+	void printStats()
+	{
+		pthread_mutex_lock(&lock);
+		cout << "Hedge delay: " << delay << " us (p" << percentile << ")\t" << "eligible: " << eligible << "\t" << "hedged: " << hedges << " (" << (eligible ? 100.0 * hedges / eligible : 0) << "%)\t" << "hedge wins: " << hedgeWins << "\t" << "over budget: " << refused << endl;
+		pthread_mutex_unlock(&lock);
+	}
+};
+}
+#endif
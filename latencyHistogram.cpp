@@ -0,0 +1,191 @@
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+/**
+ * @file latencyHistogram.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the LatencyHistogram class the client records response times in
+ */
+
+#include <iostream>
+#include <string.h>
+
+#define HISTSUBBITS 6 //Each power of two is split into 2^HISTSUBBITS buckets, about 1.6% wide
+#define HISTMAXBITS 40 //Values up to 2^HISTMAXBITS microseconds, about 12 days, are recorded exactly enough
+#define HISTBUCKETS ((HISTMAXBITS - HISTSUBBITS + 2) << HISTSUBBITS) //The number of buckets
+
+using namespace std;
+
+/**
+ * @brief A log-bucketed histogram of microsecond latencies in the style of HdrHistogram
+ *
+ * @note Values below 2^(HISTSUBBITS + 1) get a bucket each. Above that every
+ * power of two is split into 2^HISTSUBBITS equal buckets, so any recorded
+ * value is known to within about 1.6% however large it is, in a fixed 18 KB.
+ * Recording is a shift and an increment, so each thread keeps its own
+ * histogram and they are merged at the end. It has external linkage,
+ * unlike most classes here, because structs such as threadReturn and
+ * reportInterval hold one.
+ */
+class LatencyHistogram
+{
+	private:
+
+	long counts[HISTBUCKETS];
+
+	long total;
+
+	///The exact largest and smallest values, since the buckets round
+	long largest;
+	long smallest;
+
+	///The sum of the values, for the mean
+	long sum;
+
+	/**
+	 * @brief Finds the bucket a value falls in
+	 */
+	static int bucketFor(long value)
+	{
+		if(value < (1L << (HISTSUBBITS + 1))) return value < 0 ? 0 : (int)value;
+
+		int magnitude = 63 - __builtin_clzl(value);
+		if(magnitude >= HISTMAXBITS) return HISTBUCKETS - 1;
+
+		//The top HISTSUBBITS + 1 bits, whose leading one says which half of the bucket range is used
+		int shift = magnitude - HISTSUBBITS;
+		return (shift << HISTSUBBITS) + (int)(value >> shift);
+	}
+
+	/**
+	 * @brief The largest value that falls in a bucket
+	 */
+	static long highestIn(int bucket)
+	{
+		if(bucket < (1 << (HISTSUBBITS + 1))) return bucket;
+
+		int shift = (bucket >> HISTSUBBITS) - 1;
+		long sub = bucket - ((long)shift << HISTSUBBITS);
+
+		return ((sub + 1) << shift) - 1;
+	}
+
+	public:
+
+	LatencyHistogram()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		memset(counts, 0, sizeof(counts));
+		total = 0;
+		largest = 0;
+		smallest = 0;
+		sum = 0;
+	}
+
+	/**
+	 * @brief Counts one latency
+	 *
+	 * @param micros The latency in microseconds
+	 */
+	void record(long micros)
+	{
+		counts[bucketFor(micros)]++;
+
+		if(total == 0 || micros < smallest) smallest = micros;
+		if(micros > largest) largest = micros;
+
+		total++;
+		sum += micros;
+	}
+
+	/**
+	 * @brief Counts one latency in a histogram other threads or processes record into too
+	 *
+	 * @param micros The latency in microseconds
+	 */
+	void recordShared(long micros)
+	{
+		__sync_fetch_and_add(&counts[bucketFor(micros)], 1);
+		__sync_fetch_and_add(&sum, micros);
+
+		//A smallest of zero means nothing is recorded yet
+		long low = __atomic_load_n(&smallest, __ATOMIC_RELAXED);
+		while((low == 0 || micros < low) && !__atomic_compare_exchange_n(&smallest, &low, micros, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		long high = __atomic_load_n(&largest, __ATOMIC_RELAXED);
+		while(micros > high && !__atomic_compare_exchange_n(&largest, &high, micros, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		__sync_fetch_and_add(&total, 1);
+	}
+
+	/**
+	 * @brief Adds another histogram's counts to this one
+	 */
+	void merge(const LatencyHistogram& other)
+	{
+		for(int i = 0; i < HISTBUCKETS; i++)
+			counts[i] += other.counts[i];
+
+		if(other.total > 0 && (total == 0 || other.smallest < smallest)) smallest = other.smallest;
+		largest = max(largest, other.largest);
+
+		total += other.total;
+		sum += other.sum;
+	}
+
+	long count()
+	{
+		return total;
+	}
+
+	long maximum()
+	{
+		return largest;
+	}
+
+	long mean()
+	{
+		return total ? sum / total : 0;
+	}
+
+	/**
+	 * @brief Finds the latency a share of the recorded values are at or below
+	 *
+	 * @param percentile From 0 to 100
+	 * @return The highest value in the bucket the percentile falls in, capped at the largest recorded
+	 */
+	long valueAt(double percentile)
+	{
+		if(total == 0) return 0;
+
+		//The rank of the value, counting from one
+		long rank = (long)(percentile / 100 * total + 0.5);
+		rank = min(max(rank, 1L), total);
+
+		long seen = 0;
+		for(int i = 0; i < HISTBUCKETS; i++)
+		{
+			seen += counts[i];
+			if(seen >= rank)
+				return min(highestIn(i), largest);
+		}
+
+		return largest;
+	}
+
+	/**
+	 * @brief Prints the usual percentiles on one line
+	 *
+	 * @param label What the latencies were measured from
+	 */
+	void print(const char* label)
+	{
+		cout << label << ": p50 " << valueAt(50) << " us\t" << "p90 " << valueAt(90) << " us\t" << "p99 " << valueAt(99) << " us\t" << "p99.9 " << valueAt(99.9) << " us\t" << "max " << largest << " us\t" << "mean " << mean() << " us\t" << "count " << total << endl;
+	}
+};
+#endif
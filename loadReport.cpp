@@ -0,0 +1,183 @@
+#ifndef LOAD_REPORT
+#define LOAD_REPORT
+
+/**
+ * @file loadReport.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the LoadReport layout that forked client processes start on and record their results into
+ */
+
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "latencyHistogram.cpp"
+
+#define REPORTINTERVALS 1024 //The intervals a report holds; later responses are counted in the last one
+#define REPORTMAXPROCS 64 //The most generator processes a report holds totals for
+
+/**
+ * @brief The responses that completed during one interval, across every generator
+ */
+struct reportInterval
+{
+	long requests;
+	long errors;
+	long bytes;
+	LatencyHistogram latencies;
+};
+
+/**
+ * @brief What one generator process reported when it finished
+ */
+struct generatorTotals
+{
+	int pid;
+	int cpu;
+
+	///Set once the totals below are written
+	int finished;
+
+	long micros;
+	long errors;
+	long bytes;
+	long connections;
+	long completed;
+};
+
+/**
+ * @brief The shared memory a load coordinator and its forked generator processes report through
+ *
+ * @note The coordinator maps it before forking, so every generator shares
+ * it. Generators wait on a futex barrier until all of them have their
+ * threads and connections ready, then the coordinator stamps the start and
+ * wakes them together. Each response is counted in the interval it
+ * completed in with atomic adds, so the coordinator can print intervals as
+ * they pass without stopping the generators.
+ */
+struct LoadReport
+{
+	int generators;
+
+	///Generators ready to start
+	int arrived;
+
+	///Set when the run starts; the futex word
+	int started;
+
+	///The length of an interval in nanoseconds
+	long intervalNanos;
+
+	///When the run started, on CLOCK_MONOTONIC
+	struct timespec start;
+
+	generatorTotals totals[REPORTMAXPROCS];
+
+	reportInterval intervals[REPORTINTERVALS];
+
+	static long futex(int* addr, int op, int val, const struct timespec* timeout)
+	{
+		return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+	}
+
+	/**
+	 * @brief Maps a zeroed report that processes forked afterwards share
+	 *
+	 * @return The report, or NULL if it couldn't be mapped
+	 */
+	static LoadReport* create(int generators, long intervalMillis)
+	{
+		//Intervals are only backed by memory once something is counted in them
+		void* mem = mmap(NULL, sizeof(LoadReport), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(mem == MAP_FAILED) return NULL;
+
+		LoadReport* report = (LoadReport*)mem;
+		report->generators = generators;
+		report->intervalNanos = intervalMillis * 1000000L;
+
+		return report;
+	}
+
+	static void destroy(LoadReport* report)
+	{
+		munmap(report, sizeof(LoadReport));
+	}
+
+	/**
+	 * @brief Tells the coordinator a generator is ready and waits for the start
+	 */
+	void arriveAndWait()
+	{
+		__atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST);
+		futex(&arrived, FUTEX_WAKE, INT_MAX, NULL);
+
+		while(!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+			futex(&started, FUTEX_WAIT, 0, NULL);
+	}
+
+	/**
+	 * @brief Waits until a number of generators are ready
+	 *
+	 * @param count The generators still alive, so one that died doesn't hold the start forever
+	 * @return False if fewer than count have arrived, so the caller should check again
+	 */
+	bool waitForArrivals(int count)
+	{
+		int seen = __atomic_load_n(&arrived, __ATOMIC_SEQ_CST);
+		if(seen >= count) return true;
+
+		//Woken by each arrival, or gives up after a while so the caller can reap dead generators
+		struct timespec timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = 100000000;
+		futex(&arrived, FUTEX_WAIT, seen, &timeout);
+
+		return __atomic_load_n(&arrived, __ATOMIC_SEQ_CST) >= count;
+	}
+
+	/**
+	 * @brief Stamps the start and wakes every waiting generator
+	 */
+	void release()
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+		futex(&started, FUTEX_WAKE, INT_MAX, NULL);
+	}
+
+	/**
+	 * @brief The interval the current time falls in
+	 */
+	int currentInterval()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long elapsed = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+		return (int)min(max(elapsed / intervalNanos, 0L), (long)REPORTINTERVALS - 1);
+	}
+
+	/**
+	 * @brief Counts a response in the current interval
+	 */
+	void recordResponse(long micros, long bytes)
+	{
+		reportInterval& current = intervals[currentInterval()];
+
+		__sync_fetch_and_add(&current.requests, 1);
+		__sync_fetch_and_add(&current.bytes, bytes);
+		current.latencies.recordShared(micros);
+	}
+
+	/**
+	 * @brief Counts failed requests in the current interval
+	 */
+	void recordErrors(long count)
+	{
+		__sync_fetch_and_add(&intervals[currentInterval()].errors, count);
+	}
+};
+#endif
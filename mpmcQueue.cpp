@@ -0,0 +1,239 @@
+#ifndef MPMC_QUEUE
+#define MPMC_QUEUE
+
+/**
+ * @file mpmcQueue.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the MPMCQueue class used to hand accepted sockets to worker threads
+ */
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHELINE 64 //Keeps indices written by different threads on separate lines
+#define QUEUESPINS 128 //Failed pops before a consumer parks on the futex
+
+namespace{
+/**
+ * @brief A bounded lock-free multi-producer/multi-consumer ring of ints
+ *
+ * @note Based on Dmitry Vyukov's sequence-numbered array queue. Each cell's
+ * sequence number says whether it is ready to be written or read for the
+ * current lap, so producers and consumers only contend on their own index.
+ * Consumers that find the ring empty park on a futex and are only woken
+ * when a producer sees that someone is waiting.
+ */
+class MPMCQueue
+{
+	private:
+
+	/**
+	 * @brief One slot of the ring
+	 */
+	struct cell
+	{
+		///The position this cell will next be written (pos) or read (pos + 1) at
+		unsigned long sequence;
+
+		///The stored value
+		int value;
+	};
+
+	///The slots
+	cell* cells;
+
+	///The number of slots
+	unsigned long capacity;
+
+	char pad0[CACHELINE];
+
+	///The next position a producer will claim
+	unsigned long enqueuePos;
+
+	char pad1[CACHELINE];
+
+	///The next position a consumer will claim
+	unsigned long dequeuePos;
+
+	char pad2[CACHELINE];
+
+	///Bumped by producers to wake parked consumers; the futex word
+	int wakeSequence;
+
+	///The number of consumers parked or about to park
+	int waiters;
+
+	///Set once the queue is shutting down
+	bool closed;
+
+	static long futex(int* addr, int op, int val)
+	{
+		return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+	}
+
+	public:
+
+	/**
+	 * @brief Creates an empty queue
+	 *
+	 * @param size The most values the queue holds before push fails
+	 */
+	MPMCQueue(unsigned long size)
+	{
+		capacity = size > 0 ? size : 1;
+		cells = new cell[capacity];
+
+		for(unsigned long i = 0; i < capacity; i++)
+			cells[i].sequence = i;
+
+		enqueuePos = 0;
+		dequeuePos = 0;
+		wakeSequence = 0;
+		waiters = 0;
+		closed = false;
+	}
+
+	~MPMCQueue()
+	{
+		delete[] cells;
+	}
+
+	/**
+	 * @brief Adds a value without blocking
+	 *
+	 * @return False if the queue is full
+	 */
+	bool tryPush(int value)
+	{
+		unsigned long pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		cell* target;
+
+		while(true)
+		{
+			target = &cells[pos % capacity];
+			unsigned long seq = __atomic_load_n(&target->sequence, __ATOMIC_ACQUIRE);
+			long diff = (long)seq - (long)pos;
+
+			//The cell is free for this lap, try to claim it
+			if(diff == 0)
+			{
+				if(__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			}
+			//A consumer hasn't emptied it since the last lap
+			else if(diff < 0)
+				return false;
+			else
+				pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		}
+
+		target->value = value;
+		__atomic_store_n(&target->sequence, pos + 1, __ATOMIC_RELEASE);
+
+		//Only pay for the wake syscall when a consumer is parked
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&waiters, __ATOMIC_RELAXED) > 0)
+		{
+			__atomic_add_fetch(&wakeSequence, 1, __ATOMIC_SEQ_CST);
+			futex(&wakeSequence, FUTEX_WAKE_PRIVATE, 1);
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Removes a value without blocking
+	 *
+	 * @return False if the queue is empty
+	 */
+	bool tryPop(int& value)
+	{
+		unsigned long pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+		cell* target;
+
+		while(true)
+		{
+			target = &cells[pos % capacity];
+			unsigned long seq = __atomic_load_n(&target->sequence, __ATOMIC_ACQUIRE);
+			long diff = (long)seq - (long)(pos + 1);
+
+			//The cell holds a value for this lap, try to claim it
+			if(diff == 0)
+			{
+				if(__atomic_compare_exchange_n(&dequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			}
+			//Nothing has been written here yet
+			else if(diff < 0)
+				return false;
+			else
+				pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+		}
+
+		value = target->value;
+
+		//Free the cell for the producer one lap ahead
+		__atomic_store_n(&target->sequence, pos + capacity, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+	/**
+	 * @brief Removes a value, parking the calling thread while the queue is empty
+	 *
+	 * @return False if the queue was shut down
+	 */
+	bool pop(int& value)
+	{
+		while(true)
+		{
+			for(int i = 0; i < QUEUESPINS; i++)
+			{
+				if(tryPop(value)) return true;
+				if(__atomic_load_n(&closed, __ATOMIC_ACQUIRE)) return false;
+			}
+
+			__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+			int seq = __atomic_load_n(&wakeSequence, __ATOMIC_SEQ_CST);
+
+			//Check again now that producers can see this thread is waiting
+			bool found = tryPop(value);
+			bool stop = __atomic_load_n(&closed, __ATOMIC_ACQUIRE);
+
+			if(!found && !stop)
+				futex(&wakeSequence, FUTEX_WAIT_PRIVATE, seq);
+
+			__atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+
+			if(found) return true;
+			if(stop) return false;
+		}
+	}
+
+	/**
+	 * @brief Counts the values waiting, which may be stale by the time it returns
+	 */
+	unsigned long approximateSize()
+	{
+		unsigned long dequeued = __atomic_load_n(&dequeuePos, __ATOMIC_ACQUIRE);
+		unsigned long enqueued = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+
+		//Reading the pop position first keeps it from passing the push position
+		return enqueued - dequeued;
+	}
+
+	/**
+	 * @brief Makes every blocked and future pop return false
+	 */
+	void shutdown()
+	{
+		__atomic_store_n(&closed, true, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&wakeSequence, 1, __ATOMIC_SEQ_CST);
+		futex(&wakeSequence, FUTEX_WAKE_PRIVATE, INT_MAX);
+	}
+};
+}
+#endif
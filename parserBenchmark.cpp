@@ -0,0 +1,122 @@
+/**
+ * @file parserBenchmark.cpp
+ *
+ * @section DESCRIPTION
+ * Compares RequestParser against the string append/find/substr parsing the server used to do
+ *
+ * ./parserBench <iterations> <bytes per read>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <sys/time.h>
+#include "requestParser.cpp"
+
+using namespace std;
+
+static const char* sampleRequest =
+	"GET http://127.0.0.1:8000/WWW/index.html HTTP/1.1\r\n"
+	"Host: 127.0.0.1:8000\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"\r\n";
+
+static long elapsed(struct timeval& start, struct timeval& end)
+{
+	return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+}
+
+/**
+ * @brief The worker's parsing as it was: append each read, search the whole string, then copy fields out
+ */
+static long oldParse(const char* request, int length, int chunk, long iterations)
+{
+	long checksum = 0;
+
+	for(long i = 0; i < iterations; i++)
+	{
+		string input;
+		size_t headerEnd = string::npos;
+
+		for(int offset = 0; offset < length && headerEnd == string::npos; offset += chunk)
+		{
+			input.append(request + offset, min(chunk, length - offset));
+			headerEnd = input.find("\r\n\r\n");
+		}
+
+		string header = input.substr(0, headerEnd + 4);
+		input.erase(0, headerEnd + 4);
+
+		size_t methodEnd = header.find(" ");
+		string method = header.substr(0, methodEnd);
+		size_t fileEnd = header.find(" ", methodEnd + 1);
+		string file = header.substr(methodEnd + 1, fileEnd - methodEnd - 1);
+
+		string host;
+		size_t hostIdx = header.find("Host: ");
+		if(hostIdx != string::npos)
+			host = header.substr(hostIdx + 6, header.find("\r\n", hostIdx) - hostIdx - 6);
+
+		checksum += method.length() + file.length() + host.length();
+	}
+
+	return checksum;
+}
+
+/**
+ * @brief The same work with RequestParser resuming over one buffer
+ */
+static long newParse(const char* request, int length, int chunk, long iterations)
+{
+	long checksum = 0;
+	char buffer[REQUESTBUFSIZE];
+	RequestParser parser;
+
+	for(long i = 0; i < iterations; i++)
+	{
+		int buffered = 0;
+		int requestLength = PARSE_INCOMPLETE;
+		parser.reset();
+
+		while(requestLength == PARSE_INCOMPLETE && buffered < length)
+		{
+			int bytes = min(chunk, length - buffered);
+			memcpy(buffer + buffered, request + buffered, bytes);
+			buffered += bytes;
+			requestLength = parser.parse(buffer, buffered);
+		}
+
+		checksum += parser.method.length + parser.target.length + parser.findHeader("Host").length;
+	}
+
+	return checksum;
+}
+
+int main(int argc, char* argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	int chunk = argc > 2 ? atoi(argv[2]) : 255;
+	int length = strlen(sampleRequest);
+
+	cout << "# " << iterations << " requests of " << length << " bytes, read " << chunk << " bytes at a time" << endl;
+
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	long oldSum = oldParse(sampleRequest, length, chunk, iterations);
+	gettimeofday(&end, NULL);
+	long oldTime = elapsed(start, end);
+	cout << "string\t" << oldTime << "\t" << (iterations * 1000000.0 / oldTime) << " req/s" << "\t" << oldSum << endl;
+
+	gettimeofday(&start, NULL);
+	long newSum = newParse(sampleRequest, length, chunk, iterations);
+	gettimeofday(&end, NULL);
+	long newTime = elapsed(start, end);
+	cout << "parser\t" << newTime << "\t" << (iterations * 1000000.0 / newTime) << " req/s" << "\t" << newSum << endl;
+}
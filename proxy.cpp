@@ -14,7 +14,22 @@
 #include <errno.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include "server.cpp"
+#include "upstreamPool.cpp"
+#include "responseCache.cpp"
+#include "diskCache.cpp"
+#include "resolverCache.cpp"
+#include "requestCoalescer.cpp"
+#include "hedgePolicy.cpp"
+
+#define RELAYPIPESIZE 65536 //The most bytes a relay holds between the upstream and client sockets
+#define FIRSTBYTEMILLIS 10000 //The longest a hedgeable request waits for either server to start responding before the client gets a 504
+#define RINGCHECKMILLIS 250 //How long a relay waits on a shared memory ring before checking its server is still registered
 //#include "client.cpp"
 
 namespace{
@@ -24,142 +39,1362 @@ class HTTP_Proxy : public virtual HTTP_Server
 	
 	int remoteServerPort;
 	
-	public:
-	HTTP_Proxy(int recvPort, int acceptQueueSize, int remotePort) 
-		: HTTP_Server(recvPort, acceptQueueSize)
+	///How files are fetched from a registered server on this machine
+	DataMethod localMethod;
+	
+	///How requests for a registered server are spread over all of them
+	ServerRegistry::BalanceMode balanceMode;
+	
+	///Requests sent to each registered server by port, when balancing
+	map<int, long> balancedRequests;
+	
+	///Protects balancedRequests
+	pthread_mutex_t balanceLock;
+	
+	///The submission queues of local servers by port
+	map<int, SubmissionQueue*> submissionQueues;
+	
+	///Protects submissionQueues
+	pthread_mutex_t queueLock;
+	
+	///SHBUFF requests posted to a server's submission queue
+	long queuedRequests;
+	
+	///SHBUFF requests sent over a TCP control connection because the server had no queue or it was full
+	long controlRequests;
+	
+	/**
+	 * @brief What a ring relay keeps of a response, so it can be cached and shared like one fetched over TCP
+	 */
+	struct ringCopy
 	{
-		remoteServerPort = remotePort;
+		///The origin and path
+		string key;
+		
+		///The shared response to fill, or NULL
+		inFlightResponse* flight;
+		
+		///The response until its header is complete, then the body unless it is shared
+		string kept;
+		
+		///The header as clients receive it, empty until it is complete
+		string header;
+		
+		long contentLength;
+		
+		///Whether the response may go in the memory or disk cache
+		bool cacheable;
+		
+		///Whether the body goes into flight
+		bool shared;
+		
+		///Set once the response turned out to be neither cacheable nor shareable
+		bool dropped;
+	};
+	
+	/**
+	 * @brief Finds the submission queue of the server on a port, mapping it the first time
+	 * 
+	 * @return The queue, or NULL if the server doesn't have one
+	 * 
+	 * @note A queue left by a server that has since exited is replaced by its
+	 * successor's. The old one stays mapped, since other threads may be using it.
+	 */
+	SubmissionQueue* submissionQueue(int destPort)
+	{
+		int pid = registry->serverPid(destPort);
+		
+		pthread_mutex_lock(&queueLock);
+		
+		SubmissionQueue*& queue = submissionQueues[destPort];
+		if(!queue || !queue->isOpen() || queue->pid != pid)
+			queue = SubmissionQueue::attach(destPort);
+		
+		SubmissionQueue* found = queue && queue->pid == pid ? queue : NULL;
+		
+		pthread_mutex_unlock(&queueLock);
+		
+		return found;
 	}
 	
-	virtual void parseHTTPRequest(string fileName, int socketNum, DataMethod method, string host, int altPort)
-	{		
-		struct sockaddr_in serv_addr;
-		hostent *server = host.length() == 0 ? gethostbyname("127.0.0.1") : gethostbyname(host.c_str());
+	/**
+	 * @brief Fetches a file from a local server through its submission queue
+	 * 
+	 * @param fileName The file to request
+	 * @param socketNum The client's socket
+	 * @param destPort The port of the local server
+	 * @param start When the client's request was received
+	 * @param copy Where the response is kept for the caches and other requests, or NULL
+	 * @return False if the server has no queue or it is full, so the request should use a control connection
+	 * 
+	 * @note The proxy claims the segment itself, so the response starts in its
+	 * first slot without any reply over a socket. A segment the server
+	 * couldn't map is handed back and the request goes over a control
+	 * connection instead. One the server stopped filling is never handed
+	 * back, since the proxy can't tell what state it was left in.
+	 */
+	bool relaySubmitted(string fileName, int socketNum, int destPort, const struct timeval& start, ringCopy* copy)
+	{
+		SubmissionQueue* queue = submissionQueue(destPort);
+		if(!queue) return false;
 		
-	    struct ifaddrs * ifAddrStruct=NULL;
-		struct ifaddrs * ifa=NULL;
-		void * tmpAddrPtr=NULL;
+		int shIdx = acquireSharedMem();
+		if(!queue->trySubmit(fileName, shIdx))
+		{
+			releaseSharedMem(shIdx);
+			return false;
+		}
 		
-		//Determine the port to use
-		int destPort = altPort ? altPort : 80;
+		__sync_fetch_and_add(&queuedRequests, 1);
 		
-		if(host.length() == 0) destPort = remoteServerPort;
-
-		//Get a linked list of all local addresses
-		getifaddrs(&ifAddrStruct);
+		//Nothing is published into a rejected segment, so wait for the first slot or the rejection
+		SharedRing* ring = shMemPool->segment(shIdx);
+		int length;
+		while(!ring->peek(length, RINGCHECKMILLIS) && serverAlive(destPort, queue->pid))
+			if(queue->wasRejected(shIdx))
+			{
+				releaseSharedMem(shIdx);
+				return false;
+			}
 		
-		bzero((char *) &serv_addr, sizeof(serv_addr));
-		serv_addr.sin_family = AF_INET;
-		bcopy((char *)server->h_addr,
-		  (char *)&serv_addr.sin_addr.s_addr,
-		  server->h_length);
-		serv_addr.sin_port = htons(destPort);
+		if(relayRing(ring, socketNum, start, destPort, queue->pid, copy))
+			releaseSharedMem(shIdx);
 		
-		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		return true;
+	}
+	
+	/**
+	 * @brief Checks that the server a ring is waiting on is still registered and beating
+	 * 
+	 * @param destPort The port of the local server
+	 * @param serverPid The process the request went to
+	 */
+	bool serverAlive(int destPort, int serverPid)
+	{
+		return serverPid > 0 && registry && registry->serverPid(destPort) == serverPid;
+	}
+	
+	/**
+	 * @brief Fetches a file's descriptor from a local server and sends the response straight from it
+	 * 
+	 * @param fileName The file to request
+	 * @param socketNum The client's socket
+	 * @param destPort The port of the local server
+	 * @param start When the client's request was received
+	 * @return False if the server couldn't be asked or didn't reply, so the request should go over TCP
+	 * 
+	 * @note Nothing is sent to the client before the reply arrives, so a
+	 * failed request can still be fetched another way
+	 */
+	bool relayPassedFile(string fileName, int socketNum, int destPort, const struct timeval& start)
+	{
+		struct sockaddr_un addr;
+		socklen_t addrLength = fdPassAddress(destPort, addr);
 		
-		int connected = connect(sockfd,(struct sockaddr *)&serv_addr,sizeof(serv_addr));
+		int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(connect(sockfd, (struct sockaddr *)&addr, addrLength) < 0)
+		{
+			close(sockfd);
+			return false;
+		}
 		
-		bool onLocal = false;
-		bool useShared = false;
+		string req = "FDPASS " + fileName + " HTTP/1.0\r\n\r\n";
+		write(sockfd, req.c_str(), req.length());
 		
-		//See if the http server is on the local machine
-		//http://stackoverflow.com/questions/212528/linux-c-get-the-ip-address-of-local-computer
-		for(ifa = ifAddrStruct; ifa != NULL; ifa = ifa->ifa_next)
+		//The reply and header arrive in one message, with the file attached
+		fdPassReply reply;
+		char header[REQUESTBUFSIZE];
+		struct iovec parts[2];
+		parts[0].iov_base = &reply;
+		parts[0].iov_len = sizeof(reply);
+		parts[1].iov_base = header;
+		parts[1].iov_len = sizeof(header);
+		
+		char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = parts;
+		msg.msg_iovlen = 2;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		
+		int received = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+		close(sockfd);
+		
+		int fileFd = -1;
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if(received > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fileFd, CMSG_DATA(cmsg), sizeof(int));
+		
+		if(received < (int)sizeof(reply) || reply.headerLength > received - (int)sizeof(reply))
 		{
-			for(int i = 0; server->h_addr_list[i] != NULL; i++)
-				if(memcmp(server->h_addr_list[i], ifa->ifa_addr->sa_data, 14))
-					onLocal = true;
+			if(fileFd >= 0) close(fileFd);
+			return false;
 		}
 		
-		delete ifAddrStruct;
+		send(socketNum, header, reply.headerLength, MSG_NOSIGNAL | (fileFd >= 0 ? MSG_MORE : 0));
+		recordFirstByte(start);
 		
-		//Determine if the local server is ours
-		if(onLocal)
+		long total = reply.headerLength;
+		
+		//The body goes from the server's page cache to the client without being copied by either process
+		if(fileFd >= 0)
 		{
-			//unregister the server in shared memory
-			for(int i = 0; i < MAXSERVERS; i++)
-				if(serverList[i] == destPort)
-				{
-					#ifdef USESHARED
-					useShared = true;
-					#endif
-				}
+			off_t offset = reply.offset;
+			off_t length = reply.length;
+			while(length > 0)
+			{
+				int sent = sendFile(socketNum, fileFd, &offset, length);
+				if(sent <= 0) break;
+				
+				length -= sent;
+				total += sent;
+			}
+			close(fileFd);
 		}
-			
 		
-		string req = "";
-#ifdef SHMEM
-		if(useShared)
-			req = "SHBUFF " + fileName + " HTTP/1.0\r\n\r\n";
-		else
-#endif
-		req = "GET " + fileName + " HTTP/1.0\r\n\r\n";
+		recordRelay(total);
+		return true;
+	}
+	
+	/**
+	 * @brief Answers a request whose origin couldn't be resolved or reached
+	 */
+	static void sendBadGateway(int socketNum)
+	{
+		string response = buildHeader("502 Bad Gateway", 11) + CLOSETAIL + "Bad Gateway";
+		send(socketNum, response.c_str(), response.length(), MSG_NOSIGNAL);
+	}
+	
+	/**
+	 * @brief Answers a request whose upstream never started responding
+	 */
+	static void sendGatewayTimeout(int socketNum)
+	{
+		string response = buildHeader("504 Gateway Timeout", 15) + CLOSETAIL + "Gateway Timeout";
+		send(socketNum, response.c_str(), response.length(), MSG_NOSIGNAL);
+	}
+	
+	/**
+	 * @brief Notes the time to the first byte sent to a client
+	 */
+	void recordFirstByte(const struct timeval& start)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		long elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
 		
-		int err = write(sockfd, req.c_str(), strlen(req.c_str()));
+		__sync_fetch_and_add(&firstByteTotal, elapsed);
 		
-		//Read back from the socket
+		long seen = firstByteMax;
+		while(elapsed > seen && !__sync_bool_compare_and_swap(&firstByteMax, seen, elapsed))
+			seen = firstByteMax;
+	}
+	
+	/**
+	 * @brief Counts a finished relay
+	 */
+	void recordRelay(long bytes)
+	{
+		__sync_fetch_and_add(&relays, 1);
+		__sync_fetch_and_add(&relayedBytes, bytes);
+	}
+	
+	/**
+	 * @brief Forwards an upstream socket to the client as bytes arrive
+	 * 
+	 * @param sockfd The upstream socket
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received
+	 * @param remaining The bytes to forward, or -1 to forward until upstream EOF
+	 * @param alreadySent Bytes of this response the caller has already sent the client
+	 * @return True if remaining bytes were forwarded before either side stopped
+	 * 
+	 * @note The bytes move through a pipe with splice, so they never enter
+	 * user space. Both sockets block, so a slow client stops the proxy from
+	 * reading upstream once the pipe is full; at most RELAYPIPESIZE bytes
+	 * are held per relay.
+	 */
+	bool relaySocket(int sockfd, int socketNum, const struct timeval& start, long remaining = -1, long alreadySent = 0)
+	{
+		int pipefds[2];
+		long total = alreadySent;
+		
+		if(pipe2(pipefds, O_CLOEXEC) < 0)
+			return relayBuffered(sockfd, socketNum, start, remaining, alreadySent);
+		
+		fcntl(pipefds[1], F_SETPIPE_SZ, RELAYPIPESIZE);
+		
+		while(remaining != 0)
+		{
+			long request = remaining < 0 ? RELAYPIPESIZE : min(remaining, (long)RELAYPIPESIZE);
+			int in = splice(sockfd, NULL, pipefds[1], NULL, request, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(in <= 0) break;
+			
+			if(total == 0) recordFirstByte(start);
+			if(remaining > 0) remaining -= in;
+			
+			//Drain the pipe before reading upstream again
+			int out = 0;
+			while(in > 0 && (out = splice(pipefds[0], NULL, socketNum, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+			{
+				in -= out;
+				total += out;
+			}
+			
+			//The client went away
+			if(out <= 0) break;
+		}
+		
+		close(pipefds[0]);
+		close(pipefds[1]);
+		
+		recordRelay(total);
+		return remaining <= 0;
+	}
+	
+	/**
+	 * @brief Forwards an upstream socket to the client through a fixed buffer, for when splice isn't available
+	 * 
+	 * @note Takes the same arguments as relaySocket
+	 */
+	bool relayBuffered(int sockfd, int socketNum, const struct timeval& start, long remaining, long alreadySent)
+	{
 		char buf[SENDSIZE];
-		string contents = "";
+		long total = alreadySent;
+		int bytesRead;
 		
-#ifdef SHMEM
-		int shIdx = 0;
-		if(useShared)
+		while(remaining != 0 && (bytesRead = read(sockfd, buf, remaining < 0 ? sizeof(buf) : min(remaining, (long)sizeof(buf)))) > 0)
 		{
-			//Get the shared memory index
-			err = read(sockfd, buf, sizeof(buf));
-			bcopy(buf, &shIdx, sizeof(int));
-			//cout << "ShMem: " << shIdx << endl;
+			if(total == 0) recordFirstByte(start);
+			if(remaining > 0) remaining -= bytesRead;
 			
-			if(shIdx >= SHNUM) return;//ERROR!
+			if(send(socketNum, buf, bytesRead, MSG_NOSIGNAL) != bytesRead) break;
+			total += bytesRead;
 		}
-#endif
 		
-		do
+		recordRelay(total);
+		return remaining <= 0;
+	}
+	
+	/**
+	 * @brief Forwards an upstream socket to the client while keeping a copy of the body
+	 * 
+	 * @param sockfd The upstream socket
+	 * @param socketNum The client's socket
+	 * @param remaining The body bytes still to forward
+	 * @param body The body bytes already received, which the rest are appended to
+	 * @param alreadySent Bytes of this response the caller has already sent the client
+	 * @param flight The shared response body belongs to, told of each append, or NULL
+	 * @return True if the whole body was received; it is still read if the client goes away
+	 */
+	bool relayAndKeep(int sockfd, int socketNum, long remaining, string& body, long alreadySent, inFlightResponse* flight)
+	{
+		//Read as much as a splice relay moves at once, so the copy costs few extra syscalls
+		char buf[RELAYPIPESIZE];
+		long total = alreadySent;
+		bool clientGone = false;
+		int bytesRead;
+		
+		body.reserve(body.length() + remaining);
+		
+		while(remaining > 0 && (bytesRead = read(sockfd, buf, min(remaining, (long)sizeof(buf)))) > 0)
 		{
-#ifdef SHMEM
-			if(useShared)
+			remaining -= bytesRead;
+			body.append(buf, bytesRead);
+			if(flight) flight->advance();
+			
+			if(!clientGone && send(socketNum, buf, bytesRead, MSG_NOSIGNAL) != bytesRead)
+				clientGone = true;
+			
+			if(!clientGone) total += bytesRead;
+		}
+		
+		recordRelay(total);
+		return remaining == 0;
+	}
+	
+	/**
+	 * @brief Sends buffers to a client with gather writes
+	 * 
+	 * @param parts The buffers, which are advanced past whatever is sent
+	 * @param count The number of buffers
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received, if these are the response's first bytes, or NULL
+	 * @return The bytes sent, which are fewer than asked for only if the client went away
+	 * 
+	 * @note sendmsg rather than writev, so a closed client can't raise SIGPIPE
+	 */
+	long sendParts(struct iovec* parts, int count, int socketNum, const struct timeval* start)
+	{
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = parts;
+		msg.msg_iovlen = count;
+		
+		long total = 0;
+		
+		//Only a send buffer too small for everything takes more than one call
+		while(msg.msg_iovlen > 0)
+		{
+			int sent = sendmsg(socketNum, &msg, MSG_NOSIGNAL);
+			if(sent <= 0) break;
+			
+			if(total == 0 && start) recordFirstByte(*start);
+			total += sent;
+			
+			while(msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
 			{
-				//cout << "before" << endl;
-				pthread_mutex_lock((pthread_mutex_t*)(shMem[shIdx] + 1));
-				
-				char* cond = (char*)(shMem[shIdx] + 1) + sizeof(pthread_mutex_t);
+				sent -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			}
+			if(msg.msg_iovlen > 0)
+			{
+				msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+				msg.msg_iov->iov_len -= sent;
+			}
+		}
+		
+		return total;
+	}
+	
+	/**
+	 * @brief Sends a cached response with one gather write
+	 * 
+	 * @param header The response header
+	 * @param body The body
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received
+	 */
+	void serveCached(const string& header, const string& body, int socketNum, const struct timeval& start)
+	{
+		struct iovec parts[2];
+		parts[0].iov_base = (void*)header.data();
+		parts[0].iov_len = header.length();
+		parts[1].iov_base = (void*)body.data();
+		parts[1].iov_len = body.length();
+		
+		recordRelay(sendParts(parts, 2, socketNum, &start));
+	}
+	
+	/**
+	 * @brief Streams a response another request is fetching to this request's client
+	 * 
+	 * @param flight The shared response
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received
+	 * @param sentBytes Set to the bytes sent
+	 * @return False if the response couldn't be shared and the caller must fetch it
+	 * 
+	 * @note The header goes out with the first body bytes
+	 */
+	bool followFlight(inFlightResponse* flight, int socketNum, const struct timeval& start, long& sentBytes)
+	{
+		size_t sent = 0;
+		size_t available;
+		sentBytes = 0;
+		
+		while(true)
+		{
+			int state = flight->waitPast(sent, available);
+			
+			//The header is set before streaming starts, so it stays empty if it never did
+			if(flight->header.empty())
+				return false;
+			
+			struct iovec parts[2];
+			int count = 0;
+			if(sentBytes == 0)
+			{
+				parts[count].iov_base = (void*)flight->header.data();
+				parts[count++].iov_len = flight->header.length();
+			}
+			parts[count].iov_base = (void*)(flight->body.data() + sent);
+			parts[count++].iov_len = available - sent;
+			
+			long wanted = (sentBytes == 0 ? flight->header.length() : 0) + available - sent;
+			long out = sendParts(parts, count, socketNum, sentBytes == 0 ? &start : NULL);
+			sentBytes += out;
+			sent = available;
+			
+			if(out < wanted || state != inFlightResponse::STREAMING)
+				break;
+		}
+		
+		recordRelay(sentBytes);
+		return true;
+	}
+	
+	/**
+	 * @brief Waits for an upstream to start responding, racing a copy of the request on another local server if it is slow
+	 * 
+	 * @param sockfd The connection the request was sent on
+	 * @param req The request
+	 * @param serv_addr The upstream's address
+	 * @param hedged Set to true if the copy answered first
+	 * @return The connection to read the response from; the other one is closed, which cancels its request.
+	 * -1 if neither started responding within FIRSTBYTEMILLIS, and both are closed.
+	 * 
+	 * @note The copy goes to the least loaded of two other registered servers,
+	 * and only if the hedge budget allows it. A connection that fails is
+	 * dropped from the race, and the upstream's is returned if both fail, so
+	 * reading it reports the failure.
+	 */
+	int awaitFirstByte(int sockfd, const string& req, const struct sockaddr_in& serv_addr, bool& hedged)
+	{
+		hedged = false;
+		
+		struct timeval sent;
+		gettimeofday(&sent, NULL);
+		
+		long delay = hedger->begin();
+		struct timespec timeout;
+		timeout.tv_sec = delay / 1000000;
+		timeout.tv_nsec = (delay % 1000000) * 1000;
+		
+		struct pollfd fds[2];
+		fds[0].fd = sockfd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		
+		//Readable or failed within the delay; reading the upstream tells which
+		if(ppoll(fds, 1, &timeout, NULL) > 0)
+		{
+			recordUpstreamFirstByte(sent);
+			return sockfd;
+		}
+		
+		int hedgefd = -1;
+		int port = registry->pickServer(0, ServerRegistry::POWER_OF_TWO, ntohs(serv_addr.sin_port));
+		
+		if(port > 0 && hedger->tryHedge())
+		{
+			struct sockaddr_in hedge_addr = serv_addr;
+			hedge_addr.sin_port = htons(port);
+			
+			hedgefd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if(connect(hedgefd, (struct sockaddr *)&hedge_addr, sizeof(hedge_addr)) < 0 || send(hedgefd, req.c_str(), req.length(), MSG_NOSIGNAL) != (int)req.length())
+			{
+				close(hedgefd);
+				hedgefd = -1;
+			}
+		}
+		
+		fds[1].fd = hedgefd;
+		fds[1].events = POLLIN;
+		
+		//A negative descriptor is ignored, so without a hedge this just waits for the upstream
+		int winner = -1;
+		while(winner < 0)
+		{
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			long waited = (now.tv_sec - sent.tv_sec) * 1000 + (now.tv_usec - sent.tv_usec) / 1000;
+			
+			fds[0].revents = 0;
+			fds[1].revents = 0;
+			
+			int ready = poll(fds, 2, max(FIRSTBYTEMILLIS - waited, 0L));
+			if(ready < 0 && errno == EINTR) continue;
+			
+			if(ready <= 0)
+			{
+				close(sockfd);
+				if(hedgefd >= 0) close(hedgefd);
+				return -1;
+			}
+			
+			//On a tie the upstream wins, since its connection may go back to the pool
+			for(int i = 0; i < 2 && winner < 0; i++)
+				if(fds[i].revents & POLLIN) winner = i;
+			
+			if(winner >= 0) break;
+			
+			//Error or hang-up without a response; keep waiting on the other if it is still racing
+			for(int i = 0; i < 2; i++)
+				if(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) fds[i].fd = -1;
+			
+			if(fds[0].fd < 0 && fds[1].fd < 0) winner = 0;
+		}
+		
+		recordUpstreamFirstByte(sent);
+		
+		if(hedgefd < 0) return sockfd;
+		
+		hedged = winner == 1;
+		hedger->recordOutcome(hedged);
+		
+		close(hedged ? sockfd : hedgefd);
+		return hedged ? hedgefd : sockfd;
+	}
+	
+	/**
+	 * @brief Adds the time a hedgeable request took to start responding to the hedge delay's samples
+	 */
+	void recordUpstreamFirstByte(const struct timeval& sent)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		hedger->recordFirstByte((now.tv_sec - sent.tv_sec) * 1000000 + (now.tv_usec - sent.tv_usec));
+	}
+	
+	/**
+	 * @brief Forwards an origin's response, sharing one fetch among concurrent requests for the same file
+	 * 
+	 * @note Takes the same arguments as fetchUpstream
+	 */
+	void relayUpstream(const string& origin, const string& upstream, struct sockaddr_in& serv_addr, string fileName, string host, int socketNum, const struct timeval& start, bool hedgeable)
+	{
+		inFlightResponse* flight = NULL;
+		
+		if(coalescer)
+		{
+			bool leader;
+			flight = coalescer->join(origin + fileName, leader);
+			
+			if(!leader)
+			{
+				long sentBytes;
+				bool served = followFlight(flight, socketNum, start, sentBytes);
+				coalescer->release(flight, sentBytes, !served);
 				
-				while(*(shMem[shIdx]) != MODIFIED)
+				if(served) return;
+				flight = NULL;
+			}
+		}
+		
+		fetchUpstream(origin, upstream, serv_addr, fileName, host, socketNum, start, flight, hedgeable);
+		
+		if(flight) coalescer->finish(flight);
+	}
+	
+	/**
+	 * @brief Fetches a file from an origin and forwards the response, framing it by its Content-Length
+	 * 
+	 * @param origin The "host:port" the client asked for; with the file name it is the response cache key
+	 * @param upstream The "host:port" actually fetched from, which differs from origin when local servers are balanced
+	 * @param serv_addr The upstream's address, used when no idle connection is available
+	 * @param fileName The file to request
+	 * @param host The Host header to send
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received
+	 * @param flight The shared response to fill for other requests, or NULL
+	 * @param hedgeable Whether the upstream is a registered local server another one can stand in for
+	 * 
+	 * @note With an upstream pool the request is HTTP/1.1 and the connection
+	 * goes back to the pool only if the response was framed with
+	 * Content-Length, forwarded completely, and the origin didn't close it. A
+	 * reused connection that fails before any response bytes arrive was closed
+	 * by the origin while idle, so the request is retried once on a new one.
+	 * If no response arrives at all the client gets a 502.
+	 * With a response cache or disk cache, a 200 response small enough for
+	 * either is read through user space so it can be offered to them, and so is
+	 * one being shared with other requests; anything else is spliced. With
+	 * hedging, a hedgeable request that is slow to start is raced against a
+	 * copy sent to another server.
+	 */
+	void fetchUpstream(const string& origin, const string& upstream, struct sockaddr_in& serv_addr, string fileName, string host, int socketNum, const struct timeval& start, inFlightResponse* flight, bool hedgeable)
+	{
+		string req = "GET " + fileName + (upstreamPool ? " HTTP/1.1" : " HTTP/1.0") + "\r\nHost: " + host + "\r\n\r\n";
+		
+		for(int attempt = 0; attempt < 2; attempt++)
+		{
+			int sockfd = upstreamPool ? upstreamPool->checkout(upstream) : -1;
+			bool reused = sockfd >= 0;
+			
+			if(!reused)
+			{
+				sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
 				{
-					//cout << "waiting" << endl;
-					pthread_cond_wait((pthread_cond_t*) cond, (pthread_mutex_t*)(shMem[shIdx] + 1));
+					close(sockfd);
+					break;
 				}
+			}
+			
+			//Read until the header is complete; the status line splits like a request line
+			char header[REQUESTBUFSIZE];
+			int buffered = 0;
+			int headerLength = PARSE_INCOMPLETE;
+			RequestParser parser;
+			bool hedged = false;
+			
+			if(send(sockfd, req.c_str(), req.length(), MSG_NOSIGNAL) == (int)req.length())
+			{
+				if(hedgeable && hedger)
+					sockfd = awaitFirstByte(sockfd, req, serv_addr, hedged);
 				
-				char* mutexEnd = (char*)(shMem[shIdx] + 1) + sizeof(pthread_mutex_t) + sizeof(pthread_cond_t);
-				char* dataStart = mutexEnd + sizeof(int);
-				
-				bcopy(mutexEnd, &err, sizeof(int));
-				bcopy(dataStart, buf, err);
-				
-				//Mark the buffer as being read
-				*(shMem[shIdx]) = READ;
-				
-				//cout << "read" << endl;
+				if(sockfd < 0)
+				{
+					sendGatewayTimeout(socketNum);
+					return;
+				}
 				
-				pthread_cond_signal((pthread_cond_t*)cond);
+				while((headerLength = parser.parse(header, buffered)) == PARSE_INCOMPLETE && buffered < (int)sizeof(header))
+				{
+					int bytesRead = read(sockfd, header + buffered, sizeof(header) - buffered);
+					if(bytesRead <= 0) break;
+					
+					buffered += bytesRead;
+				}
+			}
+			
+			if(buffered == 0)
+			{
+				close(sockfd);
 				
-				pthread_mutex_unlock((pthread_mutex_t*)(shMem[shIdx] + 1));
+				if(reused) continue;
+				break;
+			}
+			
+			//Without a length the response ends at EOF and the connection can't be kept
+			slice lengthField = parser.findHeader("Content-Length");
+			if(headerLength <= 0 || !lengthField.data)
+			{
+				send(socketNum, header, buffered, MSG_NOSIGNAL);
+				recordFirstByte(start);
 				
-				//cout << "after" << endl;
+				relaySocket(sockfd, socketNum, start, -1, buffered);
+				close(sockfd);
+				return;
+			}
+			
+			long contentLength = atol(string(lengthField.data, lengthField.length).c_str());
+			long bodyRemaining = contentLength - (buffered - headerLength);
+			
+			//The upstream connection may persist but the client's doesn't, so replace the Connection field
+			string clientHeader(header, (parser.headerCount > 0 ? parser.headers[0].name.data : header + headerLength - 2) - header);
+			for(int i = 0; i < parser.headerCount; i++)
+				if(!parser.headers[i].name.equalsIgnoreCase("Connection"))
+					clientHeader.append(parser.headers[i].name.data, parser.headers[i].name.length).append(": ").append(parser.headers[i].value.data, parser.headers[i].value.length).append("\r\n");
+			clientHeader += CLOSETAIL;
+			
+			size_t responseSize = clientHeader.length() + contentLength;
+			bool inMemory = responseCache && responseSize <= responseCache->maxObjectSize();
+			bool onDisk = diskCache && responseSize <= diskCache->maxObjectSize();
+			bool cacheable = (inMemory || onDisk) && bodyRemaining >= 0 && parser.target.equals("200");
+			bool shared = flight && bodyRemaining >= 0 && responseSize <= coalescer->maxResponseSize();
+			
+			//A shared body is reserved in full before followers may read it, so it never moves
+			string ownBody;
+			string& body = shared ? flight->body : ownBody;
+			body.assign(header + headerLength, buffered - headerLength);
+			if(shared)
+			{
+				body.reserve(contentLength);
+				flight->start(clientHeader, contentLength);
+			}
+			
+			struct iovec parts[2];
+			parts[0].iov_base = (void*)clientHeader.data();
+			parts[0].iov_len = clientHeader.length();
+			parts[1].iov_base = (void*)body.data();
+			parts[1].iov_len = body.length();
+			
+			struct msghdr msg;
+			bzero(&msg, sizeof(msg));
+			msg.msg_iov = parts;
+			msg.msg_iovlen = 2;
+			
+			sendmsg(socketNum, &msg, MSG_NOSIGNAL);
+			recordFirstByte(start);
+			
+			bool complete;
+			if(cacheable || shared)
+			{
+				complete = relayAndKeep(sockfd, socketNum, bodyRemaining, body, clientHeader.length() + body.length(), shared ? flight : NULL);
+				if(complete && cacheable && inMemory)
+					responseCache->insert(origin + fileName, clientHeader, body);
+				if(complete && cacheable && onDisk)
+					diskCache->insert(origin + fileName, clientHeader, body);
 			}
 			else
-#endif
-			err = read(sockfd, buf, sizeof(buf));
+				complete = bodyRemaining >= 0 && relaySocket(sockfd, socketNum, start, bodyRemaining, clientHeader.length() + body.length());
+			
+			if(responseCache) responseCache->recordFetch(origin + fileName, clientHeader.length() + contentLength);
 			
-			if(err > 0) contents += string(buf, err);
+			bool keepAlive = parser.method.equals("HTTP/1.1") && !parser.findHeader("Connection").equalsIgnoreCase("close");
+			
+			//A hedge's connection is to a different server than the pool key names
+			if(upstreamPool && complete && keepAlive && !hedged)
+				upstreamPool->checkin(upstream, sockfd);
+			else
+				close(sockfd);
 			
-		}while(err > 0);
+			return;
+		}
+		
+		//Nothing has been sent to the client, so it can still be told the origin failed
+		sendBadGateway(socketNum);
+	}
+	
+	/**
+	 * @brief Forwards a shared memory ring to the client one slot at a time
+	 * 
+	 * @param ring The ring the server is filling
+	 * @param socketNum The client's socket
+	 * @param start When the client's request was received
+	 * @param destPort The port of the local server
+	 * @param serverPid The process filling the ring
+	 * @param copy Where the response is kept for the caches and other requests, or NULL
+	 * @return False if the server went away before ending the response, so the ring must not be reused
+	 * 
+	 * @note A slot is released only after it is sent, so a slow client holds
+	 * the server back once the ring is full. If the client goes away the ring
+	 * is still drained so the server can finish. While the ring is empty the
+	 * server's registry entry is checked every RINGCHECKMILLIS; once it is
+	 * gone or stale the client gets a 502, or a cut-short response if some of
+	 * it was already sent.
+	 */
+	bool relayRing(SharedRing* ring, int socketNum, const struct timeval& start, int destPort, int serverPid, ringCopy* copy = NULL)
+	{
+		long total = 0;
+		bool clientGone = false;
+		int length;
+		
+		while(true)
+		{
+			const char* slot;
+			while(!(slot = ring->peek(length, RINGCHECKMILLIS)))
+				if(!serverAlive(destPort, serverPid))
+				{
+					if(total == 0 && !clientGone) sendBadGateway(socketNum);
+					recordRelay(total);
+					return false;
+				}
+			
+			if(length == 0)
+			{
+				ring->release();
+				if(copy) finishCopy(*copy);
+				break;
+			}
+			
+			if(total == 0) recordFirstByte(start);
+			
+			for(int sent = 0; !clientGone && sent < length; )
+			{
+				int out = send(socketNum, slot + sent, length - sent, MSG_NOSIGNAL);
+				if(out <= 0) clientGone = true;
+				else sent += out;
+			}
+			
+			if(!clientGone) total += length;
+			
+			//Kept even once the client is gone, as relayAndKeep does
+			if(copy) keepSlot(*copy, slot, length);
+			ring->release();
+		}
+		
+		recordRelay(total);
+		return true;
+	}
+	
+	/**
+	 * @brief Fetches a file from a local server through shared memory, sharing the fetch and caching the response like a TCP fetch
+	 * 
+	 * @param key The origin and path the response is cached and shared under
+	 * @param fileName The file to request
+	 * @param socketNum The client's socket
+	 * @param serv_addr The server's address, for a control connection
+	 * @param destPort The port of the local server
+	 * @param start When the client's request was received
+	 * 
+	 * @note The request goes through the server's submission queue, or over
+	 * a TCP control connection if that can't take it
+	 */
+	void relayShared(const string& key, string fileName, int socketNum, struct sockaddr_in& serv_addr, int destPort, const struct timeval& start)
+	{
+		inFlightResponse* flight = NULL;
+		
+		if(coalescer)
+		{
+			bool leader;
+			flight = coalescer->join(key, leader);
+			
+			if(!leader)
+			{
+				long sentBytes;
+				bool served = followFlight(flight, socketNum, start, sentBytes);
+				coalescer->release(flight, sentBytes, !served);
+				
+				if(served) return;
+				flight = NULL;
+			}
+		}
+		
+		ringCopy copy;
+		copy.key = key;
+		copy.flight = flight;
+		copy.contentLength = -1;
+		copy.cacheable = false;
+		copy.shared = false;
+		copy.dropped = false;
+		ringCopy* keep = responseCache || diskCache || flight ? &copy : NULL;
+		
+		if(!relaySubmitted(fileName, socketNum, destPort, start, keep))
+		{
+			__sync_fetch_and_add(&controlRequests, 1);
+			relayControl(fileName, socketNum, serv_addr, destPort, start, keep);
+		}
+		
+		if(flight) coalescer->finish(flight);
+	}
+	
+	/**
+	 * @brief Asks a local server over TCP for a shared memory segment holding a file, and relays it
+	 * 
+	 * @note Takes the same arguments as relaySubmitted, and the server's address
+	 */
+	void relayControl(string fileName, int socketNum, struct sockaddr_in& serv_addr, int destPort, const struct timeval& start, ringCopy* copy)
+	{
+		//The server filling a ring is watched while the proxy waits on it
+		int serverPid = registry->serverPid(destPort);
+		
+		int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+		{
+			close(sockfd);
+			sendBadGateway(socketNum);
+			return;
+		}
+		
+		string req = "SHBUFF " + fileName + " HTTP/1.0\r\n\r\n";
+		write(sockfd, req.c_str(), req.length());
+		
+		//Get the shared memory index
+		int shIdx = 0;
+		int received = read(sockfd, &shIdx, sizeof(shIdx));
+		close(sockfd);
+		
+		//The server may have grown the pool since this process last looked
+		SharedRing* ring = received == (int)sizeof(shIdx) ? shMemPool->attach(shIdx) : NULL;
+		if(!ring)
+		{
+			sendBadGateway(socketNum);
+			return;
+		}
+		
+		//The server hands the segment back itself once the ring is drained
+		relayRing(ring, socketNum, start, destPort, serverPid, copy);
+	}
+	
+	/**
+	 * @brief Adds a slot's bytes to a ring relay's copy of the response
+	 * 
+	 * @note Once the header is complete it decides whether the rest is kept:
+	 * a 200 small enough for a cache, or any response small enough to share,
+	 * by the same limits as fetchUpstream. The server's header already ends
+	 * the client's connection, so it is kept as sent.
+	 */
+	void keepSlot(ringCopy& copy, const char* data, int length)
+	{
+		if(copy.dropped) return;
+		
+		if(!copy.header.empty())
+		{
+			appendBody(copy, data, length);
+			return;
+		}
+		
+		copy.kept.append(data, length);
+		
+		//Parsed from the start each time, since the buffer may have moved
+		RequestParser parser;
+		int headerLength = parser.parse(copy.kept.data(), copy.kept.length());
+		if(headerLength == PARSE_INCOMPLETE && copy.kept.length() < REQUESTBUFSIZE)
+			return;
+		
+		slice lengthField = parser.findHeader("Content-Length");
+		if(headerLength <= 0 || !lengthField.data)
+		{
+			copy.dropped = true;
+			return;
+		}
+		
+		copy.contentLength = atol(string(lengthField.data, lengthField.length).c_str());
+		if(copy.contentLength < 0)
+		{
+			copy.dropped = true;
+			return;
+		}
+		
+		size_t responseSize = headerLength + copy.contentLength;
+		bool inMemory = responseCache && responseSize <= responseCache->maxObjectSize();
+		bool onDisk = diskCache && responseSize <= diskCache->maxObjectSize();
+		copy.cacheable = (inMemory || onDisk) && parser.target.equals("200");
+		copy.shared = copy.flight && responseSize <= coalescer->maxResponseSize();
+		copy.dropped = !copy.cacheable && !copy.shared;
+		
+		copy.header = copy.kept.substr(0, headerLength);
+		string rest = copy.kept.substr(headerLength);
+		copy.kept.clear();
+		
+		//A shared body is reserved in full before followers may read it, so it never moves
+		if(copy.shared)
+		{
+			copy.flight->body.reserve(copy.contentLength);
+			copy.flight->start(copy.header, copy.contentLength);
+		}
+		
+		appendBody(copy, rest.data(), rest.length());
+	}
+	
+	/**
+	 * @brief Adds body bytes a ring relay kept, stopping at the response's Content-Length
+	 * 
+	 * @note Followers read a shared body while it is appended to, so it must never
+	 * outgrow what was reserved. A server that sends more than it announced gets
+	 * the extra bytes dropped and its response kept out of the caches.
+	 */
+	void appendBody(ringCopy& copy, const char* data, int length)
+	{
+		string& body = copy.shared ? copy.flight->body : copy.kept;
+		
+		long remaining = copy.contentLength - (long)body.length();
+		if(length > remaining)
+		{
+			length = remaining;
+			copy.cacheable = false;
+		}
+		
+		if(length > 0) body.append(data, length);
+		if(copy.shared) copy.flight->advance();
+	}
+	
+	/**
+	 * @brief Offers a response a ring relay kept to the caches, once the server has ended it
+	 */
+	void finishCopy(ringCopy& copy)
+	{
+		if(copy.header.empty()) return;
+		
+		if(responseCache) responseCache->recordFetch(copy.key, copy.header.length() + copy.contentLength);
+		
+		const string& body = copy.shared ? copy.flight->body : copy.kept;
+		if(!copy.cacheable || (long)body.length() != copy.contentLength) return;
+		
+		size_t responseSize = copy.header.length() + body.length();
+		if(responseCache && responseSize <= responseCache->maxObjectSize())
+			responseCache->insert(copy.key, copy.header, body);
+		if(diskCache && responseSize <= diskCache->maxObjectSize())
+			diskCache->insert(copy.key, copy.header, body);
+	}
+	
+	///Origin addresses and whether they are on this machine
+	ResolverCache* resolver;
+	
+	///Idle keep-alive connections to origins, or NULL to connect for every request
+	UpstreamPool* upstreamPool;
+	
+	///Whole origin responses kept in memory, or NULL to fetch every request
+	ResponseCache* responseCache;
+	
+	///Origin responses kept on disk across restarts, or NULL for none
+	DiskCache* diskCache;
+	
+	///Fetches shared by concurrent requests for the same file, or NULL to fetch for each
+	RequestCoalescer* coalescer;
+	
+	///Decides when slow requests to local servers are hedged, or NULL to never hedge
+	HedgePolicy* hedger;
+	
+	///Responses relayed to clients
+	long relays;
+	
+	///Bytes relayed to clients
+	long relayedBytes;
+	
+	///Microseconds from each request to its first byte to the client, summed
+	long firstByteTotal;
+	
+	///The longest time to first byte, in microseconds
+	long firstByteMax;
+	
+	public:
+	HTTP_Proxy(int recvPort, int acceptQueueSize, int remotePort) 
+		: HTTP_Server(recvPort, acceptQueueSize)
+	{
+		remoteServerPort = remotePort;
+		
+		resolver = new ResolverCache(RESOLVERTTL, RESOLVERNEGATIVETTL);
+		upstreamPool = NULL;
+		responseCache = NULL;
+		diskCache = NULL;
+		coalescer = NULL;
+		hedger = NULL;
+		balanceMode = ServerRegistry::POWER_OF_TWO;
+		pthread_mutex_init(&balanceLock, NULL);
+		pthread_mutex_init(&queueLock, NULL);
+		queuedRequests = 0;
+		controlRequests = 0;
+		relays = 0;
+		relayedBytes = 0;
+		firstByteTotal = 0;
+		firstByteMax = 0;
+		
+		#ifdef USESHARED
+		localMethod = SHBUFF;
+		#else
+		localMethod = GET;
+		#endif
+	}
+	
+	/**
+	 * @brief Chooses how files are fetched from servers registered on this machine
+	 * 
+	 * @param method GET over TCP, SHBUFF through shared memory, or FDPASS over a Unix socket
+	 */
+	void setLocalTransport(DataMethod method)
+	{
+		localMethod = method;
+	}
+	
+	/**
+	 * @brief How files are fetched from servers registered on this machine
+	 */
+	DataMethod localTransport()
+	{
+		return localMethod;
+	}
+	
+	/**
+	 * @brief Chooses how requests for a registered server are spread over all the registered servers
+	 * 
+	 * @param mode FIXED sends them to the server requested, POWER_OF_TWO to the
+	 * less loaded of two sampled servers, LEAST_LOADED to the least loaded of all
+	 * 
+	 * @note Load is a server's queued and active connections per worker, as published in the registry
+	 */
+	void setBalanceMode(ServerRegistry::BalanceMode mode)
+	{
+		balanceMode = mode;
+	}
+	
+	/**
+	 * @brief Proxies register so they get a heartbeat, but are never balanced to
+	 */
+	virtual bool isOrigin()
+	{
+		return false;
+	}
+	
+	/**
+	 * @brief Reuses keep-alive connections to origins instead of connecting for every request
+	 * 
+	 * @param maxIdle The most idle connections kept for one origin
+	 * @param idleSeconds How long a connection may stay idle before it is closed
+	 * 
+	 * @note Origins only keep connections open if they support keep-alive,
+	 * such as an http_server started with keepalive=<N>
+	 */
+	void setupUpstreamPool(int maxIdle, int idleSeconds)
+	{
+		upstreamPool = new UpstreamPool(maxIdle, idleSeconds);
+	}
+	
+	/**
+	 * @brief Keeps origin responses in memory and serves repeat requests from there
+	 * 
+	 * @param bytes The memory budget, split evenly over the cache's shards
+	 * 
+	 * @note Responses fetched over TCP or shared memory are cached, but not
+	 * ones sent from a passed descriptor, and a response larger than one
+	 * shard's budget never is
+	 */
+	void setupResponseCache(size_t bytes)
+	{
+		responseCache = new ResponseCache(bytes);
+	}
+	
+	/**
+	 * @brief Keeps origin responses in a log-structured store on disk, below the memory cache
+	 * 
+	 * @param directory Where the segment files live; whatever a previous proxy left there is indexed at once
+	 * @param bytes The most the segment files may hold
+	 * 
+	 * @note Disk hits are promoted into the memory cache if there is one
+	 */
+	void setupDiskCache(const string& directory, long bytes)
+	{
+		diskCache = new DiskCache(directory, bytes);
+	}
+	
+	/**
+	 * @brief Has concurrent requests for the same file share one upstream fetch
+	 * 
+	 * @note Applies to origins fetched over TCP or shared memory, not with fdpass
+	 */
+	void setupCoalescing()
+	{
+		coalescer = new RequestCoalescer();
+	}
+	
+	/**
+	 * @brief Sends a second copy of a request to another registered server when the first is slow to respond
+	 * 
+	 * @param percentile The percentile of recent upstream first-byte times to wait before hedging
+	 * @param budgetPercent The most hedges per hundred requests that could be hedged
+	 * 
+	 * @note Only applies to registered local servers fetched over TCP, since
+	 * any of them can answer. Whichever copy responds first is used and the
+	 * other connection is closed.
+	 */
+	void setupHedging(double percentile, int budgetPercent)
+	{
+		hedger = new HedgePolicy(percentile, budgetPercent);
+	}
+	
+	/**
+	 * @brief Prints the relay counters and the proxy's peak memory use along with the server's
+	 */
+	virtual void printTransferStats()
+	{
+		HTTP_Server::printTransferStats();
+		
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		
+		cout << "Relayed responses: " << relays << "\t" << "bytes: " << relayedBytes << endl;
+		cout << "Time to first byte: avg " << (relays ? firstByteTotal / relays : 0) << " us\t" << "max " << firstByteMax << " us" << endl;
+		cout << "Peak RSS: " << usage.ru_maxrss << " KB" << endl;
+		
+		resolver->printStats();
+		
+		if(registry) registry->printStats();
+		
+		if(queuedRequests || controlRequests)
+			cout << "Shared memory requests submitted: " << queuedRequests << "\t" << "over control connections: " << controlRequests << endl;
+		
+		pthread_mutex_lock(&balanceLock);
+		for(map<int, long>::iterator it = balancedRequests.begin(); it != balancedRequests.end(); ++it)
+			cout << "Balanced to port " << it->first << ": " << it->second << endl;
+		pthread_mutex_unlock(&balanceLock);
+		
+		if(upstreamPool) upstreamPool->printStats();
+		if(responseCache) responseCache->printStats();
+		if(diskCache) diskCache->printStats();
+		if(coalescer) coalescer->printStats();
+		if(hedger) hedger->printStats();
+	}
+	
+	virtual bool parseHTTPRequest(string fileName, int socketNum, DataMethod method, string host, int altPort, bool keepAlive)
+	{
+		struct timeval start;
+		gettimeofday(&start, NULL);
+		
+		//Determine the port to use
+		int destPort = altPort ? altPort : 80;
+		
+		if(host.length() == 0) destPort = remoteServerPort;
+		
+		char origin[300];
+		snprintf(origin, sizeof(origin), "%s:%d", host.length() == 0 ? "127.0.0.1" : host.c_str(), destPort);
+		
+		if(responseCache)
+		{
+			responseEntry* cached = responseCache->acquire(origin + fileName);
+			if(cached)
+			{
+				serveCached(cached->header, cached->body, socketNum, start);
+				responseCache->release(cached);
+				return false;
+			}
+		}
+		
+		string cachedHeader, cachedBody;
+		if(diskCache && diskCache->lookup(origin + fileName, cachedHeader, cachedBody))
+		{
+			serveCached(cachedHeader, cachedBody, socketNum, start);
+			
+			if(responseCache)
+			{
+				responseCache->recordFetch(origin + fileName, cachedHeader.length() + cachedBody.length());
+				responseCache->insert(origin + fileName, cachedHeader, cachedBody);
+			}
+			return false;
+		}
+		
+		vector<in_addr_t> addresses;
+		if(!resolver->resolve(host.length() == 0 ? "127.0.0.1" : host, addresses))
+		{
+			sendBadGateway(socketNum);
+			return false;
+		}
+		
+		struct sockaddr_in serv_addr;
+		bzero((char *) &serv_addr, sizeof(serv_addr));
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_addr.s_addr = addresses[0];
+		serv_addr.sin_port = htons(destPort);
+		
+		bool onLocal = false;
+		bool localServer = false;
+		
+		//See if the http server is on the local machine
+		for(size_t i = 0; i < addresses.size() && !onLocal; i++)
+			onLocal = resolver->isLocal(addresses[i]);
+		
+		//Determine if the local server is ours
+		if(onLocal && registry)
+			localServer = registry->isRegistered(destPort);
+		
+		//Any of our servers can answer, so send the request to a lightly loaded one
+		string upstream = origin;
+		if(localServer && balanceMode != ServerRegistry::FIXED)
+		{
+			destPort = registry->pickServer(destPort, balanceMode);
+			serv_addr.sin_port = htons(destPort);
+			
+			//Pooled connections are kept by the server they go to, responses by the origin asked for
+			char address[INET_ADDRSTRLEN], chosen[300];
+			inet_ntop(AF_INET, &serv_addr.sin_addr, address, sizeof(address));
+			snprintf(chosen, sizeof(chosen), "%s:%d", address, destPort);
+			upstream = chosen;
+			
+			pthread_mutex_lock(&balanceLock);
+			balancedRequests[destPort]++;
+			pthread_mutex_unlock(&balanceLock);
+		}
+		
+		if(localServer && localMethod == FDPASS && relayPassedFile(fileName, socketNum, destPort, start))
+			return false;
+		
+		bool useShared = localServer && localMethod == SHBUFF;
+		
+		if((upstreamPool || responseCache || diskCache || coalescer || hedger) && !useShared)
+		{
+			relayUpstream(origin, upstream, serv_addr, fileName, host.length() == 0 ? "127.0.0.1" : host, socketNum, start, localServer);
+			return false;
+		}
+		
+#ifdef SHMEM
+		if(useShared)
+		{
+			relayShared(origin + fileName, fileName, socketNum, serv_addr, destPort, start);
+			return false;
+		}
+#endif
+		
+		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		
+		int connected = connect(sockfd,(struct sockaddr *)&serv_addr,sizeof(serv_addr));
+		if(connected < 0)
+		{
+			close(sockfd);
+			sendBadGateway(socketNum);
+			return false;
+		}
 		
-		//cout << contents << endl;
+		string req = "GET " + fileName + " HTTP/1.0\r\n\r\n";
+		write(sockfd, req.c_str(), req.length());
 		
-		//Now write the contents back to the client
-		write(socketNum, contents.c_str(), strlen(contents.c_str()));
+		relaySocket(sockfd, socketNum, start);
+		close(sockfd);
 		
+		//The relayed response isn't reframed, so the client connection ends here
+		return false;
 	}
 };
 }
@@ -3,6 +3,98 @@
 int main(int argc, char* argv[])
 {
 	HTTP_Proxy p(atoi(argv[1]), atoi(argv[3]), atoi(argv[2]));
+	
+	int shmSegments = 0;
+	size_t shmSize = 0;
+	bool hugePages = false;
+	int poolSize = 0;
+	int poolIdle = 30;
+	size_t cacheSize = 0;
+	const char* diskDir = NULL;
+	long diskSize = 1024;
+	bool coalesce = false;
+	double hedgePercentile = 0;
+	int hedgeBudget = 5;
+	
+	//Optional settings follow the required arguments
+	for(int i = 5; i < argc; i++)
+	{
+		//"shm=<N>" lets the shared memory pool grow to N segments
+		if(strncmp(argv[i], "shm=", 4) == 0)
+			shmSegments = atoi(argv[i] + 4);
+		//"shmsize=<KB>" sets the size of each shared memory segment
+		else if(strncmp(argv[i], "shmsize=", 8) == 0)
+			shmSize = (size_t)atoi(argv[i] + 8) * 1024;
+		//"hugepages" backs shared memory segments with huge pages
+		else if(strcmp(argv[i], "hugepages") == 0)
+			hugePages = true;
+		//"fdpass" has local servers pass file descriptors instead of sending the file
+		else if(strcmp(argv[i], "fdpass") == 0)
+			p.setLocalTransport(HTTP_Proxy::FDPASS);
+		//"pool=<N>" keeps up to N idle keep-alive connections to each origin
+		else if(strncmp(argv[i], "pool=", 5) == 0)
+			poolSize = atoi(argv[i] + 5);
+		//"poolidle=<seconds>" closes pooled connections left idle that long
+		else if(strncmp(argv[i], "poolidle=", 9) == 0)
+			poolIdle = atoi(argv[i] + 9);
+		//"cache=<MB>" keeps up to that much of the origins' responses in memory
+		else if(strncmp(argv[i], "cache=", 6) == 0)
+			cacheSize = (size_t)atoi(argv[i] + 6) * 1024 * 1024;
+		//"disk=<dir>" keeps origin responses in that directory across restarts
+		else if(strncmp(argv[i], "disk=", 5) == 0)
+			diskDir = argv[i] + 5;
+		//"disksize=<MB>" caps the disk cache, 1024 MB by default
+		else if(strncmp(argv[i], "disksize=", 9) == 0)
+			diskSize = atol(argv[i] + 9);
+		//"coalesce" has concurrent requests for the same file share one upstream fetch
+		else if(strcmp(argv[i], "coalesce") == 0)
+			coalesce = true;
+		//"hedge=<percentile>" sends a copy of a request to another local server once it has waited that percentile of recent first-byte times
+		else if(strncmp(argv[i], "hedge=", 6) == 0)
+			hedgePercentile = atof(argv[i] + 6);
+		//"hedgebudget=<percent>" caps hedges at that share of requests, 5% by default
+		else if(strncmp(argv[i], "hedgebudget=", 12) == 0)
+			hedgeBudget = atoi(argv[i] + 12);
+		//"balance=<p2c|least|off>" picks how requests for local servers are spread over all of them
+		else if(strncmp(argv[i], "balance=", 8) == 0)
+		{
+			if(strcmp(argv[i] + 8, "p2c") == 0)
+				p.setBalanceMode(ServerRegistry::POWER_OF_TWO);
+			else if(strcmp(argv[i] + 8, "least") == 0)
+				p.setBalanceMode(ServerRegistry::LEAST_LOADED);
+			else if(strcmp(argv[i] + 8, "off") == 0)
+				p.setBalanceMode(ServerRegistry::FIXED);
+			else
+			{
+				cout << "Unknown " << argv[i] << ", usage: balance=<p2c|least|off>" << endl;
+				return 1;
+			}
+		}
+	}
+	
+	if(poolSize > 0)
+		p.setupUpstreamPool(poolSize, poolIdle);
+	
+	if(cacheSize > 0)
+		p.setupResponseCache(cacheSize);
+	
+	if(diskDir)
+		p.setupDiskCache(diskDir, diskSize * 1024 * 1024);
+	
+	if(coalesce)
+		p.setupCoalescing();
+	
+	//Local servers reached through fdpass are sent from the descriptor, never through the caches
+	if((cacheSize > 0 || diskDir || coalesce) && p.localTransport() == HTTP_Proxy::FDPASS)
+		cout << "cache=, disk= and coalesce only apply to remote origins with fdpass" << endl;
+	
+	//Hedges race a second TCP fetch, so they can't help local servers reached another way
+	if(hedgePercentile > 0 && p.localTransport() != HTTP_Proxy::GET)
+		cout << "hedge= is ignored with " << (p.localTransport() == HTTP_Proxy::FDPASS ? "fdpass" : "shared memory") << " local transfers" << endl;
+	else if(hedgePercentile > 0)
+		p.setupHedging(hedgePercentile, hedgeBudget);
+	
+	p.setupSharedMemPool(shmSegments, shmSize, hugePages);
 	p.setupThreadPool(atoi(argv[4]));
 	p.beginAcceptLoop();
 	
@@ -0,0 +1,201 @@
+/**
+ * @file queueBenchmark.cpp
+ *
+ * @section DESCRIPTION
+ * Compares the MPMCQueue handoff against the mutex/condvar queue the server used to use
+ *
+ * ./queueBench <producers> <consumers> <items per producer> <queue size>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <queue>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sched.h>
+#include "mpmcQueue.cpp"
+
+using namespace std;
+
+/**
+ * @brief The boss/worker handoff as it was: a std::queue of heap allocated requests behind one lock
+ */
+class LockedQueue
+{
+	private:
+	struct requestData
+	{
+		int socketNum;
+	};
+
+	queue<requestData*> requestQueue;
+	pthread_mutex_t acceptLock;
+	pthread_cond_t acceptCondition;
+	unsigned int queueSize;
+	bool closed;
+
+	public:
+	LockedQueue(unsigned int size)
+	{
+		queueSize = size;
+		closed = false;
+		pthread_mutex_init(&acceptLock, NULL);
+		pthread_cond_init(&acceptCondition, NULL);
+	}
+
+	bool tryPush(int value)
+	{
+		bool added = false;
+
+		pthread_mutex_lock(&acceptLock);
+		if(requestQueue.size() < queueSize)
+		{
+			requestData* data = new requestData();
+			data->socketNum = value;
+			requestQueue.push(data);
+			pthread_cond_signal(&acceptCondition);
+			added = true;
+		}
+		pthread_mutex_unlock(&acceptLock);
+
+		return added;
+	}
+
+	bool pop(int& value)
+	{
+		pthread_mutex_lock(&acceptLock);
+		while(requestQueue.size() == 0 && !closed)
+			pthread_cond_wait(&acceptCondition, &acceptLock);
+
+		if(requestQueue.size() == 0)
+		{
+			pthread_mutex_unlock(&acceptLock);
+			return false;
+		}
+
+		requestData* data = requestQueue.front();
+		requestQueue.pop();
+		pthread_mutex_unlock(&acceptLock);
+
+		value = data->socketNum;
+		delete data;
+		return true;
+	}
+
+	void shutdown()
+	{
+		pthread_mutex_lock(&acceptLock);
+		closed = true;
+		pthread_cond_broadcast(&acceptCondition);
+		pthread_mutex_unlock(&acceptLock);
+	}
+};
+
+template <class Q>
+struct benchArgs
+{
+	Q* queue;
+	long items;
+	long popped;
+	long rejected;
+};
+
+template <class Q>
+static void *producer(void* input)
+{
+	benchArgs<Q>* args = (benchArgs<Q>*)input;
+
+	//Like the boss thread, retry instead of dropping so every item is delivered
+	for(long i = 0; i < args->items; i++)
+		while(!args->queue->tryPush((int)i))
+		{
+			args->rejected++;
+			sched_yield();
+		}
+
+	return NULL;
+}
+
+template <class Q>
+static void *consumer(void* input)
+{
+	benchArgs<Q>* args = (benchArgs<Q>*)input;
+	int value;
+
+	while(args->queue->pop(value))
+		__atomic_store_n(&args->popped, args->popped + 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/**
+ * @brief Pushes items through a queue and reports the handoff rate
+ */
+template <class Q>
+static void runBenchmark(const char* name, int producers, int consumers, long items, unsigned int size)
+{
+	Q queue(size);
+	pthread_t producerThreads[producers];
+	pthread_t consumerThreads[consumers];
+	benchArgs<Q> producerArgs[producers];
+	benchArgs<Q> consumerArgs[consumers];
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	for(int i = 0; i < consumers; i++)
+	{
+		consumerArgs[i].queue = &queue;
+		consumerArgs[i].popped = 0;
+		pthread_create(&consumerThreads[i], NULL, consumer<Q>, &consumerArgs[i]);
+	}
+
+	for(int i = 0; i < producers; i++)
+	{
+		producerArgs[i].queue = &queue;
+		producerArgs[i].items = items;
+		producerArgs[i].rejected = 0;
+		pthread_create(&producerThreads[i], NULL, producer<Q>, &producerArgs[i]);
+	}
+
+	long rejected = 0;
+	for(int i = 0; i < producers; i++)
+	{
+		pthread_join(producerThreads[i], NULL);
+		rejected += producerArgs[i].rejected;
+	}
+
+	//Wait for the consumers to drain what is left
+	long popped = 0;
+	while(popped < items * producers)
+	{
+		popped = 0;
+		for(int i = 0; i < consumers; i++)
+			popped += __atomic_load_n(&consumerArgs[i].popped, __ATOMIC_RELAXED);
+		sched_yield();
+	}
+
+	gettimeofday(&end, NULL);
+
+	queue.shutdown();
+	for(int i = 0; i < consumers; i++)
+		pthread_join(consumerThreads[i], NULL);
+
+	long mtime = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+	cout << name << "\t" << mtime << "\t" << (popped * 1000000.0 / mtime) << " ops/s" << "\t" << "full: " << rejected << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	int producers = argc > 1 ? atoi(argv[1]) : 1;
+	int consumers = argc > 2 ? atoi(argv[2]) : 16;
+	long items = argc > 3 ? atol(argv[3]) : 1000000;
+	unsigned int size = argc > 4 ? atoi(argv[4]) : 32;
+
+	cout << "# " << producers << " producers, " << consumers << " consumers, " << items << " items each, queue size " << size << endl;
+
+	runBenchmark<LockedQueue>("mutex/condvar", producers, consumers, items, size);
+	runBenchmark<MPMCQueue>("lock-free", producers, consumers, items, size);
+}
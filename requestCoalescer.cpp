@@ -0,0 +1,262 @@
+#ifndef REQUEST_COALESCER
+#define REQUEST_COALESCER
+
+/**
+ * @file requestCoalescer.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the RequestCoalescer class that lets concurrent proxy requests for the same file share one upstream fetch
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <pthread.h>
+
+#define COALESCEMAX 16777216 //The largest response buffered for followers
+
+using namespace std;
+
+/**
+ * @brief A response one request is fetching while others wait to stream it
+ *
+ * @note The body's storage is reserved for the whole Content-Length before
+ * any follower is let in, so followers can send from it without the lock
+ * while the leader appends.
+ */
+struct inFlightResponse
+{
+	///The states of a fetch
+	enum {FETCHING, STREAMING, DONE, FAILED};
+
+	///The origin and path
+	string key;
+
+	///The header as clients receive it, set when streaming starts
+	string header;
+
+	///The body received so far
+	string body;
+
+	///The Content-Length
+	size_t bodyLength;
+
+	///The body bytes followers may send
+	size_t filled;
+
+	int state;
+
+	///The leader and followers holding the response
+	int refs;
+
+	///Protects filled and state
+	pthread_mutex_t lock;
+
+	///Signalled when filled or state changes
+	pthread_cond_t progress;
+
+	/**
+	 * @brief Lets followers start sending, once the header is known
+	 *
+	 * @param clientHeader The header as clients receive it
+	 * @param contentLength The body's length; body holds whatever of it arrived with the header
+	 */
+	void start(const string& clientHeader, size_t contentLength)
+	{
+		pthread_mutex_lock(&lock);
+		header = clientHeader;
+		bodyLength = contentLength;
+		filled = body.length();
+		state = STREAMING;
+		pthread_cond_broadcast(&progress);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief Publishes body bytes the leader appended
+	 */
+	void advance()
+	{
+		pthread_mutex_lock(&lock);
+		filled = body.length();
+		pthread_cond_broadcast(&progress);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief Waits for more of the body than a follower has sent
+	 *
+	 * @param sent The body bytes the follower has sent
+	 * @param available Set to the body bytes that may be sent
+	 * @return The state, which is FETCHING only before the header is known
+	 */
+	int waitPast(size_t sent, size_t& available)
+	{
+		pthread_mutex_lock(&lock);
+
+		while(state == FETCHING || (state == STREAMING && filled <= sent))
+			pthread_cond_wait(&progress, &lock);
+
+		available = filled;
+		int current = state;
+
+		pthread_mutex_unlock(&lock);
+
+		return current;
+	}
+};
+
+namespace{
+/**
+ * @brief Single-flight table of upstream fetches
+ *
+ * @note The first request for a key leads: it fetches from the origin and
+ * fills the shared response as it relays it to its own client. Requests for
+ * the same key that arrive before it finishes follow: they wait for the
+ * header and then stream the body to their clients as it fills, each at its
+ * own client's pace. A response that can't be shared, because it has no
+ * Content-Length, is too large, or fails before its header arrives, sends the
+ * followers back to fetch it themselves.
+ */
+class RequestCoalescer
+{
+	private:
+
+	///Fetches in progress by key
+	map<string, inFlightResponse*> flights;
+
+	///Protects flights and the counters
+	pthread_mutex_t lock;
+
+	long leaders;
+	long followers;
+	long fallbacks;
+	long followerBytes;
+
+	/**
+	 * @brief Drops one reference and frees the response when none are left
+	 *
+	 * @note The caller holds lock
+	 */
+	void dropReference(inFlightResponse* flight)
+	{
+		if(--flight->refs == 0)
+		{
+			pthread_mutex_destroy(&flight->lock);
+			pthread_cond_destroy(&flight->progress);
+			delete flight;
+		}
+	}
+
+	public:
+
+	RequestCoalescer()
+	{
+		leaders = 0;
+		followers = 0;
+		fallbacks = 0;
+		followerBytes = 0;
+
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	/**
+	 * @brief The largest response that can be shared
+	 */
+	size_t maxResponseSize()
+	{
+		return COALESCEMAX;
+	}
+
+	/**
+	 * @brief Leads a new fetch for a key, or follows the one already under way
+	 *
+	 * @param key The origin and path
+	 * @param leader Set to true if the caller must fetch and then call finish()
+	 * @return The shared response; followers hand it back with release()
+	 */
+	inFlightResponse* join(const string& key, bool& leader)
+	{
+		pthread_mutex_lock(&lock);
+
+		map<string, inFlightResponse*>::iterator found = flights.find(key);
+		inFlightResponse* flight;
+
+		if(found != flights.end())
+		{
+			flight = found->second;
+			flight->refs++;
+			followers++;
+			leader = false;
+		}
+		else
+		{
+			flight = new inFlightResponse();
+			flight->key = key;
+			flight->bodyLength = 0;
+			flight->filled = 0;
+			flight->state = inFlightResponse::FETCHING;
+			flight->refs = 1;
+			pthread_mutex_init(&flight->lock, NULL);
+			pthread_cond_init(&flight->progress, NULL);
+
+			flights[key] = flight;
+			leaders++;
+			leader = true;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		return flight;
+	}
+
+	/**
+	 * @brief Ends the leader's fetch, so the next request for the key starts a new one
+	 *
+	 * @note Followers still sending keep the response alive. One that was
+	 * never streamed, or stopped short of its length, fails.
+	 */
+	void finish(inFlightResponse* flight)
+	{
+		pthread_mutex_lock(&lock);
+		flights.erase(flight->key);
+		pthread_mutex_unlock(&lock);
+
+		pthread_mutex_lock(&flight->lock);
+		flight->state = flight->state == inFlightResponse::STREAMING && flight->filled == flight->bodyLength ? inFlightResponse::DONE : inFlightResponse::FAILED;
+		pthread_cond_broadcast(&flight->progress);
+		pthread_mutex_unlock(&flight->lock);
+
+		release(flight, 0, false);
+	}
+
+	/**
+	 * @brief Hands back a response a follower joined
+	 *
+	 * @param bytes The bytes the follower sent its client
+	 * @param fellBack Whether the follower has to fetch the response itself
+	 */
+	void release(inFlightResponse* flight, long bytes, bool fellBack)
+	{
+		pthread_mutex_lock(&lock);
+
+		followerBytes += bytes;
+		if(fellBack) fallbacks++;
+
+		dropReference(flight);
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief Prints how many fetches were shared
+	 */
+	void printStats()
+	{
+		pthread_mutex_lock(&lock);
+		cout << "Coalesced fetches: " << leaders << "\t" << "followers: " << followers << "\t" << "follower bytes: " << followerBytes << "\t" << "fell back: " << fallbacks << endl;
+		pthread_mutex_unlock(&lock);
+	}
+};
+}
+#endif
@@ -0,0 +1,280 @@
+#ifndef REQUEST_PARSER
+#define REQUEST_PARSER
+
+/**
+ * @file requestParser.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the RequestParser class, an incremental HTTP request header parser
+ */
+
+#include <iostream>
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define MAXHEADERS 32 //Header fields past this many are skipped
+#define REQUESTBUFSIZE 4096 //The largest request header a connection will buffer
+
+#define PARSE_INCOMPLETE 0 //More bytes are needed
+#define PARSE_ERROR -1 //The request is malformed
+
+using namespace std;
+
+/**
+ * @brief A view of bytes inside a connection's buffer, valid until the buffer is reused
+ */
+struct slice
+{
+	const char* data;
+	int length;
+
+	bool equals(const char* text) const
+	{
+		return data && (int)strlen(text) == length && memcmp(data, text, length) == 0;
+	}
+
+	bool equalsIgnoreCase(const char* text) const
+	{
+		return data && (int)strlen(text) == length && strncasecmp(data, text, length) == 0;
+	}
+
+	bool startsWith(const char* text, int textLength) const
+	{
+		return data && textLength <= length && memcmp(data, text, textLength) == 0;
+	}
+};
+
+inline ostream& operator<<(ostream& out, const slice& text)
+{
+	if(text.data) out.write(text.data, text.length);
+	return out;
+}
+
+/**
+ * @brief A header field name and value
+ */
+struct headerField
+{
+	slice name;
+	slice value;
+};
+
+namespace{
+/**
+ * @brief Finds the first of two bytes in a range, 32 or 16 bytes at a time where the CPU allows
+ *
+ * @return A pointer to the byte, or end if neither is found
+ */
+static inline const char* scanFor(const char* start, const char* end, char a, char b)
+{
+#ifdef __AVX2__
+	__m256i wideA = _mm256_set1_epi8(a);
+	__m256i wideB = _mm256_set1_epi8(b);
+	while(end - start >= 32)
+	{
+		__m256i chunk = _mm256_loadu_si256((const __m256i*)start);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, wideA), _mm256_cmpeq_epi8(chunk, wideB)));
+		if(mask) return start + __builtin_ctz(mask);
+		start += 32;
+	}
+#endif
+#ifdef __SSE2__
+	__m128i vecA = _mm_set1_epi8(a);
+	__m128i vecB = _mm_set1_epi8(b);
+	while(end - start >= 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i*)start);
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, vecA), _mm_cmpeq_epi8(chunk, vecB)));
+		if(mask) return start + __builtin_ctz(mask);
+		start += 16;
+	}
+#endif
+	for(; start < end; start++)
+		if(*start == a || *start == b) return start;
+
+	return end;
+}
+}
+
+/**
+ * @brief A resumable state machine that parses a request header in place
+ *
+ * @note The parser never copies or allocates. The caller reads into one
+ * fixed buffer and calls parse() with everything buffered so far; lines that
+ * were already parsed are not scanned again. The slices point into that
+ * buffer, so it must not move until the request has been handled. Call
+ * reset() before parsing the next request.
+ */
+class RequestParser
+{
+	private:
+
+	typedef enum {REQUEST_LINE, HEADERS, DONE, FAILED} ParseState;
+
+	///Where the parser is in the request
+	ParseState state;
+
+	///The offset of the first byte of the line being parsed
+	int lineStart;
+
+	///The offset scanning resumes from when more bytes arrive
+	int scanPos;
+
+	/**
+	 * @brief Splits the request line into method, target and version
+	 */
+	bool parseRequestLine(const char* line, const char* lineEnd)
+	{
+		const char* space = scanFor(line, lineEnd, ' ', '\t');
+		if(space == line) return false;
+
+		method.data = line;
+		method.length = space - line;
+
+		if(space == lineEnd) return false;
+
+		const char* targetStart = space + 1;
+		const char* targetEnd = scanFor(targetStart, lineEnd, ' ', '\t');
+
+		target.data = targetStart;
+		target.length = targetEnd - targetStart;
+
+		//A missing version is accepted for simple telnet requests
+		version.data = targetEnd < lineEnd ? targetEnd + 1 : lineEnd;
+		version.length = lineEnd - version.data;
+
+		return target.length > 0;
+	}
+
+	/**
+	 * @brief Splits a header line into a name and a trimmed value
+	 */
+	bool parseHeaderLine(const char* line, const char* lineEnd)
+	{
+		const char* colon = scanFor(line, lineEnd, ':', ':');
+		if(colon == lineEnd || colon == line) return false;
+
+		//Skip what doesn't fit rather than failing the request
+		if(headerCount == MAXHEADERS) return true;
+
+		const char* value = colon + 1;
+		while(value < lineEnd && (*value == ' ' || *value == '\t')) value++;
+
+		const char* valueEnd = lineEnd;
+		while(valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) valueEnd--;
+
+		headers[headerCount].name.data = line;
+		headers[headerCount].name.length = colon - line;
+		headers[headerCount].value.data = value;
+		headers[headerCount].value.length = valueEnd - value;
+		headerCount++;
+
+		return true;
+	}
+
+	public:
+
+	///The request method
+	slice method;
+
+	///The request target, as sent
+	slice target;
+
+	///The protocol version, empty if none was sent
+	slice version;
+
+	///The header fields, in the order they were sent
+	headerField headers[MAXHEADERS];
+
+	///The number of fields in headers
+	int headerCount;
+
+	RequestParser()
+	{
+		reset();
+	}
+
+	/**
+	 * @brief Gets ready to parse a new request from the start of the buffer
+	 */
+	void reset()
+	{
+		state = REQUEST_LINE;
+		lineStart = 0;
+		scanPos = 0;
+		headerCount = 0;
+
+		method.data = target.data = version.data = NULL;
+		method.length = target.length = version.length = 0;
+	}
+
+	/**
+	 * @brief Continues parsing with everything buffered so far
+	 *
+	 * @param buffer The connection's buffer, the same one on every call
+	 * @param length The number of bytes in the buffer
+	 * @return The length of the request header once it is complete, PARSE_INCOMPLETE or PARSE_ERROR
+	 */
+	int parse(const char* buffer, int length)
+	{
+		while(state != DONE && state != FAILED)
+		{
+			const char* lineEnd = scanFor(buffer + scanPos, buffer + length, '\n', '\n');
+			if(lineEnd == buffer + length)
+			{
+				scanPos = length;
+				return PARSE_INCOMPLETE;
+			}
+
+			const char* line = buffer + lineStart;
+			int next = lineEnd - buffer + 1;
+
+			//Accept bare LF as well as CRLF
+			if(lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+
+			if(state == REQUEST_LINE)
+			{
+				//Blank lines before the request line are ignored
+				if(lineEnd > line)
+					state = parseRequestLine(line, lineEnd) ? HEADERS : FAILED;
+			}
+			else if(lineEnd == line)
+			{
+				state = DONE;
+				lineStart = scanPos = next;
+				return next;
+			}
+			//Folded continuation lines are ignored
+			else if(*line != ' ' && *line != '\t' && !parseHeaderLine(line, lineEnd))
+				state = FAILED;
+
+			lineStart = scanPos = next;
+		}
+
+		return state == DONE ? lineStart : PARSE_ERROR;
+	}
+
+	/**
+	 * @brief Looks up a header field by name, ignoring case
+	 *
+	 * @return The value, or a slice with NULL data if the field wasn't sent
+	 */
+	slice findHeader(const char* name) const
+	{
+		for(int i = 0; i < headerCount; i++)
+			if(headers[i].name.equalsIgnoreCase(name))
+				return headers[i].value;
+
+		slice missing;
+		missing.data = NULL;
+		missing.length = 0;
+		return missing;
+	}
+};
+#endif
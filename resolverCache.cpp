@@ -0,0 +1,265 @@
+#ifndef RESOLVER_CACHE
+#define RESOLVER_CACHE
+
+/**
+ * @file resolverCache.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the ResolverCache class the proxy uses to resolve origins and tell whether they are on this machine
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define RESOLVERTTL 60 //Seconds a resolved host is trusted
+#define RESOLVERNEGATIVETTL 5 //Seconds a host that failed to resolve stays failed
+
+using namespace std;
+
+namespace{
+/**
+ * @brief A thread-safe cache of host name lookups and of this machine's addresses
+ *
+ * @note Names are resolved with getaddrinfo, which unlike gethostbyname is
+ * safe to call from the worker threads, and the answers are kept for a fixed
+ * time since the resolver doesn't report record TTLs. Failures are kept for a
+ * shorter time so a bad name doesn't cost a lookup per request. The local
+ * addresses are read once at startup and again whenever a netlink route
+ * socket reports that an address was added or removed.
+ */
+class ResolverCache
+{
+	private:
+
+	/**
+	 * @brief The answer for one host
+	 */
+	struct resolvedHost
+	{
+		///IPv4 addresses in network order, empty if the host didn't resolve
+		vector<in_addr_t> addresses;
+
+		time_t expires;
+	};
+
+	///Answers by host name
+	map<string, resolvedHost> hosts;
+
+	///The IPv4 addresses of this machine's interfaces, in network order
+	set<in_addr_t> localAddresses;
+
+	///Protects hosts, localAddresses and the counters
+	pthread_mutex_t lock;
+
+	///The netlink socket the refresh thread listens on, or -1
+	int netlinkfd;
+
+	pthread_t refreshThread;
+
+	int ttl;
+	int negativeTtl;
+
+	long hits;
+	long misses;
+	long failures;
+	long refreshes;
+
+	/**
+	 * @brief Reads the interface addresses again
+	 */
+	void loadLocalAddresses()
+	{
+		set<in_addr_t> found;
+
+		struct ifaddrs* ifAddrStruct = NULL;
+		if(getifaddrs(&ifAddrStruct) == 0)
+		{
+			for(struct ifaddrs* ifa = ifAddrStruct; ifa != NULL; ifa = ifa->ifa_next)
+				if(ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET)
+					found.insert(((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr);
+
+			freeifaddrs(ifAddrStruct);
+		}
+
+		pthread_mutex_lock(&lock);
+		localAddresses.swap(found);
+		refreshes++;
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief A level of indirection to call the member function refreshTask for a thread
+	 */
+	static void *launchRefreshTask(void* obj)
+	{
+		ResolverCache* thisCache = (ResolverCache*)obj;
+		return thisCache->refreshTask();
+	}
+
+	/**
+	 * @brief Reloads the local addresses whenever the kernel announces an address change
+	 */
+	void *refreshTask()
+	{
+		char buf[8192];
+
+		while(true)
+		{
+			int bytesRead = recv(netlinkfd, buf, sizeof(buf), 0);
+
+			//ENOBUFS means announcements were dropped, so reload anyway
+			if(bytesRead < 0 && errno != ENOBUFS && errno != EINTR)
+				break;
+
+			bool changed = bytesRead < 0;
+			for(struct nlmsghdr* msg = (struct nlmsghdr*)buf; bytesRead > 0 && NLMSG_OK(msg, (unsigned int)bytesRead); msg = NLMSG_NEXT(msg, bytesRead))
+				if(msg->nlmsg_type == RTM_NEWADDR || msg->nlmsg_type == RTM_DELADDR)
+					changed = true;
+
+			if(changed)
+				loadLocalAddresses();
+		}
+
+		return NULL;
+	}
+
+	public:
+
+	/**
+	 * @brief Reads the local addresses and starts watching for changes to them
+	 *
+	 * @param positiveTtl Seconds a resolved host is trusted
+	 * @param failureTtl Seconds a host that failed to resolve stays failed
+	 */
+	ResolverCache(int positiveTtl, int failureTtl)
+	{
+		ttl = positiveTtl;
+		negativeTtl = failureTtl;
+		hits = 0;
+		misses = 0;
+		failures = 0;
+		refreshes = 0;
+
+		pthread_mutex_init(&lock, NULL);
+
+		//Subscribe before the first read so no change can slip in between
+		netlinkfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+		struct sockaddr_nl addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = RTMGRP_IPV4_IFADDR;
+
+		if(netlinkfd >= 0 && bind(netlinkfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		{
+			close(netlinkfd);
+			netlinkfd = -1;
+		}
+
+		if(netlinkfd < 0)
+			cout << "Unable to watch for address changes, local addresses are read once" << endl;
+
+		loadLocalAddresses();
+
+		if(netlinkfd >= 0)
+			pthread_create(&refreshThread, NULL, ResolverCache::launchRefreshTask, this);
+	}
+
+	/**
+	 * @brief Looks up a host's IPv4 addresses
+	 *
+	 * @param host A name or dotted address
+	 * @param addresses Set to the addresses in network order
+	 * @return False if the host doesn't resolve
+	 */
+	bool resolve(const string& host, vector<in_addr_t>& addresses)
+	{
+		time_t now = time(NULL);
+
+		pthread_mutex_lock(&lock);
+
+		map<string, resolvedHost>::iterator found = hosts.find(host);
+		if(found != hosts.end() && found->second.expires > now)
+		{
+			addresses = found->second.addresses;
+			hits++;
+			pthread_mutex_unlock(&lock);
+
+			return !addresses.empty();
+		}
+
+		misses++;
+		pthread_mutex_unlock(&lock);
+
+		//Resolve without the lock; two threads missing on the same host both look it up
+		resolvedHost answer;
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* results = NULL;
+		if(getaddrinfo(host.c_str(), NULL, &hints, &results) == 0)
+		{
+			for(struct addrinfo* result = results; result != NULL; result = result->ai_next)
+				answer.addresses.push_back(((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr);
+
+			freeaddrinfo(results);
+		}
+
+		answer.expires = now + (answer.addresses.empty() ? negativeTtl : ttl);
+		addresses = answer.addresses;
+
+		pthread_mutex_lock(&lock);
+		hosts[host] = answer;
+		if(addresses.empty()) failures++;
+		pthread_mutex_unlock(&lock);
+
+		return !addresses.empty();
+	}
+
+	/**
+	 * @brief Checks whether an address belongs to this machine
+	 *
+	 * @param address An IPv4 address in network order
+	 */
+	bool isLocal(in_addr_t address)
+	{
+		//All of 127.0.0.0/8 is loopback, though only 127.0.0.1 is usually configured
+		if((ntohl(address) >> 24) == 127)
+			return true;
+
+		pthread_mutex_lock(&lock);
+		bool local = localAddresses.count(address) > 0;
+		pthread_mutex_unlock(&lock);
+
+		return local;
+	}
+
+	/**
+	 * @brief Prints how often lookups were answered from the cache
+	 */
+	void printStats()
+	{
+		pthread_mutex_lock(&lock);
+		cout << "Resolver cache hits: " << hits << "\t" << "misses: " << misses << "\t" << "failures: " << failures << "\t" << "hosts: " << hosts.size() << "\t" << "local address reloads: " << refreshes << "\t" << "local addresses: " << localAddresses.size() << endl;
+		pthread_mutex_unlock(&lock);
+	}
+};
+}
+#endif
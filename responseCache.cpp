@@ -0,0 +1,329 @@
+#ifndef RESPONSE_CACHE
+#define RESPONSE_CACHE
+
+/**
+ * @file responseCache.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the ResponseCache class the proxy keeps origin responses in
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <pthread.h>
+
+#define RESPONSESHARDS 16 //The number of independently locked pieces of the cache
+
+using namespace std;
+
+/**
+ * @brief A whole response from an origin, ready to send to a client
+ */
+struct responseEntry
+{
+	///The origin and path the response was fetched for
+	string key;
+
+	///The header as the client receives it
+	string header;
+
+	///The body
+	string body;
+
+	///How often the entry has been requested while cached
+	long frequency;
+
+	///The entry's GDSF priority; the lowest is evicted first
+	double priority;
+
+	///The entry's position in its shard's eviction order
+	multimap<double, responseEntry*>::iterator order;
+
+	///The number of holders, including the cache itself while the entry is indexed
+	int refs;
+
+	size_t size() const
+	{
+		return header.length() + body.length();
+	}
+};
+
+namespace{
+/**
+ * @brief A sharded cache of origin responses with size-aware admission and eviction
+ *
+ * @note Uses GreedyDual-Size-Frequency: an entry's priority is the shard's
+ * inflation value plus its hit count divided by its size, so small hot
+ * objects outrank large cold ones. Evicting an entry raises the inflation
+ * value to its priority, which ages everything still cached. A new response
+ * is only admitted if it outranks every entry it would displace, so one
+ * large object can't flush many small popular ones.
+ */
+class ResponseCache
+{
+	private:
+
+	/**
+	 * @brief One independently locked piece of the cache
+	 */
+	struct responseShard
+	{
+		///Protects everything in the shard
+		pthread_mutex_t lock;
+
+		///Maps a key to its entry
+		map<string, responseEntry*> index;
+
+		///Entries ordered from lowest to highest priority
+		multimap<double, responseEntry*> order;
+
+		///The GDSF inflation value
+		double inflation;
+
+		///The response bytes held by the shard
+		size_t bytes;
+
+		long hits;
+		long misses;
+		long hitBytes;
+		long missBytes;
+		long evictions;
+		long rejections;
+	};
+
+	///The shards, picked by a hash of the key
+	responseShard shards[RESPONSESHARDS];
+
+	///The most response bytes each shard may hold
+	size_t shardBudget;
+
+	/**
+	 * @brief Picks the shard that owns a key
+	 */
+	responseShard& shardFor(const string& key)
+	{
+		//FNV-1a
+		unsigned int hash = 2166136261u;
+		for(size_t i = 0; i < key.length(); i++)
+			hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+		return shards[hash % RESPONSESHARDS];
+	}
+
+	/**
+	 * @brief Drops one reference and frees the entry when none are left
+	 */
+	static void dropReference(responseEntry* entry)
+	{
+		if(__sync_sub_and_fetch(&entry->refs, 1) == 0)
+			delete entry;
+	}
+
+	/**
+	 * @brief Moves an entry to the place its priority puts it
+	 *
+	 * @note The caller holds the shard's lock
+	 */
+	static void reprioritize(responseShard& shard, responseEntry* entry)
+	{
+		shard.order.erase(entry->order);
+		entry->priority = shard.inflation + (double)entry->frequency / entry->size();
+		entry->order = shard.order.insert(make_pair(entry->priority, entry));
+	}
+
+	public:
+
+	/**
+	 * @brief Creates an empty cache
+	 *
+	 * @param byteBudget The most response bytes the whole cache may hold
+	 */
+	ResponseCache(size_t byteBudget)
+	{
+		shardBudget = byteBudget / RESPONSESHARDS;
+
+		for(int i = 0; i < RESPONSESHARDS; i++)
+		{
+			pthread_mutex_init(&shards[i].lock, NULL);
+			shards[i].inflation = 0;
+			shards[i].bytes = 0;
+			shards[i].hits = 0;
+			shards[i].misses = 0;
+			shards[i].hitBytes = 0;
+			shards[i].missBytes = 0;
+			shards[i].evictions = 0;
+			shards[i].rejections = 0;
+		}
+	}
+
+	~ResponseCache()
+	{
+		for(int i = 0; i < RESPONSESHARDS; i++)
+		{
+			for(map<string, responseEntry*>::iterator it = shards[i].index.begin(); it != shards[i].index.end(); ++it)
+				dropReference(it->second);
+
+			pthread_mutex_destroy(&shards[i].lock);
+		}
+	}
+
+	/**
+	 * @brief The largest response worth fetching into memory for the cache
+	 */
+	size_t maxObjectSize()
+	{
+		return shardBudget;
+	}
+
+	/**
+	 * @brief Looks up a response
+	 *
+	 * @param key The origin and path
+	 * @return The entry, which must be handed back to release(), or NULL on a miss
+	 */
+	responseEntry* acquire(const string& key)
+	{
+		responseShard& shard = shardFor(key);
+		responseEntry* entry = NULL;
+
+		pthread_mutex_lock(&shard.lock);
+
+		map<string, responseEntry*>::iterator found = shard.index.find(key);
+		if(found != shard.index.end())
+		{
+			entry = found->second;
+			entry->frequency++;
+			reprioritize(shard, entry);
+			__sync_fetch_and_add(&entry->refs, 1);
+
+			shard.hits++;
+			shard.hitBytes += entry->size();
+		}
+		else
+			shard.misses++;
+
+		pthread_mutex_unlock(&shard.lock);
+
+		return entry;
+	}
+
+	/**
+	 * @brief Counts the bytes of a response fetched after a miss, whether or not it is offered to the cache
+	 */
+	void recordFetch(const string& key, size_t bytes)
+	{
+		responseShard& shard = shardFor(key);
+
+		pthread_mutex_lock(&shard.lock);
+		shard.missBytes += bytes;
+		pthread_mutex_unlock(&shard.lock);
+	}
+
+	/**
+	 * @brief Offers a response fetched after a miss
+	 *
+	 * @param key The origin and path
+	 * @param header The header as the client receives it
+	 * @param body The body
+	 * @return True if the response was admitted
+	 */
+	bool insert(const string& key, const string& header, const string& body)
+	{
+		size_t size = header.length() + body.length();
+		responseShard& shard = shardFor(key);
+		bool admitted = false;
+
+		pthread_mutex_lock(&shard.lock);
+
+		if(size <= shardBudget && shard.index.find(key) == shard.index.end())
+		{
+			double priority = shard.inflation + 1.0 / size;
+
+			//Find the victims first so nothing is evicted for a response that isn't admitted
+			size_t freed = 0;
+			multimap<double, responseEntry*>::iterator victim = shard.order.begin();
+			while(shard.bytes - freed + size > shardBudget && victim != shard.order.end() && victim->first <= priority)
+			{
+				freed += victim->second->size();
+				++victim;
+			}
+
+			if(shard.bytes - freed + size <= shardBudget)
+			{
+				while(shard.order.begin() != victim)
+				{
+					responseEntry* evicted = shard.order.begin()->second;
+					shard.inflation = max(shard.inflation, evicted->priority);
+					shard.order.erase(shard.order.begin());
+					shard.index.erase(evicted->key);
+					shard.bytes -= evicted->size();
+					shard.evictions++;
+
+					dropReference(evicted);
+				}
+
+				responseEntry* entry = new responseEntry();
+				entry->key = key;
+				entry->header = header;
+				entry->body = body;
+				entry->frequency = 1;
+				entry->priority = shard.inflation + 1.0 / size;
+				entry->order = shard.order.insert(make_pair(entry->priority, entry));
+				entry->refs = 1;
+
+				shard.index[key] = entry;
+				shard.bytes += size;
+				admitted = true;
+			}
+			else
+				shard.rejections++;
+		}
+
+		pthread_mutex_unlock(&shard.lock);
+
+		return admitted;
+	}
+
+	/**
+	 * @brief Hands back an entry returned by acquire()
+	 */
+	void release(responseEntry* entry)
+	{
+		dropReference(entry);
+	}
+
+	/**
+	 * @brief Prints the request and byte hit ratios of each shard and the whole cache
+	 */
+	void printStats()
+	{
+		long hits = 0, misses = 0, hitBytes = 0, missBytes = 0, evictions = 0, rejections = 0;
+		size_t bytes = 0;
+
+		for(int i = 0; i < RESPONSESHARDS; i++)
+		{
+			responseShard& shard = shards[i];
+
+			pthread_mutex_lock(&shard.lock);
+
+			if(shard.hits + shard.misses > 0)
+				cout << "Shard " << i << "\t" << "hit ratio: " << (double)shard.hits / (shard.hits + shard.misses) << "\t" << "byte hit ratio: " << (shard.hitBytes + shard.missBytes ? (double)shard.hitBytes / (shard.hitBytes + shard.missBytes) : 0) << "\t" << "entries: " << shard.index.size() << "\t" << "bytes: " << shard.bytes << endl;
+
+			hits += shard.hits;
+			misses += shard.misses;
+			hitBytes += shard.hitBytes;
+			missBytes += shard.missBytes;
+			evictions += shard.evictions;
+			rejections += shard.rejections;
+			bytes += shard.bytes;
+
+			pthread_mutex_unlock(&shard.lock);
+		}
+
+		cout << "Response cache hits: " << hits << "\t" << "misses: " << misses << "\t" << "hit ratio: " << (hits + misses ? (double)hits / (hits + misses) : 0) << "\t" << "byte hit ratio: " << (hitBytes + missBytes ? (double)hitBytes / (hitBytes + missBytes) : 0) << endl;
+		cout << "Response cache evictions: " << evictions << "\t" << "rejected admissions: " << rejections << "\t" << "bytes: " << bytes << endl;
+	}
+};
+}
+#endif
@@ -18,25 +18,96 @@
 #include <iostream>
 #include <string.h>
 #include <pthread.h>
-#include <queue>
 #include <fstream>
 #include <signal.h>
 #include <errno.h>
-#include <sys/shm.h>
-#include <sys/ipc.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "contentCache.cpp"
+#include "mpmcQueue.cpp"
+#include "requestParser.cpp"
+#include "shmPool.cpp"
+#include "shmQueue.cpp"
+#include "serverRegistry.cpp"
 
 #define SHMEM
-#define SHNUM 5 //The number of shared memory segments
-#define SHSIZE 4096 //The size of each segment
+#define SHNUM 5 //The fewest shared memory segments the pool may grow to by default
 
 #define SENDSIZE 2048//The bytes read from the file during each iteration
-#define MAXSERVERS 50
+#define SENDFILESIZE 262144 //The most bytes handed to a single sendfile call
+#define CACHEOBJECTSIZE 1048576 //Files larger than this are sent with sendfile instead of cached
+
+#define CLOSETAIL "Connection: close\r\n\r\n" //Ends the header of a response on a closing connection
+#define KEEPALIVETAIL "Connection: keep-alive\r\n\r\n" //Ends the header of a response on a persistent connection
+#define LINGERMILLIS 1000 //The longest a closing persistent connection waits for more bytes to discard, so pipelined requests don't reset it
+#define LINGERMAXBYTES 65536 //The most bytes a closing connection discards before it is closed anyway
+#define MAXEVENTS 64 //The number of epoll events handled per wakeup
+#define ACCEPTBATCH 16 //The most connections a listener accepts before handing them to its workers
+#define LISTENERWORKERS 4 //The threads that serve each REUSEPORT listener's connections by default
+#define FDPASSNAME "httpServer.%d" //The abstract Unix socket a server passes file descriptors on, by port
 
 using namespace std;
 
-struct requestData
+static_assert(SQSEGMENTS >= SHMAXSEGMENTS, "a submission queue must be able to reject any segment");
+
+/**
+ * @brief The state of a non-blocking connection owned by an event loop
+ */
+struct connectionData
 {
+	///The client's socket
 	int socketNum;
+	
+	///The request bytes received so far
+	char input[REQUESTBUFSIZE];
+	
+	///The number of bytes in input
+	int inputLength;
+	
+	///Parses input as it arrives
+	RequestParser parser;
+	
+	///Response bytes that go out before the file (the header or an error page)
+	string output;
+	
+	///How much of output has been written
+	size_t outputSent;
+	
+	///The file being sent, or -1 if the response is only output
+	int fileFd;
+	
+	///The cached response being sent, or NULL
+	cacheEntry* entry;
+	
+	///The offset of the next file byte to send
+	off_t fileOffset;
+	
+	///The number of file bytes left to send
+	off_t fileRemaining;
+	
+	///Set once the request has been parsed and the response prepared
+	bool responding;
+};
+
+/**
+ * @brief What a server sends in front of the response header when it passes a file descriptor
+ */
+struct fdPassReply
+{
+	///The offset of the body in the passed file
+	long offset;
+	
+	///The number of body bytes, 0 if no file was passed
+	long length;
+	
+	///The number of header bytes that follow, which hold the whole response if there is no file
+	int headerLength;
 };
 
 inline void signal_callback_handler(int signum);
@@ -66,23 +137,11 @@ class HTTP_Server
 	///The attributes threads run with
 	pthread_attr_t attr;
 	
-	///Pthreads condition that will be 'signaled' when a client is accepted
-	pthread_cond_t acceptCondition;
-	
-	///Pthreads condition that will broadcast when a thread finishes using a section of shared memory
-	pthread_cond_t bufferCondition;
-	
-	///The mutex that will lock to change information about the shared memory queue
-	pthread_mutex_t bufferLock;
-	
 	///Controls whether the server is running or not
 	bool running;
 	
-	///The mutex that synchronizes the boss thread and the worker threads
-	pthread_mutex_t acceptLock;
-	
-	///Queue that file requests are placed in
-	queue<requestData*> requestQueue;
+	///Lock-free queue the boss thread hands accepted sockets to workers through
+	MPMCQueue* requestQueue;
 
 	///The socket that is handling accepts
 	int bossfd;
@@ -90,35 +149,107 @@ class HTTP_Server
 	///The path of the documents folder that the server will read from
 	const char* rootDir;
 
-	///The current head of the shared memory queue
-	unsigned int queueHead;
-
-	///The current tail of the shared memory queue
-	unsigned int queueTail;
+	///The shared memory rings SHBUFF transfers go through, or NULL before setup
+	SharedMemPool* shMemPool;
 	
-	///The number of threads currently using shared memory
-	int shMemThreads;
-
-	///Queue for getting a shared memory slot
-	int* sharedQueue;
+	///The most segments the pool grows to, or 0 to match the number of workers
+	int shMemMax;
+	
+	///The size of each segment this process creates
+	size_t shMemSize;
+	
+	///Whether segments are put on hugetlbfs
+	bool shMemHugePages;
+	
+	///The machine's table of servers and their load, or NULL before registering
+	ServerRegistry* registry;
+	
+	///The thread that keeps this server's registry entry current
+	pthread_t heartbeatThread;
+	
+	///The queue local proxies submit SHBUFF requests through, or NULL
+	SubmissionQueue* submissions;
 	
-	///An array of pointers to the sections of shared memory
-	int** shMem;
+	///The threads that serve submitted requests
+	pthread_t* submissionThreads;
 	
-	///An array of ID's for shared memory segments
-	int* shMemID;
+	///The number of submission threads
+	int submissionThreadCount;
 	
-	///The id of the shared memory segment that contains the server ports being used
-	int serverListID;
+	///The requests taken from the submission queue
+	long submittedRequests;
 	
-	///A segment of shared memory that keeps a list of the ports that servers bind to
-	int* serverList;
+	///Flags that represent how accepted connections are serviced
+	typedef enum {BOSS_WORKER, EVENT_LOOP, REUSEPORT} ServerMode;
 	
-	///Attributes for the condition variable for shared memory
-	pthread_condattr_t shMemCondAttr;
+	///The mode the server was set up in
+	ServerMode serverMode;
 	
-	///Attributes for the mutex for shared memory
-	pthread_mutexattr_t shMemMutexAttr;
+	///Array of event loop threads that service connections in EVENT_LOOP mode
+	pthread_t* eventThreads;
+	
+	///One epoll instance for each event loop thread
+	int* epollfds;
+	
+	///The number of event loop threads
+	int eventLoopCount;
+	
+	///Round robin counter the boss thread uses to pick an event loop
+	unsigned int nextEventLoop;
+	
+	///The number of sendfile calls made for file bodies
+	long sendfileCalls;
+	
+	///The file bytes sent with sendfile, which never pass through user space
+	long zeroCopyBytes;
+	
+	///The read/write pairs made by the buffered (SHBUFF) file loop
+	long bufferedCalls;
+	
+	///The file bytes copied through a user-space buffer
+	long bufferedBytes;
+	
+	///The file descriptors passed to local proxies
+	long passedFds;
+	
+	///The file bytes behind the passed descriptors, which the proxy sends itself
+	long passedBytes;
+	
+	///The Unix socket local proxies connect to for FDPASS requests, or -1
+	int fdPassfd;
+	
+	///The thread that accepts on fdPassfd
+	pthread_t fdPassThread;
+	
+	///Static files held in memory, or NULL if caching is off
+	ContentCache* contentCache;
+	
+	///The most requests served on one connection, or 0 to close after every response
+	int keepAliveMax;
+	
+	///The seconds an idle persistent connection is held open
+	int keepAliveTimeout;
+	
+	///The backlog passed to listen()
+	int listenBacklog;
+	
+	///The number of sockets accepting connections: the boss thread's, or one per REUSEPORT listener
+	int listenerCount;
+	
+	///Connections accepted by each listening socket
+	long* acceptCounts;
+	
+	///The REUSEPORT listener threads, which only accept
+	pthread_t* listenerThreads;
+	
+	///One queue per REUSEPORT listener that its own workers serve from
+	MPMCQueue** listenerQueues;
+	
+	///Round robin counter fdPassTask uses to pick a listener's queue
+	unsigned int nextListener;
+	
+	///acceptCounts as of the last printAcceptRates call
+	long* reportedAcceptCounts;
 	
 	//Boolean that tracks the running state of the server
 	//static bool serverRunning;
@@ -128,142 +259,49 @@ class HTTP_Server
 		cout << errorText << endl;
 	}
 	
-	/**
-	 * @brief Flags that represents the current state of a shared memory slot
-	 */
-	enum {FREE, LOCKED, MODIFIED, READ};
-	
-	///Flags that represent the different return methods for data going to the client
-	typedef enum {GET, SHBUFF} DataMethod;
+	///The arguments handed to a new event loop or listener thread
+	struct threadArgs
+	{
+		HTTP_Server* srv;
+		int index;
+	};
 
 	/**
-	* @brief Creates and connects to shared memory, and if this is the first process to attach, initialize the state and mutex
+	* @brief Joins the machine's pool of shared memory rings and the registry of servers
 	* 
-	* @note 4 Byte state, Shared Mutex, 4 Byte data length, data
+	* @note Segments are created on demand by SharedMemPool
 	*/
 	void setupSharedMem()
 	{
-		sharedQueue = new int[workerThreadCount];
-		shMem = new int* [SHNUM];
-		shMemID = new int[SHNUM];
-		
-		for(int i = 0; i < SHNUM; i++)
-		{
-			int sharedID = 0;
-			key_t sharedKey = 7890 + i;
-
-			//create shared memory
-			if((sharedID = shmget(sharedKey, SHSIZE, IPC_CREAT | 0666)) < 0)
-				cout << "Error created shared memory" << endl;
-			
-			//Store the ID	
-			shMemID[i] = sharedID;
-			
-			//Get shared memory info
-			shmid_ds stats;	
-			if(shmctl(sharedID, IPC_STAT, &stats) < 0)
-				cout << "Error in shared memory Stat" << endl;
-				
-			//Attach to the memory
-			if((shMem[i] = (int*)shmat(sharedID, 0, 0)) == (int*)-1)
-				cout << "Error attaching to shared memory" << endl;	
-				
-			//If this is the first to attach, initialize the mutex and state
-			if(stats.shm_nattch == 0)
-			{
-
-				//Initialize the attributes
-				if(i == 0)
-				{
-					pthread_mutexattr_init(&shMemMutexAttr);
-					pthread_condattr_init(&shMemCondAttr);
-					
-					pthread_mutexattr_setpshared(&shMemMutexAttr, PTHREAD_PROCESS_SHARED);
-					pthread_condattr_setpshared(&shMemCondAttr, PTHREAD_PROCESS_SHARED);
-				}
-					
-				//Init state
-				*(shMem[i]) = FREE;
-				
-				//Create the shared mutex
-				pthread_mutex_init((pthread_mutex_t*)(shMem[i] + 1), &shMemMutexAttr);
-				
-				//Create a shared condition
-				char* mutexEnd = (char*)(shMem[i] + 1) + sizeof(pthread_mutex_t);
-				pthread_cond_init((pthread_cond_t*)mutexEnd, &shMemCondAttr);
-				
-			}		
-		}
-		
-		//Create the section of shared memory that will hold a list of server ports
-		if((serverListID = shmget(7890 - 1, MAXSERVERS * sizeof(int), IPC_CREAT | 0666)) < 0)
-			cout << "Error created shared memory" << endl;
+		//By default every worker can have a SHBUFF transfer in flight
+		int maxSegments = shMemMax > 0 ? shMemMax : max(SHNUM, max(workerThreadCount, max(eventLoopCount, listenerCount)));
+		shMemPool = new SharedMemPool(maxSegments, shMemSize, shMemHugePages);
 		
-		//Get shared memory info
-		shmid_ds stats;	
-		if(shmctl(serverListID, IPC_STAT, &stats) < 0)
-			cout << "Error in shared memory Stat" << endl;
-			
-		//Attach to the memory
-		if((serverList = (int*)shmat(serverListID, 0, 0)) == (int*)-1)
-			cout << "Error attaching to shared memory" << endl;	
-			
-		if(stats.shm_nattch == 0)
-			bzero(serverList, MAXSERVERS * sizeof(int));
+		registry = new ServerRegistry();
 	}
 	
 	/**
 	 * @brief Gains ownership of a section of shared memory
-	 * @return The index of the shared memory section in shMem
+	 * @return The index of the shared memory section in shMemPool
 	 * 
 	 * @note Blocks until shared memory can be acquired
 	 */
 	int acquireSharedMem()
 	{
-		int retn;
-		
-		pthread_mutex_lock(&bufferLock);
-		sharedQueue[queueTail] = (unsigned int)pthread_self();
-		queueTail = (queueTail + 1) % SHNUM;
-		
-		while(shMemThreads >= SHNUM || sharedQueue[queueHead] != (unsigned int)pthread_self())
-			pthread_cond_wait(&bufferCondition, &bufferLock);
-			
-		queueHead = (queueHead + 1) % SHNUM;
-		shMemThreads++;
-		
-		pthread_mutex_unlock(&bufferLock);
-		
-		//Find a free shmem segment
-		for(int i = 0; i < SHNUM; i++)
-			if(*(shMem[i]) == FREE)
-			{
-				retn = i;
-				*(shMem[i]) = LOCKED;
-				break;
-			}
-		
-		pthread_mutex_lock(&bufferLock);
-		pthread_cond_broadcast(&bufferCondition);
-		pthread_mutex_unlock(&bufferLock);
-		
-		return retn;
+		return shMemPool->acquire();
 	}
 	
 	void releaseSharedMem(int shId)
 	{
-		pthread_mutex_lock(&bufferLock);
-		
-		*(shMem[shId]) = FREE;
-		
-		shMemThreads--;
-		
-		pthread_cond_broadcast(&bufferCondition);
-		pthread_mutex_unlock(&bufferLock);
+		shMemPool->release(shId);
 	}
 	
 	public:
 	
+	///Flags that represent the different return methods for data going to the client
+	///@note SHQUEUE is SHBUFF into a segment the proxy already claimed, submitted through the shared queue
+	typedef enum {GET, SHBUFF, FDPASS, SHQUEUE} DataMethod;
+	
 	///An instance of the running server
 	///@note Only one server can be running per process
 	///@note Not thread safe
@@ -274,44 +312,45 @@ class HTTP_Server
 	 */
 	void cleanupSharedMem()
 	{
-		for(int i = 0; i < SHNUM; i++)
+		if(!shMemPool) return;
+		
+		//Proxies stop submitting, and whatever they already submitted is answered while the segments are still mapped
+		if(submissions)
 		{
-			shmdt(shMem[i]);
-			
-			//Get shared memory info
-			shmid_ds stats;	
-			if(shmctl(shMemID[i], IPC_STAT, &stats) < 0)
-				cout << "Error in shared memory Stat" << endl;
-				
-			//Mark for removal if no other processes are attached (This should be required behavior for IPC_RMID anyway)
-			if(stats.shm_nattch == 0)
-			{
-				shmctl(shMemID[i], IPC_RMID, &stats);
-			}
+			submissions->shutdown(port);
+			drainSubmissions();
 		}
 		
-		delete sharedQueue;
-		delete shMem;
-		delete shMemID;
+		//The last process out removes the segments
+		delete shMemPool;
+		shMemPool = NULL;
+		
+		//Worker threads may still touch the registry, so it stays mapped until exit
+		if(registry) registry->detach();
+	}
+	
+	/**
+	 * @brief Answers every request left in the closed submission queue with a 503
+	 * 
+	 * @note Without this a proxy would wait on a segment nobody is going to fill
+	 */
+	void drainSubmissions()
+	{
+		string response = buildHeader("503 Service Unavailable", 19) + CLOSETAIL + "Service Unavailable";
+		string fileName;
+		int segment;
 		
-		//unregister the server in shared memory
-		for(int i = 0; i < MAXSERVERS; i++)
-			if(serverList[i] == port)
+		while(submissions->takeRemaining(fileName, segment))
+		{
+			SharedRing* ring = shMemPool->attach(segment);
+			if(!ring)
 			{
-				serverList[i] = 0;
+				submissions->reject(segment);
+				continue;
 			}
 			
-		shmdt(serverList);
-		
-		//Get shared memory info
-		shmid_ds stats;	
-		if(shmctl(serverListID, IPC_STAT, &stats) < 0)
-			cout << "Error in shared memory Stat" << endl;
-			
-		//Mark for removal if no other processes are attached (This should be required behavior for IPC_RMID anyway)
-		if(stats.shm_nattch == 0)
-		{
-			shmctl(serverListID, IPC_RMID, &stats);
+			ring->append(response.c_str(), response.length());
+			ring->end();
 		}
 	}
 	
@@ -332,21 +371,52 @@ class HTTP_Server
 		queueSize = acceptQueueSize;
 		running = true;
 		
-		pthread_mutex_init(&acceptLock, NULL);
-		pthread_cond_init(&acceptCondition, NULL);
-		
-		pthread_mutex_init(&bufferLock, NULL);
-		pthread_cond_init(&bufferCondition, NULL);
+		//Holding queueSize sockets is what makes the boss thread reject connections
+		requestQueue = new MPMCQueue(queueSize);
 		
 		pthread_attr_init(&attr);
 		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
 		
 		rootDir = "WWW/";
 		
-		queueTail = 0;
-		queueHead = 0;
+		shMemPool = NULL;
+		shMemMax = 0;
+		shMemSize = sizeof(SharedRing) + SHSLOTS * SHSLOTSIZE;
+		shMemHugePages = false;
+		registry = NULL;
+		submissions = NULL;
+		submissionThreads = NULL;
+		submissionThreadCount = 0;
+		submittedRequests = 0;
+		
+		serverMode = BOSS_WORKER;
+		workerThreads = NULL;
+		workerThreadCount = 0;
+		eventThreads = NULL;
+		epollfds = NULL;
+		eventLoopCount = 0;
+		nextEventLoop = 0;
+		
+		sendfileCalls = 0;
+		zeroCopyBytes = 0;
+		bufferedCalls = 0;
+		bufferedBytes = 0;
+		passedFds = 0;
+		passedBytes = 0;
+		fdPassfd = -1;
 		
-		shMemThreads = 0;
+		contentCache = NULL;
+		
+		keepAliveMax = 0;
+		keepAliveTimeout = 5;
+		
+		listenBacklog = 5;
+		listenerCount = 1;
+		acceptCounts = new long[1]();
+		reportedAcceptCounts = new long[1]();
+		listenerThreads = NULL;
+		listenerQueues = NULL;
+		nextListener = 0;
 		
 		srvInstance = this;
 	}
@@ -367,267 +437,1199 @@ class HTTP_Server
 			pthread_create(&workerThreads[i], &attr, HTTP_Server::launchWorkerThreadTask, this);
 		}
 		
-#ifdef SHMEM
-		setupSharedMem();
-		
-		//register the server in shared memory
-		for(int i = 0; i < MAXSERVERS; i++)
-			if(serverList[i] == 0)
-			{
-				serverList[i] = port;
-				break;
-			}
-		
-		signal(SIGINT, signal_callback_handler);
-#endif
+		registerServer();
 	}
 	
 	/**
-	 * @brief Stops all worker threads and the boss thread
+	 * @brief Initializes edge-triggered epoll event loops that will handle
+	 * the client requests instead of a worker thread pool
+	 * 
+	 * @param loopCount The number of event loop threads
+	 * 
+	 * @note Each loop multiplexes many non-blocking connections, so a slow
+	 * client no longer holds a thread for the whole transfer. SHBUFF
+	 * requests are still serviced synchronously on the loop thread.
 	 */
-	void shutdownServer()
+	void setupEventLoops(int loopCount)
 	{
-		pthread_cancel(masterThread);
-		pthread_join(masterThread, NULL);
-		
-		pthread_mutex_lock(&acceptLock);
+		cout << "Setting up event loops" << endl;
+		serverMode = EVENT_LOOP;
+		eventLoopCount = loopCount;
+		eventThreads = new pthread_t[loopCount];
+		epollfds = new int[loopCount];
 		
-		running = false;
-		pthread_cond_broadcast(&acceptCondition);
-		
-		pthread_mutex_unlock(&acceptLock);
-		
-		for(int i = 0; i < workerThreadCount; i++)
+		for(int i = 0; i < loopCount; i++)
 		{
-			//pthread_cancel(workerThreads[i]);
-			pthread_join(workerThreads[i], NULL);
+			if((epollfds[i] = epoll_create1(0)) < 0)
+				error("Unable to create epoll instance");
+			
+			threadArgs* args = new threadArgs;
+			args->srv = this;
+			args->index = i;
+			
+			eventThreads[i] = pthread_t();
+			pthread_create(&eventThreads[i], &attr, HTTP_Server::launchEventLoopTask, args);
 		}
+		
+		registerServer();
 	}
-
+	
 	/**
-	 * @brief Starts the boss thread that will accept incoming
-	 *  connections and pass them to worker threads.
+	 * @brief Gives every listener thread its own SO_REUSEPORT listening socket and its own set of workers
+	 * 
+	 * @param listeners The number of listener threads
+	 * @param workersPerListener The threads that serve each listener's connections
 	 * 
-	 * @note Uses the port defined in the constructor
+	 * @note There is no boss thread or shared handoff queue in this mode. The
+	 * kernel spreads new connections across the listening sockets, and each
+	 * listener drains its socket with non-blocking accept4 in batches of
+	 * ACCEPTBATCH. The batch goes to the listener's own queue, so a persistent
+	 * connection holds one of its workers rather than the listener.
 	 */
-	void beginAcceptLoop()
+	void setupReusePortListeners(int listeners, int workersPerListener = LISTENERWORKERS)
 	{
-		pthread_create(&masterThread, &attr, HTTP_Server::launchBossThread, this);
+		cout << "Setting up listeners" << endl;
+		serverMode = REUSEPORT;
+		
+		listenerCount = listeners;
+		acceptCounts = new long[listeners]();
+		reportedAcceptCounts = new long[listeners]();
+		
+		listenerQueues = new MPMCQueue*[listeners];
+		for(int i = 0; i < listeners; i++)
+			listenerQueues[i] = new MPMCQueue(queueSize);
+		
+		workerThreadCount = listeners * workersPerListener;
+		workerThreads = new pthread_t[workerThreadCount];
+		for(int i = 0; i < workerThreadCount; i++)
+		{
+			threadArgs* args = new threadArgs;
+			args->srv = this;
+			args->index = i % listeners;
+			
+			workerThreads[i] = pthread_t();
+			pthread_create(&workerThreads[i], &attr, HTTP_Server::launchListenerWorkerTask, args);
+		}
+		
+		listenerThreads = new pthread_t[listeners];
+		for(int i = 0; i < listeners; i++)
+		{
+			threadArgs* args = new threadArgs;
+			args->srv = this;
+			args->index = i;
+			
+			listenerThreads[i] = pthread_t();
+			pthread_create(&listenerThreads[i], &attr, HTTP_Server::launchListenerTask, args);
+		}
+		
+		registerServer();
 	}
 	
 	/**
-	 * @brief A level of indirection to call the member function bossThread for a thread
+	 * @brief Sets the backlog of pending connections each listening socket keeps
 	 * 
-	 * @param obj The object that is creating the thread
+	 * @note Call before the listening sockets are opened
 	 */
-	static void *launchBossThread(void* obj)
+	void setListenBacklog(int backlog)
 	{
-		HTTP_Server* thisSrv = static_cast<HTTP_Server*>(obj);
-		thisSrv->bossThread(thisSrv);
+		listenBacklog = backlog;
 	}
 	
 	/**
-	 * @brief The boss thread that will loop while accepting client 
-	 * connections and handing them to worker threads
+	 * @brief Prints how many connections per second each listening socket accepted since the last call
 	 * 
-	 * @note http://www.linuxhowtos.org/C_C++/socket.htm
+	 * @param seconds The time since the last call
+	 * 
+	 * @note Nothing is printed for an interval without any connections
 	 */
-	virtual void *bossThread(void* input)
+	void printAcceptRates(int seconds)
 	{
-		HTTP_Server* thisSrv = (HTTP_Server*) input;
-		int portIN = thisSrv->port;
-		struct sockaddr_in serv_addr;
+		long rates[listenerCount];
+		long total = 0;
 		
-		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		thisSrv->bossfd = sockfd;
-		if(sockfd < 0)
+		for(int i = 0; i < listenerCount; i++)
 		{
-			error("Unable to open socket");
-			printf("errno: %d (%d, %d, %d)\n", errno, EBADF, EINTR, EIO);
-		}
+			long accepted = __atomic_load_n(&acceptCounts[i], __ATOMIC_RELAXED);
+			long delta = accepted - reportedAcceptCounts[i];
+			reportedAcceptCounts[i] = accepted;
 			
-		//Clear the structs
-		bzero(&serv_addr, sizeof(serv_addr));
-		
-		//sets server information
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_port = htons(portIN);//Host to network
-		serv_addr.sin_addr.s_addr = INADDR_ANY;
+			rates[i] = delta / seconds;
+			total += delta;
+		}
 		
-		if(bind(sockfd, (const sockaddr*) &serv_addr, sizeof(serv_addr)) < 0)
-			error("Bind failed on port: " + portIN);
-			
-		listen(sockfd, 5);
+		if(total == 0) return;
 		
-		//Loop and accept connections
-		while(thisSrv->running)
+		total = 0;
+		for(int i = 0; i < listenerCount; i++)
 		{
-			struct sockaddr_in client_addr;
-			//bzero(&&client_addr, sizeof(&client_addr));
-			socklen_t clientlen = sizeof(client_addr);
-			int newsockfd = accept(sockfd, (struct sockaddr *) &client_addr, &clientlen);
-			
-			//Should skip the interrupted accept
-			if(newsockfd <= 0) continue;
-			
-			pthread_mutex_lock(&thisSrv->acceptLock);
-			
-			
-			if(thisSrv->requestQueue.size() >= thisSrv->queueSize)
-			{
-				//cout << "Full!" << endl;
-				close(newsockfd);
-			}
-			else
-			{				
-				//Add this connection to the request queue
-				struct requestData* data = new requestData();
-				data->socketNum = newsockfd;
-				thisSrv->requestQueue.push(data);
-				//cout << "Size: " << thisSrv->requestQueue.size() << endl;
-				
-				//Signal waiting workers
-				pthread_cond_signal(&thisSrv->acceptCondition);
-			}
-			
-			pthread_mutex_unlock(&thisSrv->acceptLock);
-
+			cout << "Listener " << i << ": " << rates[i] << " accepts/s" << "\t";
+			total += rates[i];
 		}
 		
-		//pthread_exit(0);
+		cout << "Total: " << total << " accepts/s" << endl;
 	}
 	
 	/**
-	 * @brief A level of indirection to call the member function workerThreadTask for a thread
+	 * @brief Keeps requested files mapped in memory so hits need no filesystem calls
 	 * 
-	 * @param obj The object that is creating the thread
+	 * @param byteBudget The most file bytes the cache may hold
+	 * 
+	 * @note Call before the accept loop starts. Files are assumed not to change while cached.
 	 */
-	static void *launchWorkerThreadTask(void* obj)
+	void setupContentCache(size_t byteBudget)
 	{
-		HTTP_Server* thisSrv = static_cast<HTTP_Server*>(obj);
-		thisSrv->workerThreadTask(thisSrv);
+		contentCache = new ContentCache(byteBudget, CACHEOBJECTSIZE);
 	}
 	
 	/**
-	 * @brief The method worker tasks run that receive client information
-	 * from the boss thread
+	 * @brief Lets worker threads serve several, possibly pipelined, requests on one connection
+	 * 
+	 * @param maxRequests The most requests served before the connection is closed
+	 * @param idleSeconds How long a worker waits for the next request before closing
+	 * 
+	 * @note Only GET requests served by worker threads persist. Event loops and
+	 * SHBUFF transfers still close after each response.
 	 */
-	virtual void *workerThreadTask(void* input)
+	void setupKeepAlive(int maxRequests, int idleSeconds)
 	{
-		HTTP_Server* thisSrv = (HTTP_Server*)input;
-		char buffer[255];
+		keepAliveMax = maxRequests;
+		keepAliveTimeout = idleSeconds;
+	}
+	
+	/**
+	 * @brief Sizes the pool of shared memory rings used for SHBUFF transfers
+	 * 
+	 * @param maxSegments The most segments the pool grows to, or 0 to match the number of workers
+	 * @param segmentSize The size of each segment, split into SHSLOTS slots
+	 * @param hugePages Whether to put segments on hugetlbfs, falling back to transparent huge pages
+	 * 
+	 * @note Must be called before the thread pool, event loops or listeners are set up.
+	 * Only the first process on the machine decides whether huge pages are used.
+	 */
+	void setupSharedMemPool(int maxSegments, size_t segmentSize, bool hugePages)
+	{
+		shMemMax = maxSegments;
+		if(segmentSize > 0) shMemSize = segmentSize;
+		shMemHugePages = hugePages;
+	}
+	
+	/**
+	 * @brief Attaches to shared memory and registers the server's port so proxies can find it
+	 * 
+	 * @note A heartbeat thread keeps the entry's load current so proxies can balance across servers
+	 */
+	void registerServer()
+	{
+#ifdef SHMEM
+		setupSharedMem();
 		
-		while(thisSrv->running)
+		registry->registerSelf(port, max(workerThreadCount, eventLoopCount), isOrigin());
+		pthread_create(&heartbeatThread, &attr, HTTP_Server::launchHeartbeatTask, this);
+		
+		if(isOrigin()) openSubmissionQueue();
+		
+		openFdPassSocket();
+		
+		signal(SIGINT, signal_callback_handler);
+#endif
+	}
+	
+	/**
+	 * @brief Whether the process serves files itself, so proxies may send requests to it
+	 */
+	virtual bool isOrigin()
+	{
+		return true;
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function heartbeatTask for a thread
+	 */
+	static void *launchHeartbeatTask(void* obj)
+	{
+		HTTP_Server* thisSrv = (HTTP_Server*)obj;
+		return thisSrv->heartbeatTask();
+	}
+	
+	/**
+	 * @brief Publishes the server's heartbeat and queue depth every REGISTRYBEATMS
+	 */
+	void *heartbeatTask()
+	{
+		while(running)
 		{
-			requestData *data;
-			
-			#pragma region Critical Section
-			pthread_mutex_lock(&thisSrv->acceptLock);
-			if(!thisSrv->running)
+			//Event loops don't queue connections; they report them as active
+			registry->beat(queuedConnections());
+			usleep(REGISTRYBEATMS * 1000);
+		}
+		
+		return NULL;
+	}
+	
+	/**
+	 * @brief Counts the accepted connections waiting for a worker, which may be stale
+	 */
+	unsigned long queuedConnections()
+	{
+		if(serverMode == BOSS_WORKER) return requestQueue->approximateSize();
+		
+		unsigned long queued = 0;
+		if(serverMode == REUSEPORT)
+		{
+			for(int i = 0; i < listenerCount; i++)
+				queued += listenerQueues[i]->approximateSize();
+		}
+		
+		return queued;
+	}
+	
+	/**
+	 * @brief Creates the queue local proxies post SHBUFF requests to, and the threads that serve them
+	 * 
+	 * @note There is one submission thread per worker, each serving a request
+	 * at a time, so shared memory requests don't wait behind TCP connections
+	 */
+	void openSubmissionQueue()
+	{
+		if(!(submissions = SubmissionQueue::create(port)))
+		{
+			error("Unable to create the shared memory submission queue");
+			return;
+		}
+		
+		submissionThreadCount = max(1, max(workerThreadCount, eventLoopCount));
+		submissionThreads = new pthread_t[submissionThreadCount];
+		for(int i = 0; i < submissionThreadCount; i++)
+			pthread_create(&submissionThreads[i], &attr, HTTP_Server::launchSubmissionTask, this);
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function submissionTask for a thread
+	 */
+	static void *launchSubmissionTask(void* obj)
+	{
+		HTTP_Server* thisSrv = (HTTP_Server*)obj;
+		return thisSrv->submissionTask();
+	}
+	
+	/**
+	 * @brief Serves requests local proxies submit through shared memory
+	 */
+	void *submissionTask()
+	{
+		string fileName;
+		int segment;
+		
+		while(running)
+		{
+			//Time out periodically so shutdownServer can stop the thread
+			if(!submissions->take(fileName, segment, 500)) continue;
+			
+			//The proxy created the segment, but this process may not have mapped it yet
+			if(!shMemPool->attach(segment))
 			{
-				pthread_mutex_unlock(&thisSrv->acceptLock);
-				return NULL;
+				error("Unable to map a submitted segment");
+				submissions->reject(segment);
+				continue;
+			}
+			
+			__sync_fetch_and_add(&submittedRequests, 1);
+			
+			registry->connectionOpened();
+			parseHTTPRequest(fileName, segment, SHQUEUE, "", 0, false);
+			registry->connectionClosed();
+		}
+		
+		return NULL;
+	}
+	
+	/**
+	 * @brief Fills in the address of the Unix socket the server on a port passes descriptors on
+	 * 
+	 * @return The length of the address
+	 * 
+	 * @note The socket is in the abstract namespace, so nothing is left in the filesystem
+	 */
+	static socklen_t fdPassAddress(int serverPort, struct sockaddr_un& addr)
+	{
+		bzero(&addr, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		
+		int nameLength = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, FDPASSNAME, serverPort);
+		
+		return offsetof(struct sockaddr_un, sun_path) + 1 + nameLength;
+	}
+	
+	/**
+	 * @brief Starts accepting FDPASS requests from local proxies
+	 */
+	void openFdPassSocket()
+	{
+		struct sockaddr_un addr;
+		socklen_t addrLength = fdPassAddress(port, addr);
+		
+		fdPassfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		
+		if(fdPassfd < 0 || bind(fdPassfd, (const sockaddr*) &addr, addrLength) < 0 || listen(fdPassfd, listenBacklog) < 0)
+		{
+			error("Unable to open the descriptor passing socket");
+			if(fdPassfd >= 0) close(fdPassfd);
+			fdPassfd = -1;
+			return;
+		}
+		
+		pthread_create(&fdPassThread, &attr, HTTP_Server::launchFdPassTask, this);
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function fdPassTask for a thread
+	 */
+	static void *launchFdPassTask(void* obj)
+	{
+		HTTP_Server* thisSrv = (HTTP_Server*)obj;
+		return thisSrv->fdPassTask();
+	}
+	
+	/**
+	 * @brief Accepts local proxy connections and answers their FDPASS requests
+	 * 
+	 * @note The connections are served like any other accepted in the
+	 * server's mode, so a slow proxy never holds up the others.
+	 */
+	virtual void *fdPassTask()
+	{
+		struct pollfd listenPoll;
+		listenPoll.fd = fdPassfd;
+		listenPoll.events = POLLIN;
+		
+		while(running)
+		{
+			//Time out periodically so shutdownServer can stop the thread
+			if(poll(&listenPoll, 1, 500) <= 0) continue;
+			
+			int newsockfd = accept4(fdPassfd, NULL, NULL, SOCK_CLOEXEC);
+			if(newsockfd < 0) continue;
+			
+			if(serverMode == EVENT_LOOP)
+			{
+				dispatchToEventLoop(newsockfd);
+				continue;
+			}
+			
+			MPMCQueue* queue = requestQueue;
+			if(serverMode == REUSEPORT)
+				queue = listenerQueues[nextListener++ % listenerCount];
+			
+			//Rejected like any other connection when the workers are behind
+			if(!queue->tryPush(newsockfd))
+				close(newsockfd);
+		}
+		
+		close(fdPassfd);
+		return NULL;
+	}
+	
+	/**
+	 * @brief Stops all worker threads and the boss thread
+	 */
+	void shutdownServer()
+	{
+		//Listeners notice running is false on their next poll timeout
+		if(serverMode != REUSEPORT)
+		{
+			pthread_cancel(masterThread);
+			pthread_join(masterThread, NULL);
+		}
+		
+		running = false;
+		requestQueue->shutdown();
+		
+		for(int i = 0; i < listenerCount && listenerThreads; i++)
+		{
+			pthread_join(listenerThreads[i], NULL);
+			listenerQueues[i]->shutdown();
+		}
+		
+		for(int i = 0; i < workerThreadCount; i++)
+		{
+			//pthread_cancel(workerThreads[i]);
+			pthread_join(workerThreads[i], NULL);
+		}
+		
+		//Event loops notice running is false on their next epoll timeout
+		for(int i = 0; i < eventLoopCount; i++)
+		{
+			pthread_join(eventThreads[i], NULL);
+			close(epollfds[i]);
+		}
+		
+		if(fdPassfd >= 0)
+		{
+			pthread_join(fdPassThread, NULL);
+			fdPassfd = -1;
+		}
+		
+		if(registry)
+			pthread_join(heartbeatThread, NULL);
+		
+		for(int i = 0; i < submissionThreadCount; i++)
+			pthread_join(submissionThreads[i], NULL);
+		
+		printTransferStats();
+	}
+	
+	/**
+	 * @brief Prints how file bodies were sent and what sendfile saved over the buffered loop
+	 */
+	virtual void printTransferStats()
+	{
+		//The buffered loop makes a read and a write for every SENDSIZE chunk
+		long bufferedEquivalent = 2 * ((zeroCopyBytes + SENDSIZE - 1) / SENDSIZE);
+		
+		cout << "sendfile calls: " << sendfileCalls << "\t" << "zero-copy bytes: " << zeroCopyBytes << endl;
+		cout << "buffered calls: " << bufferedCalls << "\t" << "copied bytes: " << bufferedBytes << endl;
+		cout << "Syscalls saved: " << bufferedEquivalent - sendfileCalls << "\t" << "User-space copies saved: " << zeroCopyBytes << " bytes" << endl;
+		
+		if(passedFds > 0)
+			cout << "passed descriptors: " << passedFds << "\t" << "bytes sent by proxies: " << passedBytes << endl;
+		
+		if(submittedRequests > 0)
+			cout << "Shared memory submissions served: " << submittedRequests << endl;
+		
+		if(contentCache) contentCache->printStats();
+		if(shMemPool) shMemPool->printStats();
+	}
+
+	/**
+	 * @brief Starts the boss thread that will accept incoming
+	 *  connections and pass them to worker threads.
+	 * 
+	 * @note Uses the port defined in the constructor. REUSEPORT listeners
+	 * are already accepting, so there is no boss thread in that mode.
+	 */
+	void beginAcceptLoop()
+	{
+		if(serverMode == REUSEPORT) return;
+		
+		pthread_create(&masterThread, &attr, HTTP_Server::launchBossThread, this);
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function bossThread for a thread
+	 * 
+	 * @param obj The object that is creating the thread
+	 */
+	static void *launchBossThread(void* obj)
+	{
+		HTTP_Server* thisSrv = static_cast<HTTP_Server*>(obj);
+		thisSrv->bossThread(thisSrv);
+	}
+	
+	/**
+	 * @brief The boss thread that will loop while accepting client 
+	 * connections and handing them to worker threads
+	 * 
+	 * @note http://www.linuxhowtos.org/C_C++/socket.htm
+	 */
+	virtual void *bossThread(void* input)
+	{
+		HTTP_Server* thisSrv = (HTTP_Server*) input;
+		int sockfd = thisSrv->openListenSocket();
+		
+		//Loop and accept connections
+		while(thisSrv->running)
+		{
+			struct sockaddr_in client_addr;
+			//bzero(&&client_addr, sizeof(&client_addr));
+			socklen_t clientlen = sizeof(client_addr);
+			int newsockfd = accept(sockfd, (struct sockaddr *) &client_addr, &clientlen);
+			
+			//Should skip the interrupted accept
+			if(newsockfd <= 0) continue;
+			
+			thisSrv->acceptCounts[0]++;
+			
+			//Event loops own their connections, so there is no queue to hand off through
+			if(thisSrv->serverMode == EVENT_LOOP)
+			{
+				thisSrv->dispatchToEventLoop(newsockfd);
+				continue;
 			}
 			
-			//Loop while there aren't any requests
-			while(thisSrv->requestQueue.size() == 0)
+			//Add this connection to the request queue, which wakes a parked worker
+			if(!thisSrv->requestQueue->tryPush(newsockfd))
 			{
-				pthread_cond_wait( &thisSrv->acceptCondition, &thisSrv->acceptLock );
-				if(!thisSrv->running)
+				//cout << "Full!" << endl;
+				close(newsockfd);
+			}
+		}
+		
+		//pthread_exit(0);
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function listenerTask for a thread
+	 * 
+	 * @param obj A threadArgs naming the server and the listener to run
+	 */
+	static void *launchListenerTask(void* obj)
+	{
+		threadArgs* args = static_cast<threadArgs*>(obj);
+		HTTP_Server* thisSrv = args->srv;
+		int listenerId = args->index;
+		delete args;
+		
+		return thisSrv->listenerTask(listenerId);
+	}
+	
+	/**
+	 * @brief The method REUSEPORT listener threads run to accept connections for their own workers
+	 * 
+	 * @param listenerId The index of this listener's accept counter and queue
+	 */
+	virtual void *listenerTask(int listenerId)
+	{
+		int sockfd = openListenSocket(true);
+		
+		struct pollfd listenPoll;
+		listenPoll.fd = sockfd;
+		listenPoll.events = POLLIN;
+		
+		int batch[ACCEPTBATCH];
+		
+		while(running)
+		{
+			//Time out periodically so shutdownServer can stop the listener
+			if(poll(&listenPoll, 1, 500) <= 0) continue;
+			
+			//Take everything that is waiting, up to a batch, before handing any of it off
+			int accepted = 0;
+			while(accepted < ACCEPTBATCH)
+			{
+				int newsockfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+				if(newsockfd < 0) break;
+				
+				batch[accepted++] = newsockfd;
+			}
+			
+			__atomic_add_fetch(&acceptCounts[listenerId], accepted, __ATOMIC_RELAXED);
+			
+			//Workers serve the batch concurrently; a persistent connection only holds one of them
+			for(int i = 0; i < accepted; i++)
+			{
+				if(!listenerQueues[listenerId]->tryPush(batch[i]))
+					close(batch[i]);
+			}
+		}
+		
+		close(sockfd);
+		return NULL;
+	}
+	
+	/**
+	 * @brief Creates, binds and listens on the server's socket
+	 * 
+	 * @param reusePort Whether to share the port with other SO_REUSEPORT sockets, non-blocking
+	 * @return The listening socket
+	 */
+	int openListenSocket(bool reusePort = false)
+	{
+		int portIN = port;
+		struct sockaddr_in serv_addr;
+		
+		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		bossfd = sockfd;
+		if(sockfd < 0)
+		{
+			error("Unable to open socket");
+			printf("errno: %d (%d, %d, %d)\n", errno, EBADF, EINTR, EIO);
+		}
+		
+		if(reusePort)
+		{
+			int enable = 1;
+			if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+				error("Unable to set SO_REUSEPORT");
+			
+			fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+		}
+			
+		//Clear the structs
+		bzero(&serv_addr, sizeof(serv_addr));
+		
+		//sets server information
+		serv_addr.sin_family = AF_INET;
+		serv_addr.sin_port = htons(portIN);//Host to network
+		serv_addr.sin_addr.s_addr = INADDR_ANY;
+		
+		if(bind(sockfd, (const sockaddr*) &serv_addr, sizeof(serv_addr)) < 0)
+			error("Bind failed on port: " + portIN);
+			
+		listen(sockfd, listenBacklog);
+		
+		return sockfd;
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function listenerWorkerTask for a thread
+	 * 
+	 * @param obj A threadArgs naming the server and the listener whose queue to serve
+	 */
+	static void *launchListenerWorkerTask(void* obj)
+	{
+		threadArgs* args = static_cast<threadArgs*>(obj);
+		HTTP_Server* thisSrv = args->srv;
+		int listenerId = args->index;
+		delete args;
+		
+		return thisSrv->listenerWorkerTask(listenerId);
+	}
+	
+	/**
+	 * @brief The method REUSEPORT workers run to serve the connections their listener accepted
+	 * 
+	 * @param listenerId The index of the listener's queue
+	 */
+	virtual void *listenerWorkerTask(int listenerId)
+	{
+		int socketNum;
+		
+		//Park until the listener hands over a connection
+		while(listenerQueues[listenerId]->pop(socketNum))
+		{
+			serveConnection(socketNum);
+			close(socketNum);
+		}
+		
+		return NULL;
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function workerThreadTask for a thread
+	 * 
+	 * @param obj The object that is creating the thread
+	 */
+	static void *launchWorkerThreadTask(void* obj)
+	{
+		HTTP_Server* thisSrv = static_cast<HTTP_Server*>(obj);
+		thisSrv->workerThreadTask(thisSrv);
+	}
+	
+	/**
+	 * @brief The method worker tasks run that receive client information
+	 * from the boss thread
+	 */
+	virtual void *workerThreadTask(void* input)
+	{
+		HTTP_Server* thisSrv = (HTTP_Server*)input;
+		
+		while(thisSrv->running)
+		{
+			int socketNum;
+			
+			//Get the next client in the queue, parking while there aren't any requests
+			if(!thisSrv->requestQueue->pop(socketNum))
+				return NULL;
+			
+			thisSrv->serveConnection(socketNum);
+			
+			close(socketNum);
+		}
+	}
+	
+	/**
+	 * @brief Reads requests from a blocking connection and answers them until it should close
+	 * 
+	 * @param socketNum The client's socket, which the caller closes
+	 */
+	void serveConnection(int socketNum)
+	{
+		//Requests are parsed in place; bytes past the end of one belong to the next pipelined one
+		char buffer[REQUESTBUFSIZE];
+		int buffered = 0;
+		RequestParser parser;
+		
+		if(registry) registry->connectionOpened();
+		
+		//Idle persistent connections give up their worker after the timeout
+		if(keepAliveMax > 0)
+		{
+			struct timeval timeout;
+			timeout.tv_sec = keepAliveTimeout;
+			timeout.tv_usec = 0;
+			setsockopt(socketNum, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+		}
+		
+		int requestsServed = 0;
+		bool keepOpen = true;
+		bool clientGone = false;
+		
+		while(keepOpen && running)
+		{
+			int requestLength;
+			int bytesRead = 1;
+			
+			//Only the new bytes are scanned each time
+			while((requestLength = parser.parse(buffer, buffered)) == PARSE_INCOMPLETE)
+			{
+				if(buffered == REQUESTBUFSIZE)
 				{
-					pthread_mutex_unlock(&thisSrv->acceptLock);
-					return NULL;
+					requestLength = PARSE_ERROR;
+					break;
 				}
+				
+				bytesRead = read(socketNum, buffer + buffered, REQUESTBUFSIZE - buffered);
+				if(bytesRead <= 0) break;
+				
+				buffered += bytesRead;
+			}
+			
+			//Closed, errored or idle for too long
+			if(bytesRead <= 0)
+			{
+				clientGone = true;
+				break;
 			}
 			
-			//Get the next client in the queue
-			data = thisSrv->requestQueue.front();
-			thisSrv->requestQueue.pop();
+			if(requestLength == PARSE_ERROR)
+			{
+				sendBadRequest(socketNum);
+				break;
+			}
+			
+			string file, host;
+			int altPort;
+			extractRequest(parser, file, host, altPort);
+			
+			cout << "Method: " << parser.method << endl << "File: " << file << endl << "Host: " << host << endl << "Port: " << altPort << endl;
 			
-			pthread_mutex_unlock(&thisSrv->acceptLock);
-			#pragma endregion
+			DataMethod methodFlag = GET;
+			if(parser.method.equals("SHBUFF")) methodFlag = SHBUFF;
+			else if(parser.method.equals("FDPASS")) methodFlag = FDPASS;
+			
+			requestsServed++;
+			bool persist = methodFlag == GET && requestsServed < keepAliveMax && wantsKeepAlive(parser);
+			
+			keepOpen = parseHTTPRequest(file, socketNum, methodFlag, host, altPort, persist) && persist;
+			
+			//Move any pipelined bytes to the front for the next request
+			buffered -= requestLength;
+			memmove(buffer, buffer + requestLength, buffered);
+			parser.reset();
+		}
+		
+		//Closing with pipelined requests unread would reset the connection and lose the last response
+		if(keepAliveMax > 0 && running && !clientGone)
+			lingerClose(socketNum);
+		
+		if(registry) registry->connectionClosed();
+	}
+	
+	/**
+	 * @brief Stops sending on a connection and discards what the client still sends until it closes
+	 * 
+	 * @param socketNum The client's socket, which the caller closes
+	 * 
+	 * @note Closing a socket with unread bytes makes the kernel send a reset,
+	 * which can destroy responses the client hasn't read yet. A pipelining
+	 * client that passed the keep-alive limit gets its last response, sees
+	 * "Connection: close" and sends the rest again on a new connection.
+	 * The wait ends after LINGERMILLIS in total or LINGERMAXBYTES discarded,
+	 * so a client that keeps sending can't hold the worker.
+	 */
+	static void lingerClose(int socketNum)
+	{
+		char discard[REQUESTBUFSIZE];
+		
+		struct timespec now, deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += LINGERMILLIS / 1000;
+		deadline.tv_nsec += (LINGERMILLIS % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		
+		shutdown(socketNum, SHUT_WR);
+		
+		struct pollfd pfd;
+		pfd.fd = socketNum;
+		pfd.events = POLLIN;
+		
+		for(long discarded = 0; discarded < LINGERMAXBYTES; )
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long left = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if(left <= 0 || poll(&pfd, 1, left) <= 0) break;
+			
+			int bytesRead = read(socketNum, discard, sizeof(discard));
+			if(bytesRead <= 0) break;
+			
+			discarded += bytesRead;
+		}
+	}
+	
+	/**
+	 * @brief Decides if the client asked for its connection to stay open
+	 * 
+	 * @param parser The parsed request
+	 * @return True for HTTP/1.1 unless "Connection: close" was sent, or for
+	 * HTTP/1.0 with "Connection: keep-alive"
+	 */
+	static bool wantsKeepAlive(const RequestParser& parser)
+	{
+		slice connection = parser.findHeader("Connection");
+		
+		if(parser.version.equals("HTTP/1.1"))
+			return !connection.equalsIgnoreCase("close");
+		
+		return connection.equalsIgnoreCase("keep-alive");
+	}
+	
+	/**
+	 * @brief Answers a request that couldn't be parsed
+	 */
+	static void sendBadRequest(int socketNum)
+	{
+		string response = buildHeader("400 Bad Request", 11) + CLOSETAIL + "Bad Request";
+		send(socketNum, response.c_str(), response.length(), MSG_NOSIGNAL);
+	}
+	
+	/**
+	 * @brief Copies the fields the server uses out of a parsed request
+	 * 
+	 * @param parser The parsed request
+	 * @param file Set to the requested path with any host prefix removed
+	 * @param host Set to the contents of the Host field without the port
+	 * @param altPort Set to the port in the Host field, or 0
+	 */
+	static void extractRequest(const RequestParser& parser, string& file, string& host, int& altPort)
+	{
+		slice target = parser.target;
+		slice hostField = parser.findHeader("Host");
+		
+		host = "";
+		altPort = 0;
+		
+		if(hostField.data)
+		{
+			//Check for attached port
+			const char* colon = (const char*)memchr(hostField.data, ':', hostField.length);
+			const char* hostEnd = colon ? colon : hostField.data + hostField.length;
+			host.assign(hostField.data, hostEnd - hostField.data);
 			
-			string input = "";
+			for(const char* digit = hostEnd + 1; colon && digit < hostField.data + hostField.length && isdigit(*digit); digit++)
+				altPort = altPort * 10 + (*digit - '0');
 			
-			bool EOL_Found = false;
-			int bytesRead = 1;
-			while(!EOL_Found)
+			//Parse the host address out of the GET when the target is in absolute form
+			if(target.startsWith("http://", 7))
 			{
-				bytesRead = read(data->socketNum, &buffer, 255);
-				input += string(buffer, 0, bytesRead);
-				
-				//Carriage returns exists in the protocol
-				if(input.find("\r\n\r\n") != string::npos)
-					EOL_Found = true;
+				target.data += 7;
+				target.length -= 7;
 			}
 			
-			if(bytesRead < 0) continue;
-			
-			//cout << input << endl;
-			
-			int idx1 = input.find(' ');
-			int idx2 = input.find(' ', idx1 + 1);
-			
-			//TODO: Catch malformed requests
-			
-			string method = input.substr(0, idx1);
-			string file = input.substr(idx1 + 1, idx2 - idx1 - 1);
-			
-			bool hasHostField = false;
-			//Find the host
-			idx1 = input.find("Host: ");
-			if(idx1 > 0)
+			if(hostField.length > 0 && target.startsWith(hostField.data, hostField.length))
 			{
-				idx1 += 6;//Offset by the host string
-				hasHostField = true;
+				target.data += hostField.length;
+				target.length -= hostField.length;
 			}
-			else//Also search for without a space
+		}
+		
+		file.assign(target.data, target.length);
+	}
+	
+	/**
+	 * @brief A level of indirection to call the member function eventLoopTask for a thread
+	 * 
+	 * @param obj An threadArgs naming the server and the loop to run
+	 */
+	static void *launchEventLoopTask(void* obj)
+	{
+		threadArgs* args = static_cast<threadArgs*>(obj);
+		HTTP_Server* thisSrv = args->srv;
+		int loopId = args->index;
+		delete args;
+		
+		return thisSrv->eventLoopTask(loopId);
+	}
+	
+	/**
+	 * @brief Makes an accepted socket non-blocking and gives it to an event loop
+	 * 
+	 * @param socketNum The accepted client socket
+	 */
+	void dispatchToEventLoop(int socketNum)
+	{
+		int flags = fcntl(socketNum, F_GETFL, 0);
+		fcntl(socketNum, F_SETFL, flags | O_NONBLOCK);
+		
+		connectionData* conn = new connectionData();
+		conn->socketNum = socketNum;
+		conn->inputLength = 0;
+		conn->outputSent = 0;
+		conn->fileFd = -1;
+		conn->entry = NULL;
+		conn->fileOffset = 0;
+		conn->fileRemaining = 0;
+		conn->responding = false;
+		
+		if(registry) registry->connectionOpened();
+		
+		//Edge-triggered, so a loop must drain the socket each time it is woken
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = conn;
+		
+		int loopId = nextEventLoop++ % eventLoopCount;
+		if(epoll_ctl(epollfds[loopId], EPOLL_CTL_ADD, socketNum, &event) < 0)
+		{
+			error("Unable to add connection to event loop");
+			closeConnection(conn);
+		}
+	}
+	
+	/**
+	 * @brief The method event loop threads run to service their connections
+	 * 
+	 * @param loopId The index of this loop's epoll instance
+	 */
+	virtual void *eventLoopTask(int loopId)
+	{
+		int epfd = epollfds[loopId];
+		struct epoll_event events[MAXEVENTS];
+		
+		while(running)
+		{
+			//Time out periodically so shutdownServer can stop the loop
+			int ready = epoll_wait(epfd, events, MAXEVENTS, 500);
+			
+			for(int i = 0; i < ready; i++)
 			{
-				idx1 = input.find("Host:");
-				if(idx1 > 0)
+				connectionData* conn = (connectionData*)events[i].data.ptr;
+				bool finished = false;
+				
+				if(events[i].events & (EPOLLERR | EPOLLHUP))
+					finished = true;
+				else
 				{
-					idx1 += 5;//Offset by the host string
-					hasHostField = true;
+					if(!conn->responding)
+						finished = readRequest(conn);
+					
+					if(!finished && conn->responding)
+						finished = continueResponse(conn);
 				}
+				
+				if(finished) closeConnection(conn);
 			}
+		}
+		
+		return NULL;
+	}
+	
+	/**
+	 * @brief Drains a non-blocking socket and prepares the response once the request is complete
+	 * 
+	 * @param conn The connection that is readable
+	 * @return True if the connection is finished and should be closed
+	 */
+	bool readRequest(connectionData* conn)
+	{
+		while(conn->inputLength < REQUESTBUFSIZE)
+		{
+			int bytesRead = read(conn->socketNum, conn->input + conn->inputLength, REQUESTBUFSIZE - conn->inputLength);
 			
-			//Get the host string
-			string host = "";
-			string hostString = "";
-			int altPort = 0;
-			if(idx1 > 0)
+			if(bytesRead > 0)
 			{
-				idx2 = input.find("\r\n", idx1 + 1);
-				hostString = input.substr(idx1, idx2 - idx1);
-				host = hostString;
-				
-				//Check for attached port
-				int prtIdx = hostString.find(':');
-				if(prtIdx > 0)
-				{
-					altPort = atoi(hostString.substr(prtIdx + 1).c_str());
-					host = hostString.substr(0, prtIdx);
-				}
+				conn->inputLength += bytesRead;
+				continue;
 			}
 			
-			//Parse the host address out of the GET
-			if(hasHostField)
+			//Nothing left to read for now
+			if(bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			
+			//The client closed or errored before sending a whole request
+			return true;
+		}
+		
+		int requestLength = conn->parser.parse(conn->input, conn->inputLength);
+		
+		//A full buffer without a complete request is as bad as a malformed one
+		if(requestLength == PARSE_ERROR || (requestLength == PARSE_INCOMPLETE && conn->inputLength == REQUESTBUFSIZE))
+		{
+			sendBadRequest(conn->socketNum);
+			return true;
+		}
+		
+		if(requestLength == PARSE_INCOMPLETE)
+			return false;
+		
+		string file, host;
+		int altPort;
+		extractRequest(conn->parser, file, host, altPort);
+		
+		//The shared memory transfer blocks on the proxy, so service it synchronously
+		if(conn->parser.method.equals("SHBUFF"))
+		{
+			int flags = fcntl(conn->socketNum, F_GETFL, 0);
+			fcntl(conn->socketNum, F_SETFL, flags & ~O_NONBLOCK);
+			parseHTTPRequest(file, conn->socketNum, SHBUFF, host, altPort, false);
+			return true;
+		}
+		
+		//Passing a descriptor is a single small message, and the proxy sends the body
+		if(conn->parser.method.equals("FDPASS"))
+		{
+			int flags = fcntl(conn->socketNum, F_GETFL, 0);
+			fcntl(conn->socketNum, F_SETFL, flags & ~O_NONBLOCK);
+			parseHTTPRequest(file, conn->socketNum, FDPASS, host, altPort, false);
+			return true;
+		}
+		
+		conn->entry = openCachedResponse(file, conn->output, conn->fileFd, conn->fileRemaining, false);
+		conn->responding = true;
+		
+		return false;
+	}
+	
+	/**
+	 * @brief Writes as much of the response as the socket will take
+	 * 
+	 * @param conn The connection that is writable
+	 * @return True if the whole response has been sent or the client went away
+	 * 
+	 * @note Partial writes are resumed from the saved offsets on the next EPOLLOUT
+	 */
+	bool continueResponse(connectionData* conn)
+	{
+		//Cached responses go out in one gather write
+		if(conn->entry)
+		{
+			size_t total = conn->entry->header.length() + strlen(CLOSETAIL) + conn->entry->length;
+			while(conn->outputSent < total)
 			{
-				idx1 = file.find(hostString);
-				file = file.substr(idx1 + hostString.length());
+				int sent = sendCached(conn->socketNum, conn->entry, CLOSETAIL, conn->outputSent);
+				
+				if(sent < 0)
+					return !(errno == EAGAIN || errno == EWOULDBLOCK);
+				
+				conn->outputSent += sent;
 			}
 			
-			cout << "Method: " << method << endl << "File: " << file << endl << "Host: " << host << endl << "Port: " << altPort << endl;
+			return true;
+		}
+		
+		while(conn->outputSent < conn->output.length())
+		{
+			//Hold the header back so it leaves in the same segment as the file
+			int flags = conn->fileRemaining > 0 ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+			int sent = send(conn->socketNum, conn->output.c_str() + conn->outputSent,
+				conn->output.length() - conn->outputSent, flags);
+			
+			if(sent < 0)
+				return !(errno == EAGAIN || errno == EWOULDBLOCK);
 			
-			DataMethod methodFlag = GET;
-			if(method.compare("SHBUFF") == 0) methodFlag = SHBUFF;
+			conn->outputSent += sent;
+		}
+		
+		while(conn->fileRemaining > 0)
+		{
+			//sendfile advances fileOffset by whatever the socket took
+			int sent = sendFile(conn->socketNum, conn->fileFd, &conn->fileOffset, conn->fileRemaining);
 			
-			parseHTTPRequest(file, data->socketNum, methodFlag, host, altPort);
+			if(sent < 0)
+				return !(errno == EAGAIN || errno == EWOULDBLOCK);
+			if(sent == 0) return true;
 			
-			close(data->socketNum);
+			conn->fileRemaining -= sent;
+		}
+		
+		return true;
+	}
+	
+	/**
+	 * @brief Writes a cached header and body with a single gather write
+	 * 
+	 * @param socketNum The socket to send to
+	 * @param entry The cached response
+	 * @param tail The Connection line and blank line that finish the cached header
+	 * @param offset How much of the header, tail and body has already been sent
+	 * @return The bytes sent, or -1 with errno set
+	 * 
+	 * @note sendmsg is writev with flags, used so a closed client can't raise SIGPIPE
+	 */
+	static int sendCached(int socketNum, cacheEntry* entry, const char* tail, size_t offset)
+	{
+		struct iovec parts[3];
+		parts[0].iov_base = (char*)entry->header.data();
+		parts[0].iov_len = entry->header.length();
+		parts[1].iov_base = (char*)tail;
+		parts[1].iov_len = strlen(tail);
+		parts[2].iov_base = entry->body;
+		parts[2].iov_len = entry->length;
+		
+		//Skip whatever was sent by earlier calls
+		struct iovec iov[3];
+		int count = 0;
+		for(int i = 0; i < 3; i++)
+		{
+			if(offset >= parts[i].iov_len)
+			{
+				offset -= parts[i].iov_len;
+				continue;
+			}
 			
-			delete data;
+			iov[count].iov_base = (char*)parts[i].iov_base + offset;
+			iov[count].iov_len = parts[i].iov_len - offset;
+			count++;
+			offset = 0;
+		}
+		
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		
+		return sendmsg(socketNum, &msg, MSG_NOSIGNAL);
+	}
+	
+	/**
+	 * @brief Sends part of a file from the page cache to a socket without copying it through user space
+	 * 
+	 * @param socketNum The socket to send to
+	 * @param fileFd The file to send from
+	 * @param offset The file offset to send from, advanced by the bytes sent
+	 * @param length The bytes left to send
+	 * @return The bytes sent, or -1 with errno set
+	 */
+	int sendFile(int socketNum, int fileFd, off_t* offset, off_t length)
+	{
+		int sent = sendfile(socketNum, fileFd, offset, min(length, (off_t)SENDFILESIZE));
+		
+		if(sent > 0)
+		{
+			__sync_fetch_and_add(&sendfileCalls, 1);
+			__sync_fetch_and_add(&zeroCopyBytes, sent);
 		}
+		
+		return sent;
+	}
+	
+	/**
+	 * @brief Closes a connection owned by an event loop and frees its state
+	 * 
+	 * @note Closing the socket also removes it from its epoll instance
+	 */
+	void closeConnection(connectionData* conn)
+	{
+		if(conn->fileFd >= 0) close(conn->fileFd);
+		if(conn->entry) contentCache->release(conn->entry);
+		close(conn->socketNum);
+		
+		if(registry) registry->connectionClosed();
+		
+		delete conn;
 	}
 	
 	/**
@@ -637,40 +1639,174 @@ class HTTP_Server
 	{
 		//Use the shared memory buffer
 		if(method == SHBUFF)
-		{		
-			//cout << "Before" << endl;	
-			pthread_mutex_lock((pthread_mutex_t*)(shMem[retnId] + 1));
+		{
+			//Packed into the open slot; the proxy sees it once the slot fills or the response ends
+			shMemPool->segment(retnId)->append(data, len);
+			
+			return 0;
+		}
+		//Use sockets
+		else
+		{
+			return write(retnId, data, len);
+		}
+	}
+	
+	/**
+	 * @brief Opens a file and passes the descriptor to a local proxy along with the response header
+	 * 
+	 * @param fileName The name of the file relative to the document root
+	 * @param socketNum The proxy's Unix socket
+	 * @return False, the proxy's connection is closed after one file
+	 */
+	bool passFile(string fileName, int socketNum)
+	{
+		string header;
+		off_t length = 0;
+		int fileFd = openResponse(fileName, header, length, false);
+		
+		fdPassReply reply;
+		reply.offset = 0;
+		reply.length = length;
+		reply.headerLength = header.length();
+		
+		struct iovec parts[2];
+		parts[0].iov_base = &reply;
+		parts[0].iov_len = sizeof(reply);
+		parts[1].iov_base = (void*)header.data();
+		parts[1].iov_len = header.length();
+		
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = parts;
+		msg.msg_iovlen = 2;
+		
+		//Attach the open file, if there is one
+		char control[CMSG_SPACE(sizeof(int))];
+		if(fileFd >= 0)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
 			
-			char* cond = (char*)(shMem[retnId] + 1) + sizeof(pthread_mutex_t);
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fileFd, sizeof(int));
+		}
+		
+		int sent = sendmsg(socketNum, &msg, MSG_NOSIGNAL);
+		
+		if(fileFd >= 0)
+		{
+			//The proxy holds its own reference now
+			close(fileFd);
 			
-			while(*(shMem[retnId]) == MODIFIED)
+			if(sent > 0)
 			{
-				//cout << "waiting" << endl;
-				pthread_cond_wait((pthread_cond_t*) cond, (pthread_mutex_t*)(shMem[retnId] + 1));
+				__sync_fetch_and_add(&passedFds, 1);
+				__sync_fetch_and_add(&passedBytes, length);
 			}
+		}
+		
+		return false;
+	}
+	
+	/**
+	 * @brief Opens a requested file and builds the header that goes in front of it
+	 * 
+	 * @param fileName The name of the file relative to the document root
+	 * @param header Set to the response header, or to the whole response if there is no file
+	 * @param length Set to the number of bytes in the file
+	 * @param keepAlive Whether the header tells the client the connection stays open
+	 * @return The open file, or -1 if the response is only the header
+	 */
+	int openResponse(string fileName, string& header, off_t& length, bool keepAlive)
+	{
+		const char* tail = keepAlive ? KEEPALIVETAIL : CLOSETAIL;
+		
+		//Prepend the document root
+		fileName = rootDir + fileName;
+		length = 0;
+		
+		//Make sure they stay within the WWW directory
+		if(fileName.find("..") != string::npos || fileName.find("~") != string::npos)
+		{
+			header = buildHeader("403 Forbidden", 13) + tail + "403 Forbidden";
+			return -1;
+		}
+		
+		int fileFd = open(fileName.c_str(), O_RDONLY);
+		struct stat fileStat;
+		
+		//Make sure the file opened
+		if(fileFd < 0 || fstat(fileFd, &fileStat) < 0 || !S_ISREG(fileStat.st_mode))
+		{
+			if(fileFd >= 0) close(fileFd);
 			
-			char* mutexEnd = (char*)(shMem[retnId] + 1) + sizeof(pthread_mutex_t) + sizeof(pthread_cond_t);
-			char* dataStart = mutexEnd + sizeof(int);
-			
-			bcopy(data, dataStart, len);
-			bcopy(&len, mutexEnd, sizeof(int));
-			
-			*(shMem[retnId]) = MODIFIED;
-			
-			//cout << "data!" << endl;
-			
-			pthread_cond_signal((pthread_cond_t*)cond);
-			pthread_mutex_unlock((pthread_mutex_t*)(shMem[retnId] + 1));
-			
-			//cout << "after" << endl;
+			header = buildHeader("404 Not Found", 14) + tail + "Page not found";
 			
-			return 0;
+			//I need to make sure this doesn't happen in benchmarking
+			cout << "404! " << fileName << endl;
+			return -1;
 		}
-		//Use sockets
-		else
+		
+		length = fileStat.st_size;
+		header = buildHeader("200 OK", length) + tail;
+		return fileFd;
+	}
+	
+	/**
+	 * @brief Finds a response in the content cache, opening and caching the file on a miss
+	 * 
+	 * @param fileName The name of the file relative to the document root
+	 * @param header Set as in openResponse when the response is not cached
+	 * @param fileFd Set as in openResponse's return value when the response is not cached
+	 * @param length Set as in openResponse when the response is not cached
+	 * @param keepAlive Passed to openResponse when the response is not cached
+	 * @return The cached response, which must be released, or NULL
+	 * 
+	 * @note Cached headers stop before the Connection line, which is added when sending
+	 */
+	cacheEntry* openCachedResponse(const string& fileName, string& header, int& fileFd, off_t& length, bool keepAlive)
+	{
+		if(contentCache)
 		{
-			return write(retnId, data, len);
+			cacheEntry* entry = contentCache->acquire(fileName);
+			if(entry) return entry;
+		}
+		
+		fileFd = openResponse(fileName, header, length, keepAlive);
+		
+		//Errors and files too large for the cache are left to the caller
+		if(contentCache && fileFd >= 0)
+		{
+			cacheEntry* entry = contentCache->insert(fileName, buildHeader("200 OK", length), fileFd, length);
+			if(entry)
+			{
+				close(fileFd);
+				fileFd = -1;
+				return entry;
+			}
 		}
+		
+		return NULL;
+	}
+	
+	/**
+	 * @brief Builds the start of a response header that frames the body with Content-Length
+	 * 
+	 * @param status The status code and reason phrase
+	 * @param length The number of bytes in the body
+	 * 
+	 * @note The header is finished by CLOSETAIL or KEEPALIVETAIL
+	 */
+	static string buildHeader(const char* status, off_t length)
+	{
+		char header[128];
+		snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: %ld\r\n", status, (long)length);
+		
+		return header;
 	}
 	
 	/**
@@ -681,27 +1817,32 @@ class HTTP_Server
 	 * @param method The method that will be used to send the data back
 	 * @param host The contents of the HTTP header's Host field
 	 * @param altPort The port to use in the event of a remote server
-	 * 
+	 * @param keepAlive Whether the connection will be used for another request
+	 * @return True if the whole response was sent and framed, so the connection can be reused
 	 */
-	virtual void parseHTTPRequest(string fileName, int socketNum, DataMethod method, string host, int altPort)
+	virtual bool parseHTTPRequest(string fileName, int socketNum, DataMethod method, string host, int altPort, bool keepAlive)
 	{
-		//Prepend the document root
-		fileName = rootDir + fileName;
-		
-		string retn, tmpLine;
-		string header, timeStr, body;
-		ifstream inFile(fileName.c_str());
+		bool complete = true;
+		const char* tail = keepAlive ? KEEPALIVETAIL : CLOSETAIL;
 		
-		//Get the time
-		time_t rawtime;
-		struct tm* timeInfo;
-		
-		time(&rawtime);
-		timeInfo = gmtime(&rawtime);
-		timeStr = asctime(timeInfo);
+		//The proxy sends the body itself from the passed descriptor
+		if(method == FDPASS)
+		{
+			int domain = 0;
+			socklen_t domainLength = sizeof(domain);
+			
+			if(getsockopt(socketNum, SOL_SOCKET, SO_DOMAIN, &domain, &domainLength) == 0 && domain == AF_UNIX)
+				return passFile(fileName, socketNum);
+			
+			//Descriptors can't cross a TCP connection
+			method = GET;
+		}
 		
+		//A submitted request names the segment the proxy claimed, and the proxy hands it back
+		bool submitted = method == SHQUEUE;
+		if(submitted) method = SHBUFF;
 		//send the client the shared memory ID
-		if(method == SHBUFF)
+		else if(method == SHBUFF)
 		{
 			int shMemID = acquireSharedMem();
 			write(socketNum, &shMemID, sizeof(int));
@@ -709,58 +1850,96 @@ class HTTP_Server
 			socketNum = shMemID;
 		}
 		
-		//Make sure they stay within the WWW directory
-		if(fileName.find("..") != string::npos || fileName.find("~") != string::npos)
+		string header;
+		off_t length = 0;
+		int fileFd = -1;
+		cacheEntry* entry = openCachedResponse(fileName, header, fileFd, length, keepAlive);
+		
+		if(entry)
 		{
-			header = "HTTP/1.0 403 Forbidden";
-			body = "403 Forbidden";
+			size_t total = entry->header.length() + strlen(tail) + entry->length;
+			
+			//Header and body leave together, usually in a single call
+			if(method == GET)
+			{
+				size_t offset = 0;
+				while(offset < total)
+				{
+					int sent = sendCached(socketNum, entry, tail, offset);
+					if(sent <= 0) break;
+					
+					offset += sent;
+				}
+				
+				complete = offset == total;
+			}
+			else
+			{
+				string cachedHeader = entry->header + tail;
+				sendData(socketNum, cachedHeader.c_str(), cachedHeader.length(), method);
+				sendData(socketNum, entry->body, entry->length, method);
+			}
 			
-			string combined = header + "\n\n" + body;
-			sendData(socketNum, combined.c_str(), strlen(combined.c_str()), method);
+			contentCache->release(entry);
 		}
-		//Make sure the file opened
-		else if(inFile.is_open())
+		//Sockets get the file straight from the page cache
+		else if(method == GET && fileFd >= 0)
 		{
-			header = "HTTP/1.0 200 OK\n\n";
-			
-			//Write the header first
-			sendData(socketNum, header.c_str(), strlen(header.c_str()), method);
+			//Hold the header back so it leaves in the same segment as the file
+			send(socketNum, header.c_str(), header.length(), MSG_NOSIGNAL | MSG_MORE);
 			
-			char strBuf[SENDSIZE];
-			inFile.seekg(0, ios::end);
-			int length = inFile.tellg();
-			inFile.seekg(0, ios::beg);
+			off_t offset = 0;
 			while(length > 0)
 			{
-				inFile.read(strBuf, min(SENDSIZE, length));
-				int err = sendData(socketNum, strBuf, min(SENDSIZE, length), method);
-				length -= SENDSIZE;
+				int sent = sendFile(socketNum, fileFd, &offset, length);
+				if(sent <= 0) break;
+				
+				length -= sent;
 			}
-			inFile.close();
+			close(fileFd);
+			
+			complete = length == 0;
 		}
+		//Shared memory needs the bytes in user space, so fall back to the buffered loop
 		else
 		{
-			header = "HTTP/1.0 404 Not Found";
-			body = "Page not found";
-			
-			string combined = header + "\n\n" + body;
-			sendData(socketNum, combined.c_str(), strlen(combined.c_str()), method);
+			//Write the header first
+			if(sendData(socketNum, header.c_str(), header.length(), method) < 0)
+				complete = false;
 			
-			//I need to make sure this doesn't happen in benchmarking
-			cout << "404! " << fileName << endl;
+			//Read straight into the ring's slots so the file is only copied once
+			if(fileFd >= 0 && method == SHBUFF)
+			{
+				while(length > 0)
+				{
+					int space;
+					char* slot = shMemPool->segment(socketNum)->reserve(space);
+					
+					int chunk = read(fileFd, slot, min((off_t)space, length));
+					if(chunk <= 0) break;
+					
+					shMemPool->segment(socketNum)->commit(chunk);
+					length -= chunk;
+					
+					__sync_fetch_and_add(&bufferedCalls, 1);
+					__sync_fetch_and_add(&bufferedBytes, chunk);
+				}
+				close(fileFd);
+			}
 		}
 		
 		//Release the shared memory
-		if(method == SHBUFF)
+		if(method == SHBUFF && submitted)
+			shMemPool->segment(socketNum)->end();
+		else if(method == SHBUFF)
 		{
-			sendData(socketNum, NULL, 0, method);
-			while(*(shMem[socketNum]) != READ);//Spin while the client reads the final segment
-			
-			//Acquire the lock to ensure that the client is done
-			pthread_mutex_lock((pthread_mutex_t*)(shMem[socketNum] + 1));
-			pthread_mutex_unlock((pthread_mutex_t*)(shMem[socketNum] + 1));
+			//Blocks until the client has drained the ring
+			shMemPool->segment(socketNum)->finish();
 			releaseSharedMem(socketNum);
 		}
+		
+		//Shared memory transfers end with the connection
+		return complete && method == GET;
 	}
 };
 }
@@ -769,6 +1948,7 @@ HTTP_Server* HTTP_Server::srvInstance;
 
 void signal_callback_handler(int signum)
 {
+	HTTP_Server::srvInstance->printTransferStats();
 	HTTP_Server::srvInstance->cleanupSharedMem();
 	exit(0);
 }
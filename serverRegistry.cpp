@@ -0,0 +1,405 @@
+#ifndef SERVER_REGISTRY
+#define SERVER_REGISTRY
+
+/**
+ * @file serverRegistry.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the ServerRegistry class, the shared memory table servers publish their load in and proxies balance across
+ */
+
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REGISTRYNAME "/httpRegistry" //The POSIX shm object holding the registry
+#define REGISTRYMAGIC 0x52454749 //Marks an initialized registry
+#define REGISTRYVERSION 2 //Bumped whenever the layout of registryEntry changes
+#define MAXSERVERS 50 //The most servers and proxies registered at once
+#define REGISTRYBEATMS 100 //How often a registered process refreshes its heartbeat and queue depth
+#define REGISTRYSTALEMS 1000 //Servers whose heartbeat is older than this aren't balanced to
+
+using namespace std;
+
+/**
+ * @brief One registered process, on its own cache line
+ *
+ * @note Fields are written by their owner and read by proxies with relaxed
+ * atomics; a reader only needs a recent value of each, not a consistent set.
+ * port is 0 while the entry is free and -1 while it is being claimed.
+ */
+struct alignas(64) registryEntry
+{
+	int port;
+
+	///Bumped whenever the entry is claimed or freed, so readers can tell a reused entry apart
+	unsigned int generation;
+
+	int pid;
+
+	///Nonzero for servers that serve files; proxies register too but aren't balanced to
+	int origin;
+
+	///The threads serving requests
+	int workers;
+
+	///Connections accepted but not yet taken by a worker
+	int queueDepth;
+
+	///Connections being served
+	int activeConnections;
+
+	///CLOCK_MONOTONIC milliseconds at the last heartbeat
+	long heartbeat;
+};
+
+static_assert(sizeof(registryEntry) == 64, "registryEntry must fill exactly one cache line");
+
+/**
+ * @brief The start of the registry, followed by MAXSERVERS entries
+ */
+struct registryHeader
+{
+	unsigned int magic;
+	int version;
+
+	///The processes attached
+	int processes;
+
+	char pad[64 - 3 * sizeof(int)];
+};
+
+static_assert(sizeof(registryHeader) == 64, "registryHeader must fill exactly one cache line");
+
+namespace{
+/**
+ * @brief A versioned table of the servers on this machine and their current load
+ *
+ * @note Every HTTP_Server claims an entry when it registers and keeps its
+ * heartbeat, queue depth and connection count up to date. A proxy reads the
+ * table to tell whether an origin is a local server and to pick the least
+ * loaded of the live servers for each request, so starting another
+ * http_server adds capacity without reconfiguring the proxy.
+ */
+class ServerRegistry
+{
+	private:
+
+	registryHeader* header;
+
+	///The entries, right after the header
+	registryEntry* entries;
+
+	///This process's entry, or NULL before register
+	registryEntry* self;
+
+	///Varies the candidates each balancing call samples
+	unsigned int ticket;
+
+	///Whether this process is counted in header->processes
+	bool attached;
+
+	static long nowMillis()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	}
+
+	static size_t mappedSize()
+	{
+		return sizeof(registryHeader) + MAXSERVERS * sizeof(registryEntry);
+	}
+
+	/**
+	 * @brief Checks whether an entry belongs to a server that is up and reporting
+	 */
+	static bool isLive(registryEntry& entry, long now)
+	{
+		return __atomic_load_n(&entry.port, __ATOMIC_ACQUIRE) > 0 && now - __atomic_load_n(&entry.heartbeat, __ATOMIC_RELAXED) < REGISTRYSTALEMS;
+	}
+
+	/**
+	 * @brief Compares the load on two servers, scaled by their worker counts
+	 *
+	 * @return True if a is less loaded than b
+	 */
+	static bool lessLoaded(registryEntry& a, registryEntry& b)
+	{
+		long loadA = __atomic_load_n(&a.queueDepth, __ATOMIC_RELAXED) + __atomic_load_n(&a.activeConnections, __ATOMIC_RELAXED);
+		long loadB = __atomic_load_n(&b.queueDepth, __ATOMIC_RELAXED) + __atomic_load_n(&b.activeConnections, __ATOMIC_RELAXED);
+		long workersA = max(__atomic_load_n(&a.workers, __ATOMIC_RELAXED), 1);
+		long workersB = max(__atomic_load_n(&b.workers, __ATOMIC_RELAXED), 1);
+
+		return loadA * workersB < loadB * workersA;
+	}
+
+	public:
+
+	///How a proxy picks among the live servers
+	typedef enum {FIXED, POWER_OF_TWO, LEAST_LOADED} BalanceMode;
+
+	/**
+	 * @brief Attaches to the machine's registry, creating it if this is the first process
+	 */
+	ServerRegistry()
+	{
+		header = NULL;
+		entries = NULL;
+		self = NULL;
+		ticket = getpid();
+		attached = false;
+
+		bool first = true;
+		int fd = shm_open(REGISTRYNAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if(fd < 0)
+		{
+			first = false;
+			fd = shm_open(REGISTRYNAME, O_RDWR, 0666);
+		}
+		else if(fchmod(fd, 0666) < 0 || ftruncate(fd, mappedSize()) < 0)
+			cout << "Error sizing the server registry" << endl;
+
+		void* mem = fd >= 0 ? mmap(NULL, mappedSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if(fd >= 0) close(fd);
+
+		if(mem == MAP_FAILED)
+		{
+			cout << "Error attaching to the server registry" << endl;
+			return;
+		}
+
+		header = (registryHeader*)mem;
+		entries = (registryEntry*)(header + 1);
+
+		if(first)
+		{
+			header->version = REGISTRYVERSION;
+			__atomic_store_n(&header->magic, REGISTRYMAGIC, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			//The creator may still be writing the header
+			for(int i = 0; i < 1000 && __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != REGISTRYMAGIC; i++)
+				usleep(1000);
+
+			if(header->magic != REGISTRYMAGIC || header->version != REGISTRYVERSION)
+			{
+				cout << "The server registry has a different layout (version " << header->version << "), remove /dev/shm" << REGISTRYNAME << " once no servers are running" << endl;
+				munmap(mem, mappedSize());
+				header = NULL;
+				entries = NULL;
+				return;
+			}
+		}
+
+		__sync_fetch_and_add(&header->processes, 1);
+		attached = true;
+	}
+
+	~ServerRegistry()
+	{
+		detach();
+
+		if(header) munmap(header, mappedSize());
+	}
+
+	/**
+	 * @brief Frees this process's entry, and removes the registry if this is the last process
+	 *
+	 * @note The table stays mapped, so threads still reporting load are harmless
+	 */
+	void detach()
+	{
+		if(!header || !attached) return;
+
+		unregisterSelf();
+		attached = false;
+
+		if(__sync_sub_and_fetch(&header->processes, 1) == 0)
+			shm_unlink(REGISTRYNAME);
+	}
+
+	/**
+	 * @brief Claims an entry for this process
+	 *
+	 * @param port The port the process serves on
+	 * @param workers The threads serving requests
+	 * @param origin Whether the process serves files itself, so proxies may balance to it
+	 *
+	 * @note An entry left behind by a process that died without unregistering is reclaimed
+	 */
+	void registerSelf(int port, int workers, bool origin)
+	{
+		if(!attached || self) return;
+
+		for(int i = 0; i < MAXSERVERS && !self; i++)
+		{
+			registryEntry& entry = entries[i];
+			int current = __atomic_load_n(&entry.port, __ATOMIC_ACQUIRE);
+
+			if(current > 0 && kill(entry.pid, 0) < 0 && errno == ESRCH)
+				__sync_bool_compare_and_swap(&entry.port, current, 0);
+
+			if(!__sync_bool_compare_and_swap(&entry.port, 0, -1))
+				continue;
+
+			entry.pid = getpid();
+			entry.origin = origin;
+			__atomic_store_n(&entry.workers, workers, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry.queueDepth, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry.activeConnections, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry.heartbeat, nowMillis(), __ATOMIC_RELAXED);
+			__atomic_add_fetch(&entry.generation, 1, __ATOMIC_RELAXED);
+
+			//Publishing the port makes the entry visible
+			__atomic_store_n(&entry.port, port, __ATOMIC_RELEASE);
+			self = &entry;
+		}
+
+		if(!self)
+			cout << "The server registry is full" << endl;
+	}
+
+	/**
+	 * @brief Frees this process's entry
+	 */
+	void unregisterSelf()
+	{
+		if(!self) return;
+
+		__atomic_add_fetch(&self->generation, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&self->port, 0, __ATOMIC_RELEASE);
+		self = NULL;
+	}
+
+	/**
+	 * @brief Refreshes this process's heartbeat and queue depth
+	 */
+	void beat(int queueDepth)
+	{
+		if(!self) return;
+
+		__atomic_store_n(&self->queueDepth, queueDepth, __ATOMIC_RELAXED);
+		__atomic_store_n(&self->heartbeat, nowMillis(), __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * @brief Counts a connection this process started serving
+	 */
+	void connectionOpened()
+	{
+		if(self) __atomic_add_fetch(&self->activeConnections, 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * @brief Counts a connection this process finished serving
+	 */
+	void connectionClosed()
+	{
+		if(self) __atomic_sub_fetch(&self->activeConnections, 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * @brief Checks whether a port belongs to a live server on this machine
+	 */
+	bool isRegistered(int port)
+	{
+		long now = nowMillis();
+
+		for(int i = 0; entries && i < MAXSERVERS; i++)
+			if(entries[i].origin && isLive(entries[i], now) && __atomic_load_n(&entries[i].port, __ATOMIC_RELAXED) == port)
+				return true;
+
+		return false;
+	}
+
+	/**
+	 * @brief Finds the process serving on a port
+	 *
+	 * @return The pid of the live server on the port, or 0
+	 */
+	int serverPid(int port)
+	{
+		long now = nowMillis();
+
+		for(int i = 0; entries && i < MAXSERVERS; i++)
+			if(entries[i].origin && isLive(entries[i], now) && __atomic_load_n(&entries[i].port, __ATOMIC_RELAXED) == port)
+				return entries[i].pid;
+
+		return 0;
+	}
+
+	/**
+	 * @brief Picks the server a request for a local origin goes to
+	 *
+	 * @param requested The port the request named, used if no server is live
+	 * @param mode Power of two choices samples two live servers and takes the
+	 * less loaded; least loaded scans them all
+	 * @param avoid A port not to pick, such as one a request is already waiting on
+	 * @return The port to use, or 0 if avoid was the only live server
+	 */
+	int pickServer(int requested, BalanceMode mode, int avoid = 0)
+	{
+		if(!entries || mode == FIXED) return avoid ? 0 : requested;
+
+		long now = nowMillis();
+		int live[MAXSERVERS];
+		int liveCount = 0;
+
+		for(int i = 0; i < MAXSERVERS; i++)
+			if(entries[i].origin && isLive(entries[i], now) && __atomic_load_n(&entries[i].port, __ATOMIC_RELAXED) != avoid)
+				live[liveCount++] = i;
+
+		if(liveCount == 0) return avoid ? 0 : requested;
+		if(liveCount == 1)
+		{
+			int port = __atomic_load_n(&entries[live[0]].port, __ATOMIC_RELAXED);
+			return port > 0 ? port : (avoid ? 0 : requested);
+		}
+
+		registryEntry* best;
+		if(mode == POWER_OF_TWO)
+		{
+			//A multiplicative hash of a shared counter spreads the samples without a lock
+			unsigned int draw = __sync_fetch_and_add(&ticket, 1) * 2654435761u;
+			int first = (draw >> 16) % liveCount;
+			int second = (first + 1 + (draw & 0xffff) % (liveCount - 1)) % liveCount;
+
+			best = &entries[live[first]];
+			if(lessLoaded(entries[live[second]], *best))
+				best = &entries[live[second]];
+		}
+		else
+		{
+			best = &entries[live[0]];
+			for(int i = 1; i < liveCount; i++)
+				if(lessLoaded(entries[live[i]], *best))
+					best = &entries[live[i]];
+		}
+
+		int port = __atomic_load_n(&best->port, __ATOMIC_RELAXED);
+		return port > 0 ? port : (avoid ? 0 : requested);
+	}
+
+	/**
+	 * @brief Prints every live registered server and its load
+	 */
+	void printStats()
+	{
+		long now = nowMillis();
+
+		for(int i = 0; entries && i < MAXSERVERS; i++)
+			if(isLive(entries[i], now))
+				cout << "Registered " << (entries[i].origin ? "server" : "proxy") << " on port " << entries[i].port << "\t" << "workers: " << entries[i].workers << "\t" << "queued: " << entries[i].queueDepth << "\t" << "active: " << entries[i].activeConnections << endl;
+	}
+};
+}
+#endif
@@ -3,9 +3,67 @@
 int main(int argc, char* argv[])
 {
 	HTTP_Server srv(atoi(argv[1]), atoi(argv[2]));
-	srv.setupThreadPool(atoi(argv[3]));
+	
+	bool useEventLoops = false;
+	bool useReusePort = false;
+	int listenerWorkers = LISTENERWORKERS;
+	int keepAliveMax = 0;
+	int idleTimeout = 5;
+	int shmSegments = 0;
+	size_t shmSize = 0;
+	bool hugePages = false;
+	
+	//Optional settings follow the required arguments
+	for(int i = 4; i < argc; i++)
+	{
+		//"epoll" services connections from event loops instead of the worker pool
+		if(strcmp(argv[i], "epoll") == 0)
+			useEventLoops = true;
+		//"reuseport" gives each worker its own listening socket instead of a boss thread
+		else if(strcmp(argv[i], "reuseport") == 0)
+			useReusePort = true;
+		//"listenworkers=<N>" sets the threads serving each reuseport listener's connections
+		else if(strncmp(argv[i], "listenworkers=", 14) == 0)
+			listenerWorkers = atoi(argv[i] + 14);
+		//"backlog=<N>" sets the listen backlog
+		else if(strncmp(argv[i], "backlog=", 8) == 0)
+			srv.setListenBacklog(atoi(argv[i] + 8));
+		//"cache=<MB>" keeps up to that many megabytes of files in memory
+		else if(strncmp(argv[i], "cache=", 6) == 0)
+			srv.setupContentCache((size_t)atoi(argv[i] + 6) * 1024 * 1024);
+		//"keepalive=<N>" serves up to N requests per connection
+		else if(strncmp(argv[i], "keepalive=", 10) == 0)
+			keepAliveMax = atoi(argv[i] + 10);
+		//"idle=<seconds>" closes persistent connections left idle that long
+		else if(strncmp(argv[i], "idle=", 5) == 0)
+			idleTimeout = atoi(argv[i] + 5);
+		//"shm=<N>" lets the shared memory pool grow to N segments
+		else if(strncmp(argv[i], "shm=", 4) == 0)
+			shmSegments = atoi(argv[i] + 4);
+		//"shmsize=<KB>" sets the size of each shared memory segment
+		else if(strncmp(argv[i], "shmsize=", 8) == 0)
+			shmSize = (size_t)atoi(argv[i] + 8) * 1024;
+		//"hugepages" backs shared memory segments with huge pages
+		else if(strcmp(argv[i], "hugepages") == 0)
+			hugePages = true;
+	}
+	
+	if(keepAliveMax > 0)
+		srv.setupKeepAlive(keepAliveMax, idleTimeout);
+	
+	srv.setupSharedMemPool(shmSegments, shmSize, hugePages);
+	
+	if(useEventLoops)
+		srv.setupEventLoops(atoi(argv[3]));
+	else if(useReusePort)
+		srv.setupReusePortListeners(atoi(argv[3]), listenerWorkers);
+	else
+		srv.setupThreadPool(atoi(argv[3]));
 	srv.beginAcceptLoop();
 
 	while(1)
+	{
 		sleep(10);
+		srv.printAcceptRates(10);
+	}
 }
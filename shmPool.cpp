@@ -0,0 +1,385 @@
+#ifndef SHM_POOL
+#define SHM_POOL
+
+/**
+ * @file shmPool.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the SharedMemPool class that hands out SharedRing segments for SHBUFF transfers
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmRing.cpp"
+
+#define SHMAXSEGMENTS 256 //The most segments any pool may grow to
+#define SHPOOLNAME "/httpShm.pool" //The POSIX shm object every process in the pool shares
+#define SHSEGMENTNAME "/httpShm.%d" //The POSIX shm object holding one ring
+#define HUGEPAGEDIR "/dev/hugepages" //Where a mounted hugetlbfs is expected
+#define HUGEPAGESIZE 2097152 //Segments on hugetlbfs are rounded up to this
+#define SHWAITNSEC 1000000 //How long an acquire waits before checking the other processes' segments again
+
+using namespace std;
+
+/**
+ * @brief The bookkeeping shared by every process using the pool
+ */
+struct poolControl
+{
+	///The number of processes attached
+	int processes;
+
+	///Nonzero if segments live on hugetlbfs, set by the first process
+	int hugePages;
+
+	///Set last by the first process, once the fields above may be read
+	int initialized;
+};
+
+namespace{
+/**
+ * @brief A pool of shared memory rings that grows on demand up to a cap
+ *
+ * @note Segments are POSIX shm objects (or files on hugetlbfs) named by
+ * their index, so a proxy can map the segment a server names without any
+ * other handshake. Every server on the machine shares the same segments and
+ * claims one by swapping its state from FREE to LOCKED. A new segment is only
+ * created when every existing one is busy. The last process to leave unlinks
+ * them all.
+ */
+class SharedMemPool
+{
+	private:
+
+	///The rings this process has mapped, indexed by segment number
+	SharedRing* segments[SHMAXSEGMENTS];
+
+	///The mapped size of each segment
+	size_t mappedSizes[SHMAXSEGMENTS];
+
+	///The shared bookkeeping
+	poolControl* control;
+
+	///The most segments this process will create or use for its own transfers
+	int maxSegments;
+
+	///The size of segments this process creates
+	size_t segmentSize;
+
+	///Protects the mapping of new segments
+	pthread_mutex_t lock;
+
+	///Signalled when this process releases a segment
+	pthread_cond_t released;
+
+	///Segments created by this process
+	int created;
+
+	/**
+	 * @brief Builds the name of a segment
+	 *
+	 * @param path Set to the file path on hugetlbfs, or the POSIX shm name
+	 */
+	void segmentName(int index, char* path, size_t length)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), SHSEGMENTNAME, index);
+
+		if(control->hugePages)
+			snprintf(path, length, "%s%s", HUGEPAGEDIR, name);
+		else
+			snprintf(path, length, "%s", name);
+	}
+
+	/**
+	 * @brief Opens a segment by name
+	 */
+	int openSegment(int index, int flags)
+	{
+		char path[128];
+		segmentName(index, path, sizeof(path));
+
+		if(control->hugePages)
+			return open(path, flags, 0666);
+
+		return shm_open(path, flags, 0666);
+	}
+
+	/**
+	 * @brief Maps an open segment and records it
+	 *
+	 * @return The ring, or NULL if the creator hasn't sized it yet
+	 */
+	SharedRing* mapSegment(int index, int fd)
+	{
+		struct stat fileStat;
+		if(fstat(fd, &fileStat) < 0 || (size_t)fileStat.st_size < sizeof(SharedRing))
+			return NULL;
+
+		void* mem = mmap(NULL, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if(mem == MAP_FAILED)
+			return NULL;
+
+		//Without hugetlbfs, ask for transparent huge pages where the kernel allows them on shm
+		if(!control->hugePages)
+			madvise(mem, fileStat.st_size, MADV_HUGEPAGE);
+
+		mappedSizes[index] = fileStat.st_size;
+		__atomic_store_n(&segments[index], (SharedRing*)mem, __ATOMIC_RELEASE);
+
+		return (SharedRing*)mem;
+	}
+
+	/**
+	 * @brief Maps a segment, creating it if nobody has yet
+	 *
+	 * @param index The segment number
+	 * @param create Whether to create the segment if it doesn't exist
+	 * @return The ring, or NULL if it doesn't exist or isn't ready
+	 */
+	SharedRing* attachSegment(int index, bool create)
+	{
+		SharedRing* ring = __atomic_load_n(&segments[index], __ATOMIC_ACQUIRE);
+		if(ring) return ring->isReady() ? ring : NULL;
+
+		pthread_mutex_lock(&lock);
+
+		ring = segments[index];
+		if(!ring)
+		{
+			int fd = openSegment(index, O_RDWR);
+
+			if(fd >= 0)
+				ring = mapSegment(index, fd);
+			//Only the creator sizes and initializes the segment
+			else if(create && errno == ENOENT && (fd = openSegment(index, O_RDWR | O_CREAT | O_EXCL)) >= 0)
+			{
+				size_t size = segmentSize;
+				if(control->hugePages)
+					size = (size + HUGEPAGESIZE - 1) / HUGEPAGESIZE * HUGEPAGESIZE;
+
+				//Other users' proxies need to write the consumer's side
+				fchmod(fd, 0666);
+
+				if(ftruncate(fd, size) == 0 && (ring = mapSegment(index, fd)))
+				{
+					ring->init(size, FREE);
+					created++;
+				}
+				else
+					cout << "Error creating shared memory segment " << index << endl;
+			}
+
+			if(fd >= 0) close(fd);
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		return ring && ring->isReady() ? ring : NULL;
+	}
+
+	public:
+
+	///The states of a segment
+	enum {FREE, LOCKED};
+
+	/**
+	 * @brief Joins the machine's pool, creating the shared bookkeeping if this is the first process
+	 *
+	 * @param maxSegs The most segments this process uses at once
+	 * @param segSize The size of segments this process creates
+	 * @param hugePages Whether to put segments on hugetlbfs; only the first process decides
+	 */
+	SharedMemPool(int maxSegs, size_t segSize, bool hugePages)
+	{
+		maxSegments = min(max(maxSegs, 1), SHMAXSEGMENTS);
+		segmentSize = max(segSize, sizeof(SharedRing) + SHSLOTS * RINGLINE);
+		created = 0;
+
+		for(int i = 0; i < SHMAXSEGMENTS; i++)
+		{
+			segments[i] = NULL;
+			mappedSizes[i] = 0;
+		}
+
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&released, NULL);
+
+		//The first process sets the backing for everyone
+		bool first = true;
+		int fd = shm_open(SHPOOLNAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if(fd < 0)
+		{
+			first = false;
+			fd = shm_open(SHPOOLNAME, O_RDWR, 0666);
+
+			//Touching the mapping before the creator sizes the object would raise SIGBUS
+			struct stat poolStat;
+			for(int i = 0; i < 1000 && fd >= 0 && fstat(fd, &poolStat) == 0 && poolStat.st_size < (off_t)sizeof(poolControl); i++)
+				usleep(1000);
+
+			if(fd >= 0 && (fstat(fd, &poolStat) < 0 || poolStat.st_size < (off_t)sizeof(poolControl)))
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		else if(fchmod(fd, 0666) < 0 || ftruncate(fd, sizeof(poolControl)) < 0)
+			cout << "Error sizing shared memory pool" << endl;
+
+		control = fd >= 0 ? (poolControl*)mmap(NULL, sizeof(poolControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : (poolControl*)MAP_FAILED;
+		if(fd >= 0) close(fd);
+
+		if(control == MAP_FAILED)
+		{
+			cout << "Error attaching to shared memory pool" << endl;
+			control = NULL;
+			return;
+		}
+
+		if(first)
+		{
+			struct stat dirStat;
+			bool haveHugeTLB = stat(HUGEPAGEDIR, &dirStat) == 0 && S_ISDIR(dirStat.st_mode);
+
+			if(hugePages && !haveHugeTLB)
+				cout << "No hugetlbfs at " << HUGEPAGEDIR << ", using shm with transparent huge pages" << endl;
+
+			control->hugePages = hugePages && haveHugeTLB;
+			__atomic_store_n(&control->initialized, 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			//The creator may still be deciding on huge pages
+			for(int i = 0; i < 1000 && !__atomic_load_n(&control->initialized, __ATOMIC_ACQUIRE); i++)
+				usleep(1000);
+
+			if(!__atomic_load_n(&control->initialized, __ATOMIC_ACQUIRE))
+			{
+				cout << "The shared memory pool was never initialized, remove /dev/shm" << SHPOOLNAME << " once no servers are running" << endl;
+				munmap(control, sizeof(poolControl));
+				control = NULL;
+				return;
+			}
+		}
+
+		__sync_fetch_and_add(&control->processes, 1);
+	}
+
+	/**
+	 * @brief Unmaps every segment, and removes them all if this is the last process
+	 */
+	~SharedMemPool()
+	{
+		for(int i = 0; i < SHMAXSEGMENTS; i++)
+			if(segments[i]) munmap(segments[i], mappedSizes[i]);
+
+		if(!control) return;
+
+		if(__sync_sub_and_fetch(&control->processes, 1) == 0)
+		{
+			char path[128];
+			for(int i = 0; i < SHMAXSEGMENTS; i++)
+			{
+				segmentName(i, path, sizeof(path));
+
+				if(control->hugePages)
+					unlink(path);
+				else
+					shm_unlink(path);
+			}
+
+			shm_unlink(SHPOOLNAME);
+		}
+
+		munmap(control, sizeof(poolControl));
+	}
+
+	/**
+	 * @brief Maps a segment another process handed out
+	 *
+	 * @return The ring, or NULL if the index isn't a ready segment
+	 */
+	SharedRing* attach(int index)
+	{
+		if(!control || index < 0 || index >= SHMAXSEGMENTS) return NULL;
+
+		return attachSegment(index, false);
+	}
+
+	/**
+	 * @brief Gets a ring that has already been mapped by acquire() or attach()
+	 */
+	SharedRing* segment(int index)
+	{
+		return segments[index];
+	}
+
+	/**
+	 * @brief Claims a free segment, growing the pool if every segment is busy
+	 *
+	 * @return The index of the segment
+	 *
+	 * @note Blocks until a segment can be claimed
+	 */
+	int acquire()
+	{
+		while(true)
+		{
+			for(int i = 0; control && i < maxSegments; i++)
+			{
+				SharedRing* ring = attachSegment(i, true);
+
+				if(ring && __sync_bool_compare_and_swap(&ring->state, FREE, LOCKED))
+					return i;
+			}
+
+			//Other processes release segments without signalling, so don't wait for long
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += SHWAITNSEC;
+			if(deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			pthread_mutex_lock(&lock);
+			pthread_cond_timedwait(&released, &lock, &deadline);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+
+	/**
+	 * @brief Hands a segment claimed by acquire() back to the pool
+	 */
+	void release(int index)
+	{
+		__atomic_store_n(&segments[index]->state, FREE, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&lock);
+		pthread_cond_broadcast(&released);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/**
+	 * @brief Prints how large the pool has grown
+	 */
+	void printStats()
+	{
+		int mapped = 0;
+		for(int i = 0; i < SHMAXSEGMENTS; i++)
+			if(segments[i]) mapped++;
+
+		cout << "Shared memory segments: " << mapped << " mapped, " << created << " created, " << maxSegments << " max" << "\t" << "bytes each: " << segmentSize << (control && control->hugePages ? " (hugetlbfs)" : "") << endl;
+	}
+};
+}
+#endif
@@ -0,0 +1,369 @@
+#ifndef SHM_QUEUE
+#define SHM_QUEUE
+
+/**
+ * @file shmQueue.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the SubmissionQueue layout local proxies post SHBUFF requests to a server through
+ */
+
+#include <string>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SQNAME "/httpQueue.%d" //The POSIX shm object holding a server's queue, by port
+#define SQMAGIC 0x53514555 //Marks a queue whose server has finished setting it up
+#define SQENTRIES 256 //The requests a queue holds before submitters fall back to TCP
+#define SQPATHMAX 256 //The longest path that can be submitted
+#define SQSPINS 128 //Failed takes before a server thread parks on the futex
+#define SQLINE 64 //Keeps the submitters' and the server's indices on separate cache lines
+#define SQSEGMENTS 256 //Segment indices the server can report as unusable, as many as a SharedMemPool holds
+#define SQDRAINSPINS 10000 //Yields a closing server waits for a submitter to finish writing an entry it claimed
+
+using namespace std;
+
+/**
+ * @brief A submitted request
+ */
+struct submissionEntry
+{
+	///The position this entry will next be written (pos) or read (pos + 1) at
+	unsigned long sequence;
+
+	///The SharedRing segment the submitter claimed for the response
+	int segment;
+
+	///The requested path, NUL terminated
+	char path[SQPATHMAX];
+};
+
+/**
+ * @brief A bounded multi-producer/multi-consumer queue of requests laid out in a shared memory segment
+ *
+ * @note Each server creates one, named by its port. A proxy claims a free
+ * SharedRing segment itself, submits the path with the segment's index, and
+ * starts reading the ring right away; the first slot the server publishes is
+ * the response, so there is no completion message and no socket. The server
+ * publishes the end marker and moves on without waiting for the proxy to
+ * drain the ring, and the proxy hands the segment back once it has. The
+ * entries use the same sequence numbering as MPMCQueue, but the futex is
+ * shared between processes. A server that can't map a submitted segment
+ * can't write into it either, so it marks the segment rejected instead; a
+ * closing server answers whatever is left in the queue.
+ */
+struct SubmissionQueue
+{
+	///SQMAGIC once the queue can be used
+	int ready;
+
+	///The server that created the queue
+	int pid;
+
+	///Set when the server stops taking requests
+	int closed;
+
+	char pad0[SQLINE - 3 * sizeof(int)];
+
+	///The next position a submitter will claim
+	unsigned long enqueuePos;
+
+	char pad1[SQLINE - sizeof(unsigned long)];
+
+	///The next position a server thread will claim
+	unsigned long dequeuePos;
+
+	char pad2[SQLINE - sizeof(unsigned long)];
+
+	///Bumped by submitters to wake parked server threads; the futex word
+	int wakeSequence;
+
+	///The server threads parked or about to park
+	int waiters;
+
+	char pad3[SQLINE - 2 * sizeof(int)];
+
+	submissionEntry entries[SQENTRIES];
+
+	///Set by the server for a submitted segment it couldn't map, cleared when the segment is submitted again
+	int rejected[SQSEGMENTS];
+
+	static long futex(int* addr, int op, int val, const struct timespec* timeout)
+	{
+		return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+	}
+
+	static void name(int port, char* path, size_t length)
+	{
+		snprintf(path, length, SQNAME, port);
+	}
+
+	/**
+	 * @brief Creates a server's queue, replacing any a previous server on the port left behind
+	 *
+	 * @return The queue, or NULL if it couldn't be created
+	 */
+	static SubmissionQueue* create(int port)
+	{
+		char path[64];
+		name(port, path, sizeof(path));
+		shm_unlink(path);
+
+		int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if(fd < 0) return NULL;
+
+		//Other users' proxies need to submit
+		fchmod(fd, 0666);
+
+		void* mem = ftruncate(fd, sizeof(SubmissionQueue)) == 0 ? mmap(NULL, sizeof(SubmissionQueue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+
+		if(mem == MAP_FAILED)
+		{
+			shm_unlink(path);
+			return NULL;
+		}
+
+		SubmissionQueue* queue = (SubmissionQueue*)mem;
+		for(unsigned long i = 0; i < SQENTRIES; i++)
+			queue->entries[i].sequence = i;
+
+		queue->pid = getpid();
+		__atomic_store_n(&queue->ready, SQMAGIC, __ATOMIC_RELEASE);
+
+		return queue;
+	}
+
+	/**
+	 * @brief Maps the queue of the server on a port
+	 *
+	 * @return The queue, or NULL if the server doesn't have a ready one
+	 */
+	static SubmissionQueue* attach(int port)
+	{
+		char path[64];
+		name(port, path, sizeof(path));
+
+		int fd = shm_open(path, O_RDWR, 0666);
+		if(fd < 0) return NULL;
+
+		struct stat fileStat;
+		void* mem = fstat(fd, &fileStat) == 0 && (size_t)fileStat.st_size == sizeof(SubmissionQueue) ? mmap(NULL, sizeof(SubmissionQueue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+
+		if(mem == MAP_FAILED) return NULL;
+
+		SubmissionQueue* queue = (SubmissionQueue*)mem;
+		if(__atomic_load_n(&queue->ready, __ATOMIC_ACQUIRE) != SQMAGIC)
+		{
+			munmap(mem, sizeof(SubmissionQueue));
+			return NULL;
+		}
+
+		return queue;
+	}
+
+	/**
+	 * @brief Unmaps a queue
+	 */
+	static void detach(SubmissionQueue* queue)
+	{
+		munmap(queue, sizeof(SubmissionQueue));
+	}
+
+	/**
+	 * @brief Stops the server's queue taking requests and removes its name
+	 *
+	 * @note The queue stays mapped, so server threads still waiting on it are harmless
+	 */
+	void shutdown(int port)
+	{
+		char path[64];
+		name(port, path, sizeof(path));
+
+		__atomic_store_n(&closed, 1, __ATOMIC_RELEASE);
+		shm_unlink(path);
+
+		__atomic_add_fetch(&wakeSequence, 1, __ATOMIC_SEQ_CST);
+		futex(&wakeSequence, FUTEX_WAKE, INT_MAX, NULL);
+	}
+
+	/**
+	 * @brief Checks whether the server still takes requests
+	 */
+	bool isOpen()
+	{
+		return !__atomic_load_n(&closed, __ATOMIC_ACQUIRE);
+	}
+
+	/**
+	 * @brief Posts a request without blocking
+	 *
+	 * @param path The file to serve
+	 * @param segment The SharedRing segment the response goes into
+	 * @return False if the queue is full or closed, or the path is too long
+	 */
+	bool trySubmit(const string& path, int segment)
+	{
+		if(path.length() >= SQPATHMAX || segment < 0 || segment >= SQSEGMENTS || !isOpen()) return false;
+
+		unsigned long pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		submissionEntry* target;
+
+		while(true)
+		{
+			target = &entries[pos % SQENTRIES];
+			unsigned long seq = __atomic_load_n(&target->sequence, __ATOMIC_ACQUIRE);
+			long diff = (long)seq - (long)pos;
+
+			//The entry is free for this lap, try to claim it
+			if(diff == 0)
+			{
+				if(__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			}
+			//The server hasn't taken it since the last lap
+			else if(diff < 0)
+				return false;
+			else
+				pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		}
+
+		target->segment = segment;
+		memcpy(target->path, path.c_str(), path.length() + 1);
+		__atomic_store_n(&rejected[segment], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&target->sequence, pos + 1, __ATOMIC_RELEASE);
+
+		//Only pay for the wake syscall when a server thread is parked
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&waiters, __ATOMIC_RELAXED) > 0)
+		{
+			__atomic_add_fetch(&wakeSequence, 1, __ATOMIC_SEQ_CST);
+			futex(&wakeSequence, FUTEX_WAKE, 1, NULL);
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Takes a request without blocking
+	 *
+	 * @param path Set to the file to serve
+	 * @param segment Set to the segment the response goes into
+	 * @return False if the queue is empty
+	 */
+	bool tryTake(string& path, int& segment)
+	{
+		unsigned long pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+		submissionEntry* target;
+
+		while(true)
+		{
+			target = &entries[pos % SQENTRIES];
+			unsigned long seq = __atomic_load_n(&target->sequence, __ATOMIC_ACQUIRE);
+			long diff = (long)seq - (long)(pos + 1);
+
+			//The entry holds a request for this lap, try to claim it
+			if(diff == 0)
+			{
+				if(__atomic_compare_exchange_n(&dequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			}
+			//Nothing has been submitted here yet
+			else if(diff < 0)
+				return false;
+			else
+				pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+		}
+
+		segment = target->segment;
+		path.assign(target->path, strnlen(target->path, SQPATHMAX));
+
+		//Free the entry for the submitter one lap ahead
+		__atomic_store_n(&target->sequence, pos + SQENTRIES, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+	/**
+	 * @brief Takes a request left in a closed queue
+	 *
+	 * @return False once every entry submitters claimed has been taken
+	 *
+	 * @note A submitter that claimed an entry just before the queue closed may
+	 * still be writing it, so this yields for a while before giving up on it
+	 */
+	bool takeRemaining(string& path, int& segment)
+	{
+		for(int i = 0; i < SQDRAINSPINS; i++)
+		{
+			if(tryTake(path, segment)) return true;
+
+			if(__atomic_load_n(&dequeuePos, __ATOMIC_ACQUIRE) == __atomic_load_n(&enqueuePos, __ATOMIC_ACQUIRE))
+				return false;
+
+			sched_yield();
+		}
+
+		return false;
+	}
+
+	/**
+	 * @brief Tells the submitter of a segment that the server couldn't map it, so nothing will be written
+	 */
+	void reject(int segment)
+	{
+		if(segment >= 0 && segment < SQSEGMENTS)
+			__atomic_store_n(&rejected[segment], 1, __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * @brief Checks whether the server rejected a submitted segment
+	 */
+	bool wasRejected(int segment)
+	{
+		return __atomic_load_n(&rejected[segment], __ATOMIC_ACQUIRE);
+	}
+
+	/**
+	 * @brief Takes a request, parking the calling thread while the queue is empty
+	 *
+	 * @param timeoutMillis The longest to park, so the caller can check whether it should stop
+	 * @return False if nothing arrived in time or the queue was closed
+	 */
+	bool take(string& path, int& segment, int timeoutMillis)
+	{
+		for(int i = 0; i < SQSPINS; i++)
+			if(tryTake(path, segment)) return true;
+
+		__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+		int seq = __atomic_load_n(&wakeSequence, __ATOMIC_SEQ_CST);
+
+		//Check again now that submitters can see this thread is waiting
+		bool found = tryTake(path, segment);
+
+		if(!found && isOpen())
+		{
+			struct timespec timeout;
+			timeout.tv_sec = timeoutMillis / 1000;
+			timeout.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+			futex(&wakeSequence, FUTEX_WAIT, seq, &timeout);
+
+			found = tryTake(path, segment);
+		}
+
+		__atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+
+		return found;
+	}
+};
+#endif
@@ -0,0 +1,305 @@
+#ifndef SHM_RING
+#define SHM_RING
+
+/**
+ * @file shmRing.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the SharedRing layout used to stream SHBUFF responses through shared memory
+ */
+
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHSLOTS 8 //The number of slots in each ring
+#define SHSLOTSIZE 65536 //The bytes each slot holds unless the segment size is set
+#define SHRINGMAGIC 0x52494e47 //Marks a ring whose creator has finished setting it up
+#define SHRINGSPINS 256 //Checks of the other side's index before parking on the futex
+#define RINGLINE 64 //Keeps the producer's and consumer's fields on separate cache lines
+
+/**
+ * @brief A single-producer/single-consumer ring of fixed size slots laid out in a shared memory segment
+ *
+ * @note The server fills slots and publishes each one by advancing head; the
+ * proxy drains them and advances tail. Both are free-running counters, so the
+ * ring is empty when they are equal and full when they are SHSLOTS apart.
+ * Small writes are packed into the open slot, and a side only makes a wake
+ * syscall when the other has said it is parked, so a transfer costs about one
+ * notification per slot at most. A slot published with no bytes ends the
+ * response. Everything in here is shared between processes, so the futexes
+ * are not private. The slots follow the struct in the segment, and their size
+ * is chosen by whoever creates the segment.
+ */
+struct SharedRing
+{
+	///FREE or LOCKED, set by the server that hands the segment out
+	int state;
+
+	char pad0[RINGLINE - sizeof(int)];
+
+	///Slots published by the producer; the consumer's futex word
+	unsigned int head;
+
+	///Bytes written into the open slot
+	int fill;
+
+	///Set while the producer is parked waiting for a free slot
+	int producerWaiting;
+
+	char pad1[RINGLINE - sizeof(unsigned int) - 2 * sizeof(int)];
+
+	///Slots released by the consumer; the producer's futex word
+	unsigned int tail;
+
+	///Set while the consumer is parked waiting for a slot
+	int consumerWaiting;
+
+	char pad2[RINGLINE - sizeof(unsigned int) - sizeof(int)];
+
+	///The number of bytes published in each slot
+	int lengths[SHSLOTS];
+
+	///The bytes each slot holds
+	int slotSize;
+
+	///SHRINGMAGIC once the ring can be used
+	int ready;
+
+	/**
+	 * @brief Finds a slot's data, which starts after the struct
+	 */
+	char* slotData(unsigned int slot)
+	{
+		return (char*)(this + 1) + (size_t)(slot % SHSLOTS) * slotSize;
+	}
+
+	/**
+	 * @brief The slot size that fits a segment of the given size
+	 */
+	static int slotSizeFor(size_t segmentSize)
+	{
+		size_t size = segmentSize > sizeof(SharedRing) ? (segmentSize - sizeof(SharedRing)) / SHSLOTS : 0;
+
+		//Keep slots cache line aligned
+		return (int)(size & ~(size_t)(RINGLINE - 1));
+	}
+
+	static long futex(unsigned int* addr, int op, unsigned int val, const struct timespec* timeout = NULL)
+	{
+		return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+	}
+
+	/**
+	 * @brief Blocks until a counter moves off a value, spinning briefly first
+	 *
+	 * @param word The other side's counter
+	 * @param seen The value to wait for it to leave
+	 * @param waiting This side's parked flag
+	 * @param timeout The longest to stay parked, or NULL to wait for good
+	 * @return False if the timeout passed with the counter unchanged
+	 */
+	static bool waitWhile(unsigned int* word, unsigned int seen, int* waiting, const struct timespec* timeout = NULL)
+	{
+		for(int i = 0; i < SHRINGSPINS; i++)
+			if(__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) return true;
+
+		while(__atomic_load_n(word, __ATOMIC_ACQUIRE) == seen)
+		{
+			__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+			//Check again now that the other side can see this one is waiting
+			bool timedOut = false;
+			if(__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+				timedOut = futex(word, FUTEX_WAIT, seen, timeout) < 0 && errno == ETIMEDOUT;
+
+			__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+			if(timedOut)
+				return __atomic_load_n(word, __ATOMIC_ACQUIRE) != seen;
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Moves a counter on and wakes the other side if it is parked on it
+	 */
+	static void advance(unsigned int* word, int* otherWaiting)
+	{
+		__atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(otherWaiting, __ATOMIC_RELAXED))
+			futex(word, FUTEX_WAKE, INT_MAX);
+	}
+
+	/**
+	 * @brief Sets up an empty ring in a freshly created segment
+	 *
+	 * @param segmentSize The size of the whole segment
+	 * @param initialState The state the creator leaves the ring in
+	 */
+	void init(size_t segmentSize, int initialState)
+	{
+		state = initialState;
+		head = 0;
+		tail = 0;
+		fill = 0;
+		producerWaiting = 0;
+		consumerWaiting = 0;
+		slotSize = slotSizeFor(segmentSize);
+
+		__atomic_store_n(&ready, SHRINGMAGIC, __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * @brief Checks that the creator has finished init()
+	 */
+	bool isReady()
+	{
+		return __atomic_load_n(&ready, __ATOMIC_ACQUIRE) == SHRINGMAGIC;
+	}
+
+	/**
+	 * @brief Gets the unused part of the open slot, waiting for the consumer if the ring is full
+	 *
+	 * @param space Set to the bytes that may be written
+	 * @return Where to write
+	 */
+	char* reserve(int& space)
+	{
+		unsigned int slot = __atomic_load_n(&head, __ATOMIC_RELAXED);
+
+		if(fill == 0)
+			waitWhile(&tail, slot - SHSLOTS, &producerWaiting);
+
+		space = slotSize - fill;
+		return slotData(slot) + fill;
+	}
+
+	/**
+	 * @brief Accounts for bytes written after reserve(), publishing the slot once it is full
+	 */
+	void commit(int bytes)
+	{
+		fill += bytes;
+
+		if(fill == slotSize)
+			flush();
+	}
+
+	/**
+	 * @brief Publishes the open slot, even if it is partly full
+	 */
+	void flush()
+	{
+		unsigned int slot = __atomic_load_n(&head, __ATOMIC_RELAXED);
+
+		lengths[slot % SHSLOTS] = fill;
+		fill = 0;
+
+		advance(&head, &consumerWaiting);
+	}
+
+	/**
+	 * @brief Copies bytes into the ring
+	 */
+	void append(const char* data, int length)
+	{
+		while(length > 0)
+		{
+			int space;
+			char* dest = reserve(space);
+			int bytes = length < space ? length : space;
+
+			memcpy(dest, data, bytes);
+			commit(bytes);
+
+			data += bytes;
+			length -= bytes;
+		}
+	}
+
+	/**
+	 * @brief Publishes what is left followed by the end marker
+	 *
+	 * @note The producer must not touch the ring afterwards, since the
+	 * consumer may hand it to someone else once it reads the marker
+	 */
+	void end()
+	{
+		if(fill > 0) flush();
+
+		//The end marker is an empty slot
+		int space;
+		reserve(space);
+		flush();
+	}
+
+	/**
+	 * @brief Publishes what is left followed by the end marker, then waits for the consumer to drain the ring
+	 */
+	void finish()
+	{
+		end();
+
+		unsigned int published = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		unsigned int released;
+		while((released = __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) != published)
+			waitWhile(&tail, released, &producerWaiting);
+	}
+
+	/**
+	 * @brief Waits for the next published slot
+	 *
+	 * @param length Set to the bytes in the slot, 0 at the end of the response
+	 * @return The slot's data, valid until release()
+	 */
+	const char* peek(int& length)
+	{
+		unsigned int slot = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+		waitWhile(&head, slot, &consumerWaiting);
+
+		length = lengths[slot % SHSLOTS];
+		return slotData(slot);
+	}
+
+	/**
+	 * @brief Waits a limited time for the next published slot
+	 *
+	 * @param length Set to the bytes in the slot, 0 at the end of the response
+	 * @param timeoutMillis The longest to wait
+	 * @return The slot's data, valid until release(), or NULL if nothing was published in time
+	 *
+	 * @note Nothing is consumed until release(), so a caller that times out
+	 * can check on the producer and call again
+	 */
+	const char* peek(int& length, int timeoutMillis)
+	{
+		unsigned int slot = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+		struct timespec timeout;
+		timeout.tv_sec = timeoutMillis / 1000;
+		timeout.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+		if(!waitWhile(&head, slot, &consumerWaiting, &timeout))
+			return NULL;
+
+		length = lengths[slot % SHSLOTS];
+		return slotData(slot);
+	}
+
+	/**
+	 * @brief Hands the slot returned by peek() back to the producer
+	 */
+	void release()
+	{
+		advance(&tail, &producerWaiting);
+	}
+};
+#endif
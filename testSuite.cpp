@@ -1,74 +1,429 @@
-#include "server.cpp"
-#include "proxy.cpp"
+/**
+ * @file testSuite.cpp
+ *
+ * @section DESCRIPTION
+ * Runs a benchmark sweep described by a config file against http_server and http_proxy
+ *
+ * @note Every combination of the listed values is one point. Each
+ * server/proxy shape is started on free ports, measured at each client
+ * setting after a warm-up, and stopped. Every point is repeated, and the
+ * request rate and latency percentiles are reported as a mean with a
+ * Student-t confidence interval.
+ */
+
+#include <map>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <signal.h>
+#include <sys/wait.h>
 #include "client.cpp"
 
-/*
- * 
--Filesize (256b, 1kb, 4kb, 32, 256, 1mb, 4mb, 32mb?)
--Number of worker threads (1, 2, 4, 8, 16, 32?)
--Queue size (1, 2, 4, 8, 16, 32)
--Number of clients (1, 2, 4, 8, 16)
--loops? (1, 2, 4, 8)
-*/
-
-int workerThreadsNum = 5;
-int workerThreads[] = {1, 2, 4, 8, 16};
-int queueSizeNum = 6;
-int queueSize[] = {1, 2, 4, 8, 16, 32};
-int clientThreadsNum = 5;
-int clientThreads[] = {1, 2, 4, 8, 16};
-int fileSizeNum = 7;
-char* fileSize[] = {"256b.txt", "1k.txt", "4k.txt", "32k.txt", "256k.txt", "1mb.txt", "4mb.txt, 16mb.txt"};
-int loopSizeNum = 4;
-int loopSize[] = {1, 2, 4, 8};
+#define STARTTIMEOUT 5000 //Milliseconds a server or proxy has to start accepting connections
+#define STOPTIMEOUT 5000 //Milliseconds a server or proxy has to exit after Ctrl-C before it is killed
+
+using namespace std;
+
+/**
+ * @brief A sweep config: the values of each axis and the fixed settings
+ */
+struct sweepConfig
+{
+	///Each axis's values, in the order they were listed
+	map<string, vector<string> > axes;
+
+	string serverBinary;
+	string proxyBinary;
+
+	///Options passed to every server and proxy after the required arguments
+	vector<string> serverOptions;
+	vector<string> proxyOptions;
+
+	double warmup;
+	double measure;
+	int repetitions;
+	int confidence;
+
+	///A CSV file each point is appended to, or empty
+	string output;
+};
+
+/**
+ * @brief The measurements of one point across its repetitions
+ */
+struct pointSamples
+{
+	vector<double> rates;
+	vector<double> p50s;
+	vector<double> p99s;
+	long errors;
+};
+
+/**
+ * @brief Two-sided Student-t critical values for 1 to 30 degrees of freedom
+ */
+static const double tTable[3][30] = {
+	//90%
+	{6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812, 1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740, 1.734, 1.729, 1.725, 1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697},
+	//95%
+	{12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042},
+	//99%
+	{63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250, 3.169, 3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878, 2.861, 2.845, 2.831, 2.819, 2.807, 2.797, 2.787, 2.779, 2.771, 2.763, 2.756, 2.750}
+};
+
+/**
+ * @brief The normal critical values used past 30 degrees of freedom
+ */
+static const double zTable[3] = {1.645, 1.960, 2.576};
+
+/**
+ * @brief Reads a sweep config
+ *
+ * @return False if the file can't be read or a line isn't understood
+ */
+static bool loadConfig(const char* path, sweepConfig& config)
+{
+	//Anything the config leaves out
+	config.axes["target"].push_back("server");
+	config.axes["workers"].push_back("4");
+	config.axes["queue"].push_back("32");
+	config.axes["clients"].push_back("4");
+	config.axes["file"].push_back("test.txt");
+	config.axes["keepalive"].push_back("1");
+	config.serverBinary = "./http_server";
+	config.proxyBinary = "./http_proxy";
+	config.warmup = 1;
+	config.measure = 3;
+	config.repetitions = 5;
+	config.confidence = 95;
+
+	ifstream file(path);
+	if(!file)
+	{
+		cout << "Couldn't read " << path << endl;
+		return false;
+	}
+
+	string line;
+	int lineNumber = 0;
+	while(getline(file, line))
+	{
+		lineNumber++;
+
+		istringstream fields(line);
+		string key, value;
+		if(!(fields >> key) || key[0] == '#') continue;
+
+		vector<string> values;
+		while(fields >> value)
+			values.push_back(value);
+
+		if(config.axes.count(key) && !values.empty())
+			config.axes[key] = values;
+		else if(key == "serveropts")
+			config.serverOptions = values;
+		else if(key == "proxyopts")
+			config.proxyOptions = values;
+		else if(key == "server" && values.size() == 1)
+			config.serverBinary = values[0];
+		else if(key == "proxy" && values.size() == 1)
+			config.proxyBinary = values[0];
+		else if(key == "warmup" && values.size() == 1)
+			config.warmup = atof(values[0].c_str());
+		else if(key == "measure" && values.size() == 1)
+			config.measure = atof(values[0].c_str());
+		else if(key == "repetitions" && values.size() == 1)
+			config.repetitions = max(atoi(values[0].c_str()), 1);
+		else if(key == "confidence" && values.size() == 1 && (values[0] == "90" || values[0] == "95" || values[0] == "99"))
+			config.confidence = atoi(values[0].c_str());
+		else if(key == "output" && values.size() == 1)
+			config.output = values[0];
+		else
+		{
+			cout << path << ":" << lineNumber << ": can't use \"" << line << "\"" << endl;
+			return false;
+		}
+	}
+
+	for(size_t i = 0; i < config.axes["target"].size(); i++)
+		if(config.axes["target"][i] != "server" && config.axes["target"][i] != "proxy")
+		{
+			cout << "target must be server or proxy" << endl;
+			return false;
+		}
+
+	return config.measure > 0;
+}
+
+/**
+ * @brief Finds a port nothing is listening on by letting the kernel pick one
+ */
+static int freePort()
+{
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in addr;
+	bzero((char *) &addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	socklen_t length = sizeof(addr);
+	int port = -1;
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(sockfd, (struct sockaddr *)&addr, &length) == 0)
+		port = ntohs(addr.sin_port);
+
+	close(sockfd);
+	return port;
+}
+
+/**
+ * @brief Waits until something accepts connections on a local port
+ *
+ * @return False if nothing did within STARTTIMEOUT
+ */
+static bool waitForListener(int port, pid_t pid)
+{
+	struct sockaddr_in addr;
+	bzero((char *) &addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	for(int waited = 0; waited < STARTTIMEOUT; waited += 10)
+	{
+		int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		bool connected = connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		close(sockfd);
+
+		if(connected) return true;
+
+		//It exited instead of starting
+		if(waitpid(pid, NULL, WNOHANG) == pid) return false;
+
+		usleep(10000);
+	}
+
+	return false;
+}
+
+/**
+ * @brief Starts a server or proxy with its output discarded
+ *
+ * @param arguments The command line, starting with the binary
+ * @return Its pid, or -1 if it didn't start accepting on port
+ */
+static pid_t launch(const vector<string>& arguments, int port)
+{
+	cout.flush();
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(devNull, STDOUT_FILENO);
+		dup2(devNull, STDERR_FILENO);
+
+		vector<char*> argv;
+		for(size_t i = 0; i < arguments.size(); i++)
+			argv.push_back((char*)arguments[i].c_str());
+		argv.push_back(NULL);
+
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+
+	if(pid < 0 || !waitForListener(port, pid))
+	{
+		cout << "Couldn't start " << arguments[0] << " on port " << port << endl;
+		if(pid > 0)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		return -1;
+	}
+
+	return pid;
+}
+
+/**
+ * @brief Stops a server or proxy with Ctrl-C so it cleans up its shared memory, killing it if it hangs
+ */
+static void stop(pid_t pid)
+{
+	if(pid <= 0) return;
+
+	kill(pid, SIGINT);
+	for(int waited = 0; waited < STOPTIMEOUT; waited += 10)
+	{
+		if(waitpid(pid, NULL, WNOHANG) == pid) return;
+		usleep(10000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * @brief Runs the client quietly for a while
+ */
+static runResult measure(int port, const string& file, int clients, int keepalive, const char* host, double seconds)
+{
+	client clnt(port);
+	clnt.setDuration(seconds);
+	clnt.setQuiet(true);
+	return clnt.runWorkerThreads((char*)"127.0.0.1", (char*)file.c_str(), clients, INT_MAX, host, keepalive);
+}
+
+static double mean(const vector<double>& values)
+{
+	double sum = 0;
+	for(size_t i = 0; i < values.size(); i++)
+		sum += values[i];
+
+	return values.empty() ? 0 : sum / values.size();
+}
+
+/**
+ * @brief Half the width of the confidence interval around the mean
+ */
+static double confidenceHalfWidth(const vector<double>& values, int confidence)
+{
+	size_t n = values.size();
+	if(n < 2) return 0;
+
+	double average = mean(values);
+	double squares = 0;
+	for(size_t i = 0; i < n; i++)
+		squares += (values[i] - average) * (values[i] - average);
+
+	int level = confidence == 90 ? 0 : confidence == 95 ? 1 : 2;
+	double critical = n - 1 <= 30 ? tTable[level][n - 2] : zTable[level];
+
+	return critical * sqrt(squares / (n - 1)) / sqrt((double)n);
+}
+
+/**
+ * @brief Formats a mean and its confidence interval
+ */
+static string interval(const vector<double>& values, int confidence)
+{
+	ostringstream text;
+	text << (long)mean(values) << " ±" << (long)(confidenceHalfWidth(values, confidence) + 0.5);
+	return text.str();
+}
 
 int main(int argc, char* argv[])
 {
-	//Server loops
-	
-	int port = 30000;
-	
-	//Worker threads
-	for(int i = 0; i < workerThreadsNum; i++)
+	if(argc < 2)
 	{
-		for(int j = 0; j < queueSizeNum; j++)
+		cout << "Usage: " << argv[0] << " <sweep config>" << endl;
+		return 1;
+	}
+
+	sweepConfig config;
+	if(!loadConfig(argv[1], config))
+		return 1;
+
+	//Failed connections shouldn't end the run
+	signal(SIGPIPE, SIG_IGN);
+
+	vector<string>& targets = config.axes["target"];
+	vector<string>& workers = config.axes["workers"];
+	vector<string>& queues = config.axes["queue"];
+	vector<string>& clients = config.axes["clients"];
+	vector<string>& files = config.axes["file"];
+	vector<string>& keepalives = config.axes["keepalive"];
+
+	ofstream csv;
+	if(!config.output.empty())
+	{
+		//Runs append, so the header is only written to a new file
+		bool fresh = !ifstream(config.output.c_str()).good();
+		csv.open(config.output.c_str(), ios::app);
+		if(fresh)
+			csv << "target,workers,queue,clients,file,keepalive,repetitions,rate,rate_ci,p50_us,p50_ci,p99_us,p99_ci,errors" << endl;
+	}
+
+	long points = targets.size() * workers.size() * queues.size() * clients.size() * files.size() * keepalives.size();
+	cout << points << " points, " << config.repetitions << " repetitions of " << config.measure << " s after " << config.warmup << " s of warm-up, " << config.confidence << "% confidence intervals" << endl;
+	cout << "Target\tWorkers\tQueue\tClients\tFile\t\tKeep-alive\tReq/s\t\tp50 us\t\tp99 us\t\tErrors" << endl;
+
+	for(size_t t = 0; t < targets.size(); t++)
+	for(size_t w = 0; w < workers.size(); w++)
+	for(size_t q = 0; q < queues.size(); q++)
+	{
+		bool proxied = targets[t] == "proxy";
+
+		//A fresh server, and proxy, for each shape, so earlier points don't leave state behind
+		int serverPort = freePort();
+		vector<string> serverCommand;
+		serverCommand.push_back(config.serverBinary);
+		serverCommand.push_back(to_string(serverPort));
+		serverCommand.push_back(queues[q]);
+		serverCommand.push_back(workers[w]);
+		serverCommand.insert(serverCommand.end(), config.serverOptions.begin(), config.serverOptions.end());
+		pid_t serverPid = launch(serverCommand, serverPort);
+
+		int proxyPort = -1;
+		pid_t proxyPid = -1;
+		if(serverPid > 0 && proxied)
 		{
-			HTTP_Server srv(++port + 1000, queueSize[j]);
-			srv.setupThreadPool(workerThreads[i]);
-			srv.beginAcceptLoop();
-			
-			sleep(1);
-			
-			HTTP_Proxy prx(port, queueSize[j], port + 1000);
-			prx.setupThreadPool(workerThreads[i]);
-			prx.beginAcceptLoop();
-			
-			//wait for the startup
-			sleep(1);
-			
-			//Worker loop
-			for(int k = 0; k < clientThreadsNum; k++)
+			proxyPort = freePort();
+			vector<string> proxyCommand;
+			proxyCommand.push_back(config.proxyBinary);
+			proxyCommand.push_back(to_string(proxyPort));
+			proxyCommand.push_back(to_string(serverPort));
+			proxyCommand.push_back(queues[q]);
+			proxyCommand.push_back(workers[w]);
+			proxyCommand.insert(proxyCommand.end(), config.proxyOptions.begin(), config.proxyOptions.end());
+			proxyPid = launch(proxyCommand, proxyPort);
+		}
+
+		bool ready = serverPid > 0 && (!proxied || proxyPid > 0);
+		int port = proxied ? proxyPort : serverPort;
+		string host = "127.0.0.1:" + to_string(serverPort);
+
+		for(size_t c = 0; c < clients.size(); c++)
+		for(size_t f = 0; f < files.size(); f++)
+		for(size_t k = 0; k < keepalives.size(); k++)
+		{
+			int clientCount = atoi(clients[c].c_str());
+			int keepalive = max(atoi(keepalives[k].c_str()), 1);
+
+			pointSamples samples;
+			samples.errors = 0;
+
+			if(ready)
 			{
-				for(int l = 0; l < fileSizeNum; l++)
+				if(config.warmup > 0)
+					measure(port, files[f], clientCount, keepalive, proxied ? host.c_str() : NULL, config.warmup);
+
+				for(int r = 0; r < config.repetitions; r++)
 				{
-					for(int m = 0; m < loopSizeNum; m++)
-					{
-						sleep(1);
-						printf("# %d %d %d %d %d\n", i, j, k, l, m);
-						
-						//Convert the decimal digit to ascii
-						char num = rand() % 9 + 48;
-						client clnt(port);
-						char randName[128];
-						sprintf(randName, "%s%d", fileSize[l], rand() % 10);
-						clnt.runWorkerThreads(randName, clientThreads[k], loopSize[m]);
-					}
+					runResult result = measure(port, files[f], clientCount, keepalive, proxied ? host.c_str() : NULL, config.measure);
+
+					samples.rates.push_back(result.micros ? result.completed * 1000000.0 / result.micros : 0);
+					samples.p50s.push_back(result.p50);
+					samples.p99s.push_back(result.p99);
+					samples.errors += result.errors;
 				}
 			}
-			
-			srv.shutdownServer();
-			//Wait 5 before starting a new server with a new port
-			sleep(5);
+
+			cout << targets[t] << "\t" << workers[w] << "\t" << queues[q] << "\t" << clients[c] << "\t" << files[f] << (files[f].length() < 8 ? "\t\t" : "\t") << keepalive << "\t\t";
+			if(ready)
+				cout << interval(samples.rates, config.confidence) << "\t" << interval(samples.p50s, config.confidence) << "\t\t" << interval(samples.p99s, config.confidence) << "\t\t" << samples.errors << endl;
+			else
+				cout << "not started" << endl;
+
+			if(csv.is_open() && ready)
+				csv << targets[t] << "," << workers[w] << "," << queues[q] << "," << clients[c] << "," << files[f] << "," << keepalive << "," << config.repetitions << "," << mean(samples.rates) << "," << confidenceHalfWidth(samples.rates, config.confidence) << "," << mean(samples.p50s) << "," << confidenceHalfWidth(samples.p50s, config.confidence) << "," << mean(samples.p99s) << "," << confidenceHalfWidth(samples.p99s, config.confidence) << "," << samples.errors << endl;
 		}
+
+		stop(proxyPid);
+		stop(serverPid);
 	}
+
+	return 0;
 }
@@ -0,0 +1,201 @@
+#ifndef UPSTREAM_POOL
+#define UPSTREAM_POOL
+
+/**
+ * @file upstreamPool.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the UpstreamPool class that keeps idle keep-alive connections to origin servers
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <list>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace{
+/**
+ * @brief Idle upstream connections, kept per origin and shared by the proxy's worker threads
+ *
+ * @note Connections are handed out most recently used first, since those are
+ * the least likely to have been closed by the origin. Connections idle longer
+ * than the timeout are closed lazily whenever the origin's list is touched.
+ */
+class UpstreamPool
+{
+	private:
+
+	/**
+	 * @brief A connection waiting to be reused
+	 */
+	struct idleConnection
+	{
+		int sockfd;
+
+		///When the connection was checked in
+		time_t since;
+	};
+
+	///Idle connections for each "host:port", most recently used first
+	map<string, list<idleConnection> > idle;
+
+	///Protects idle and the counters
+	pthread_mutex_t lock;
+
+	///The most idle connections kept for one origin
+	int maxPerOrigin;
+
+	///The seconds a connection may stay idle
+	int idleTimeout;
+
+	long reused;
+	long opened;
+	long stale;
+	long evicted;
+
+	/**
+	 * @brief Closes the connections in a list that have been idle too long
+	 *
+	 * @note The caller holds lock
+	 */
+	void evictExpired(list<idleConnection>& conns, time_t now)
+	{
+		//The oldest are at the back
+		while(!conns.empty() && now - conns.back().since >= idleTimeout)
+		{
+			close(conns.back().sockfd);
+			conns.pop_back();
+			evicted++;
+		}
+	}
+
+	/**
+	 * @brief Checks that an idle connection is still open and has nothing unread
+	 *
+	 * @note An origin that closed the connection makes it readable (EOF), and
+	 * so would stray bytes, which would corrupt the next response
+	 */
+	static bool isHealthy(int sockfd)
+	{
+		struct pollfd check;
+		check.fd = sockfd;
+		check.events = POLLIN;
+		check.revents = 0;
+
+		return poll(&check, 1, 0) == 0;
+	}
+
+	public:
+
+	/**
+	 * @brief Creates an empty pool
+	 *
+	 * @param maxIdle The most idle connections kept for one origin
+	 * @param idleSeconds How long a connection may stay idle before it is closed
+	 */
+	UpstreamPool(int maxIdle, int idleSeconds)
+	{
+		maxPerOrigin = maxIdle;
+		idleTimeout = idleSeconds;
+		reused = 0;
+		opened = 0;
+		stale = 0;
+		evicted = 0;
+
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~UpstreamPool()
+	{
+		for(map<string, list<idleConnection> >::iterator it = idle.begin(); it != idle.end(); ++it)
+			for(list<idleConnection>::iterator conn = it->second.begin(); conn != it->second.end(); ++conn)
+				close(conn->sockfd);
+
+		pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * @brief Takes an idle connection to an origin
+	 *
+	 * @param origin The "host:port" of the origin
+	 * @return A connected socket, or -1 if the caller should open a new one
+	 */
+	int checkout(const string& origin)
+	{
+		time_t now = time(NULL);
+		int sockfd = -1;
+
+		pthread_mutex_lock(&lock);
+
+		list<idleConnection>& conns = idle[origin];
+		evictExpired(conns, now);
+
+		while(sockfd < 0 && !conns.empty())
+		{
+			int candidate = conns.front().sockfd;
+			conns.pop_front();
+
+			if(isHealthy(candidate))
+				sockfd = candidate;
+			else
+			{
+				close(candidate);
+				stale++;
+			}
+		}
+
+		if(sockfd >= 0) reused++;
+		else opened++;
+
+		pthread_mutex_unlock(&lock);
+
+		return sockfd;
+	}
+
+	/**
+	 * @brief Hands back a connection whose last response was read completely
+	 *
+	 * @param origin The "host:port" the connection goes to
+	 * @param sockfd The connection, which is closed if the origin's list is full
+	 */
+	void checkin(const string& origin, int sockfd)
+	{
+		time_t now = time(NULL);
+
+		pthread_mutex_lock(&lock);
+
+		list<idleConnection>& conns = idle[origin];
+		evictExpired(conns, now);
+
+		if((int)conns.size() < maxPerOrigin)
+		{
+			idleConnection conn;
+			conn.sockfd = sockfd;
+			conn.since = now;
+			conns.push_front(conn);
+			sockfd = -1;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		if(sockfd >= 0) close(sockfd);
+	}
+
+	/**
+	 * @brief Prints how often connections were reused
+	 */
+	void printStats()
+	{
+		pthread_mutex_lock(&lock);
+		cout << "Upstream connections reused: " << reused << "\t" << "opened: " << opened << "\t" << "stale: " << stale << "\t" << "idle evictions: " << evicted << endl;
+		pthread_mutex_unlock(&lock);
+	}
+};
+}
+#endif
@@ -0,0 +1,305 @@
+#ifndef WORKLOAD
+#define WORKLOAD
+
+/**
+ * @file workload.cpp
+ *
+ * @section DESCRIPTION
+ * Contains the Workload class that chooses which file each client request asks for
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORKLOADSEED 7 //Seeds each thread's file choices along with its start order, so runs pick the same files
+#define ZIPFDEFAULT 1.0 //The Zipf exponent when a spec doesn't give one
+
+using namespace std;
+
+/**
+ * @brief A mix of files to request, either sampled from a spec or replayed from an access log
+ *
+ * @note A spec file has one directive per line, and lines starting with # are comments:
+ *
+ *     zipf <exponent>
+ *     class <name> <weight> <file> [<file> ...]
+ *
+ * Each request first picks a size class in proportion to the weights, then
+ * a file within it by Zipf popularity: the k-th file listed is requested in
+ * proportion to 1 / k^exponent, so 0 is uniform. "name#N" stands for the N
+ * files name0 to name<N-1>, like the copies in WWW.
+ *
+ * An access log is replayed request by request at its original spacing.
+ * Lines are either "<seconds> <path>" or Common Log Format, whose request
+ * targets lose their leading / so they resolve like the file name argument.
+ *
+ * It has external linkage, since the client and its worker data point to one.
+ */
+class Workload
+{
+	private:
+
+	/**
+	 * @brief Files of a similar size and how often each is picked
+	 */
+	struct sizeClass
+	{
+		string name;
+		double weight;
+
+		///Most popular first
+		vector<string> files;
+
+		///The cumulative Zipf probability of each file
+		vector<double> cdf;
+
+		///Requests that picked this class
+		long picked;
+	};
+
+	vector<sizeClass> classes;
+
+	///The cumulative probability of each class
+	vector<double> classCdf;
+
+	double zipfExponent;
+
+	///The logged paths in order, empty unless replaying
+	vector<string> replayFiles;
+
+	///Nanoseconds after the first logged request that each was made
+	vector<long> replayTimes;
+
+	///Lines of the spec or log that couldn't be used
+	long skipped;
+
+	string source;
+
+	/**
+	 * @brief Finds the first entry of a cumulative distribution at or above a uniform draw
+	 */
+	static int sample(const vector<double>& cdf, unsigned short* seed)
+	{
+		double draw = erand48(seed) * cdf.back();
+		return min((int)(upper_bound(cdf.begin(), cdf.end(), draw) - cdf.begin()), (int)cdf.size() - 1);
+	}
+
+	/**
+	 * @brief Builds the cumulative distributions once every class is read
+	 */
+	void buildDistributions()
+	{
+		double total = 0;
+		for(size_t i = 0; i < classes.size(); i++)
+		{
+			total += classes[i].weight;
+			classCdf.push_back(total);
+
+			double popularity = 0;
+			for(size_t k = 1; k <= classes[i].files.size(); k++)
+			{
+				popularity += 1 / pow((double)k, zipfExponent);
+				classes[i].cdf.push_back(popularity);
+			}
+		}
+	}
+
+	/**
+	 * @brief Reads a Common Log Format line
+	 *
+	 * @return False if the line isn't a GET in that format
+	 */
+	static bool parseCommonLog(const string& line, long& nanos, string& path)
+	{
+		size_t open = line.find('[');
+		size_t quote = line.find('"');
+		if(open == string::npos || quote == string::npos) return false;
+
+		//The zone is ignored, since only the gaps between requests matter
+		struct tm stamp;
+		memset(&stamp, 0, sizeof(stamp));
+		if(strptime(line.c_str() + open + 1, "%d/%b/%Y:%H:%M:%S", &stamp) == NULL) return false;
+		nanos = (long)timegm(&stamp) * 1000000000L;
+
+		string method;
+		istringstream request(line.substr(quote + 1));
+		if(!(request >> method >> path) || method != "GET") return false;
+
+		if(path[0] == '/') path.erase(0, 1);
+		return path.length() > 0;
+	}
+
+	public:
+
+	Workload()
+	{
+		zipfExponent = ZIPFDEFAULT;
+		skipped = 0;
+	}
+
+	/**
+	 * @brief Reads a spec of size classes
+	 *
+	 * @return False if the file can't be read or names no files
+	 */
+	bool loadSpec(const char* path)
+	{
+		ifstream spec(path);
+		if(!spec) return false;
+
+		source = path;
+		string line;
+		while(getline(spec, line))
+		{
+			istringstream fields(line);
+			string directive;
+			if(!(fields >> directive) || directive[0] == '#') continue;
+
+			if(directive == "zipf" && fields >> zipfExponent)
+				continue;
+
+			sizeClass entry;
+			string file;
+			if(directive != "class" || !(fields >> entry.name >> entry.weight) || entry.weight <= 0)
+			{
+				skipped++;
+				continue;
+			}
+
+			while(fields >> file)
+			{
+				size_t mark = file.rfind('#');
+				if(mark == string::npos)
+				{
+					entry.files.push_back(file);
+					continue;
+				}
+
+				int copies = atoi(file.c_str() + mark + 1);
+				for(int i = 0; i < copies; i++)
+					entry.files.push_back(file.substr(0, mark) + to_string(i));
+			}
+
+			entry.picked = 0;
+			if(entry.files.empty()) skipped++;
+			else classes.push_back(entry);
+		}
+
+		buildDistributions();
+		return !classes.empty();
+	}
+
+	/**
+	 * @brief Reads an access log to replay
+	 *
+	 * @return False if the file can't be read or has no usable requests
+	 */
+	bool loadLog(const char* path)
+	{
+		ifstream log(path);
+		if(!log) return false;
+
+		source = path;
+		string line;
+		long first = 0;
+		while(getline(log, line))
+		{
+			if(line.find_first_not_of(" \t\r") == string::npos) continue;
+
+			long nanos;
+			string file;
+			if(!parseCommonLog(line, nanos, file))
+			{
+				double seconds;
+				istringstream fields(line);
+				if(!(fields >> seconds >> file))
+				{
+					skipped++;
+					continue;
+				}
+				nanos = (long)(seconds * 1e9);
+			}
+
+			if(replayFiles.empty()) first = nanos;
+
+			//Logs written as requests finish can be slightly out of order; the schedule can't go backwards
+			long offset = nanos - first;
+			if(!replayTimes.empty()) offset = max(offset, replayTimes.back());
+
+			replayFiles.push_back(file);
+			replayTimes.push_back(offset);
+		}
+
+		return !replayFiles.empty();
+	}
+
+	bool isReplay()
+	{
+		return !replayFiles.empty();
+	}
+
+	/**
+	 * @brief The number of logged requests to replay
+	 */
+	long size()
+	{
+		return replayFiles.size();
+	}
+
+	/**
+	 * @brief Lays out when each logged request should be sent
+	 *
+	 * @return Nanoseconds after the start for each request, in order, for the caller to delete
+	 */
+	long* buildSchedule()
+	{
+		long* schedule = new long[replayTimes.size()];
+		copy(replayTimes.begin(), replayTimes.end(), schedule);
+		return schedule;
+	}
+
+	/**
+	 * @brief Chooses the file a request asks for
+	 *
+	 * @param seed The calling thread's erand48 state
+	 * @param index The request's place in the schedule when replaying
+	 */
+	string pick(unsigned short* seed, long index)
+	{
+		if(isReplay())
+			return replayFiles[index % replayFiles.size()];
+
+		sizeClass& chosen = classes[sample(classCdf, seed)];
+		__sync_fetch_and_add(&chosen.picked, 1);
+
+		return chosen.files[sample(chosen.cdf, seed)];
+	}
+
+	/**
+	 * @brief Prints the mix, and how many requests each class got since the last print
+	 */
+	void print()
+	{
+		if(isReplay())
+		{
+			cout << "Replay: " << source << "\t" << replayFiles.size() << " requests over " << replayTimes.back() / 1e9 << " s\t" << "skipped lines: " << skipped << endl;
+			return;
+		}
+
+		cout << "Workload: " << source << "\t" << "zipf " << zipfExponent << "\t" << "skipped lines: " << skipped << endl;
+		for(size_t i = 0; i < classes.size(); i++)
+		{
+			cout << "Class " << classes[i].name << ": weight " << classes[i].weight << "\t" << classes[i].files.size() << " files\t" << "requests: " << classes[i].picked << endl;
+			classes[i].picked = 0;
+		}
+	}
+};
+#endif
@@ -0,0 +1,8 @@
+# Mostly small files, a few large ones, each class skewed towards its first copies
+zipf 1.0
+class 256b 40 256b.txt#10
+class 1k 30 1k.txt#10
+class 4k 15 4k.txt#10
+class 32k 10 32k.txt#10
+class 256k 4 256k.txt#10
+class 1mb 1 1mb.txt#10